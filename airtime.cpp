@@ -0,0 +1,158 @@
+#include "Arduino.h"
+
+#include "airtime.h"
+
+namespace PDP {
+
+Airtime Air;
+#ifdef ON_PC
+Airtime AirtimeTotal;
+#endif
+
+// payload bytes of each packet of a multipart message
+static const uint8_t PART_PAYLOAD = 32 - 3;
+
+// x * 1000 / ms, in 32 bits
+static uint32_t perSecond(uint32_t x, uint32_t ms) {
+  while (ms > 0xFFFFFFFF / 1000) {
+    ms >>= 1;
+    x >>= 1;
+  }
+  return x / ms * 1000 + x % ms * 1000 / ms;
+}
+
+// print thousandths as a percentage with one decimal
+static void printPermille(uint16_t p) {
+  Serial.print(p / 10);
+  Serial.print(F("."));
+  Serial.print(p % 10);
+}
+
+Airtime::Airtime()
+    : Heard(0), Duplicate(0), Duration(0), start(0), packetMicros(0) {
+  memset(this->Amount, 0, sizeof(this->Amount));
+}
+
+void Airtime::Begin(rf24_datarate_e rate) {
+  *this = Airtime();
+  // preamble, address, packet control field, payload and 1 byte CRC
+  uint16_t bits = 8 * (1 + 5 + 32 + 1) + 9;
+  if (rate == RF24_250KBPS) {
+    this->packetMicros = bits * 4;
+  } else if (rate == RF24_2MBPS) {
+    // 2 byte preamble
+    this->packetMicros = (bits + 8 + 1) / 2;
+  } else {
+    this->packetMicros = bits;
+  }
+  this->start = millis();
+}
+
+void Airtime::Sent(AirCategory_t category, uint16_t packets,
+                   uint16_t useful) {
+  uint32_t bytes = (uint32_t)packets * 32;
+  this->Amount[AIR_CHUNK] += useful;
+  this->Amount[category] += bytes - useful;
+  this->Amount[AIR_COPIES] += bytes * (RETRANSMITS - 1);
+}
+
+void Airtime::Received(uint8_t seq) {
+  // every part of a message has a sequence number below the next message
+  // type's first
+  if (seq < SEQ_CHAIN_START) {
+    this->Amount[AIR_CONTROL] += 32;
+  } else {
+    this->Amount[seq < SEQ_CHUNK_START ? AIR_CHAIN : AIR_CHUNK_OTHER] += 32;
+    this->Heard += 32;
+  }
+  // the radio drops the copies, but they were on the air
+  this->Amount[AIR_COPIES] += 32 * (RETRANSMITS - 1);
+}
+
+void Airtime::Saved(uint16_t useful) {
+  this->Amount[AIR_CHUNK_OTHER] -= useful;
+  this->Amount[AIR_CHUNK] += useful;
+}
+
+void Airtime::Repeated(uint32_t messageLength) {
+  this->Duplicate += (messageLength + PART_PAYLOAD - 1) / PART_PAYLOAD * 32;
+}
+
+void Airtime::Waited(AirCategory_t interval, uint32_t ms) {
+  this->Amount[interval] += ms;
+}
+
+void Airtime::End() {
+  this->Duration = millis() - this->start;
+#ifdef ON_PC
+  AirtimeTotal.Add(*this);
+#endif
+  this->Print();
+}
+
+uint16_t Airtime::Permille(AirCategory_t category) const {
+  uint32_t ms = this->Amount[category], packets;
+  if (this->Duration == 0) {
+    return 0;
+  }
+  if (category < AIR_INTERVALS) {
+    packets = ms / 32;
+    ms = packets / 1000 * this->packetMicros +
+         packets % 1000 * this->packetMicros / 1000;
+  }
+  return ms < this->Duration ? perSecond(ms, this->Duration) : 1000;
+}
+
+uint16_t Airtime::Idle() const {
+  uint16_t busy = 0;
+  for (uint8_t c = 0; c < AIR_CATEGORY_COUNT; c++) {
+    busy += this->Permille((AirCategory_t)c);
+  }
+  return busy < 1000 ? 1000 - busy : 0;
+}
+
+uint32_t Airtime::Goodput() const {
+  if (this->Duration == 0) {
+    return 0;
+  }
+  return perSecond(this->Amount[AIR_CHUNK], this->Duration);
+}
+
+void Airtime::Add(const Airtime &other) {
+  for (uint8_t c = 0; c < AIR_CATEGORY_COUNT; c++) {
+    this->Amount[c] += other.Amount[c];
+  }
+  this->Heard += other.Heard;
+  this->Duplicate += other.Duplicate;
+  this->Duration += other.Duration;
+  this->packetMicros = other.packetMicros;
+}
+
+void Airtime::Print() const {
+  Serial.print(F("AIR ms "));
+  Serial.print(this->Duration);
+  Serial.print(F(" goodput B/s "));
+  Serial.print(this->Goodput());
+  // efficiency is the share of the session carrying chunk contents
+  Serial.print(F(" eff % "));
+  printPermille(this->Permille(AIR_CHUNK));
+  Serial.println();
+  // shares in AirCategory_t order
+  Serial.print(F("AIR % chunk/other/chain/ctl/copies/listen/carrier/idle"));
+  for (uint8_t c = 0; c < AIR_CATEGORY_COUNT; c++) {
+    Serial.print(F(" "));
+    printPermille(this->Permille((AirCategory_t)c));
+  }
+  Serial.print(F(" "));
+  printPermille(this->Idle());
+  Serial.println();
+  if (this->Heard > 0) {
+    Serial.print(F("AIR dup % "));
+    printPermille(perSecond(this->Duplicate < this->Heard ? this->Duplicate
+                                                          : this->Heard,
+                            this->Heard));
+    Serial.println();
+  }
+}
+
+} // namespace PDP
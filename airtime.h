@@ -0,0 +1,88 @@
+#ifndef AIRTIME_H
+#define AIRTIME_H
+
+#include "RF24.h"
+#include "consts.h"
+#include "stdint.h"
+
+namespace PDP {
+
+// What a transfer session's time went on. Packets sent and heard are counted
+// in bytes, 32 to a packet, and intervals in milliseconds.
+typedef enum {
+  // chunk contents: sent, or heard and saved
+  AIR_CHUNK = 0,
+  // the rest of data chunk messages: chunk and multipart headers, padding of
+  // the last packet, and chunks heard but not saved
+  AIR_CHUNK_OTHER,
+  // hash chain messages
+  AIR_CHAIN,
+  // listen period announcements, requests and yield acknowledgements
+  AIR_CONTROL,
+  // the RETRANSMITS - 1 extra copies of every packet
+  AIR_COPIES,
+  // intervals: listening for requests or a yield acknowledgement as TX, and
+  // waiting for a request slot as RX
+  AIR_LISTEN,
+  // listening for interference before and between chunk bursts
+  AIR_CARRIER,
+  AIR_CATEGORY_COUNT,
+} AirCategory_t;
+
+// first interval category
+const uint8_t AIR_INTERVALS = AIR_LISTEN;
+
+class Airtime {
+public:
+  // bytes of packet categories, milliseconds of intervals
+  uint32_t Amount[AIR_CATEGORY_COUNT];
+  // bytes of hash chains and data chunks heard, and of those already known
+  uint32_t Heard, Duplicate;
+  // length of the session in milliseconds, once ended
+  uint32_t Duration;
+
+  Airtime();
+  // Begin a session, with packets sent at rate, forgetting the last one
+  void Begin(rf24_datarate_e rate);
+  // Count a message of the given category sent in packets, useful bytes of
+  // which are chunk contents
+  void Sent(AirCategory_t category, uint16_t packets, uint16_t useful);
+  // Count a packet heard, classified by its sequence number
+  void Received(uint8_t seq);
+  // Count useful bytes of a data chunk just heard as chunk contents
+  void Saved(uint16_t useful);
+  // Count a hash chain or data chunk of messageLength bytes heard, that was
+  // already known
+  void Repeated(uint32_t messageLength);
+  void Waited(AirCategory_t interval, uint32_t ms);
+  // End the session: print its summary, and add it to AirtimeTotal on the
+  // host
+  void End();
+  // Share of the session spent on category, in thousandths. Packets heard
+  // during listen periods are counted in both.
+  uint16_t Permille(AirCategory_t category) const;
+  // Share of the session not spent on any category, in thousandths: idle, or
+  // reading and writing the SD card
+  uint16_t Idle() const;
+  // chunk contents sent or saved per second
+  uint32_t Goodput() const;
+  void Add(const Airtime &other);
+  void Print() const;
+
+private:
+  uint32_t start;
+  // airtime of one packet, in microseconds
+  uint16_t packetMicros;
+};
+
+// the transfer session in progress, begun by each transmitter and receiver
+extern Airtime Air;
+#ifdef ON_PC
+// every session since power on, for the host simulator. A unit only prints
+// each session.
+extern Airtime AirtimeTotal;
+#endif
+
+} // namespace PDP
+
+#endif // AIRTIME_H
@@ -0,0 +1,141 @@
+#include "channels.h"
+#include "radiorx.h"
+#include "util.h"
+
+namespace PDP {
+
+uint8_t CandidateChannel(uint8_t n) { return n * CHANNEL_SPACING; }
+
+// moving average of samples, each weighing 1/8. The step is rounded away
+// from zero, so x settles on a steady sample, 0 included. Returns true if x
+// changed.
+static bool average(uint8_t &x, uint8_t sample) {
+  int16_t d = (int16_t)sample - x;
+  if (d == 0) {
+    return false;
+  }
+  x += (d + (d > 0 ? 7 : -7)) / 8;
+  return true;
+}
+
+ChannelTable::ChannelTable() : dirty(false) {
+  memset(this->entries, 0, sizeof(this->entries));
+}
+
+void ChannelTable::Load(FatFileSystem &fs) {
+  FatFile f;
+  if (OpenFile(fs, CHANNEL_TABLE_FILENAME, f, O_READ)) {
+    // no history, all channels are equal
+    return;
+  }
+  if (f.read(this->entries, sizeof(this->entries)) != sizeof(this->entries)) {
+    memset(this->entries, 0, sizeof(this->entries));
+  }
+  f.close();
+}
+
+void ChannelTable::Save(FatFileSystem &fs) {
+  FatFile f;
+  if (!this->dirty ||
+      OpenFile(fs, CHANNEL_TABLE_FILENAME, f, O_CREAT | O_RDWR)) {
+    return;
+  }
+  if (f.write(this->entries, sizeof(this->entries)) ==
+      sizeof(this->entries)) {
+    this->dirty = false;
+  }
+  f.close();
+}
+
+uint8_t ChannelTable::index(uint8_t ch) {
+  if (ch % CHANNEL_SPACING || ch / CHANNEL_SPACING >= CHANNEL_COUNT) {
+    return CHANNEL_COUNT;
+  }
+  return ch / CHANNEL_SPACING;
+}
+
+void ChannelTable::SampleBusy(uint8_t ch, uint8_t busy, uint8_t total) {
+  uint8_t n = this->index(ch);
+  if (n == CHANNEL_COUNT || total == 0) {
+    return;
+  }
+  this->dirty |= average(this->entries[n].busy, (uint16_t)busy * 255 / total);
+}
+
+void ChannelTable::Sample(RF24 &radio, uint8_t ch) {
+  uint8_t prev = radio.getChannel(), busy = 0;
+  radio.setChannel(ch);
+  for (uint8_t i = 0; i < 10; i++) {
+    radio.startListening();
+    delayMicroseconds(128);
+    radio.stopListening();
+    if (radio.testCarrier()) {
+      busy++;
+    }
+  }
+  radio.setChannel(prev);
+  // packets heard on ch were not meant for this channel's session
+  RadioRxPoll(radio);
+  RxRing.Clear();
+  this->SampleBusy(ch, busy, 10);
+}
+
+void ChannelTable::Transfer(uint8_t ch, uint16_t ok, uint16_t dropped) {
+  uint8_t n = this->index(ch);
+  if (n == CHANNEL_COUNT) {
+    return;
+  }
+  if (ok + dropped == 0) {
+    // nothing heard
+    this->dirty |= average(this->entries[n].activity, 0);
+    return;
+  }
+  this->dirty |= average(this->entries[n].activity, 255);
+  this->dirty |= average(this->entries[n].dropped,
+                         (uint32_t)dropped * 255 / (ok + dropped));
+}
+
+void ChannelTable::Transmitted(uint8_t ch, bool interference) {
+  uint8_t n = this->index(ch);
+  if (n == CHANNEL_COUNT) {
+    return;
+  }
+  this->dirty |=
+      average(this->entries[n].interference, interference ? 255 : 0);
+}
+
+uint16_t ChannelTable::cost(uint8_t n) {
+  return this->entries[n].busy +
+         CHANNEL_DROP_WEIGHT * this->entries[n].dropped +
+         CHANNEL_INTERFERENCE_WEIGHT * this->entries[n].interference;
+}
+
+uint8_t ChannelTable::Quietest() {
+  uint8_t best = 0;
+  for (uint8_t n = 1; n < CHANNEL_COUNT; n++) {
+    if (this->cost(n) < this->cost(best)) {
+      best = n;
+    }
+  }
+  return CandidateChannel(best);
+}
+
+uint8_t ChannelTable::Rank(uint8_t n) {
+  uint8_t order[CHANNEL_COUNT], i, j, t;
+  int16_t pref[CHANNEL_COUNT];
+  // most activity first, then least cost
+  for (i = 0; i < CHANNEL_COUNT; i++) {
+    order[i] = i;
+    pref[i] = 4 * (int16_t)this->entries[i].activity - this->cost(i);
+  }
+  for (i = 1; i < CHANNEL_COUNT; i++) {
+    for (j = i; j > 0 && pref[order[j]] > pref[order[j - 1]]; j--) {
+      t = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = t;
+    }
+  }
+  return CandidateChannel(order[n % CHANNEL_COUNT]);
+}
+
+} // namespace PDP
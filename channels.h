@@ -0,0 +1,62 @@
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include "RF24.h"
+#include "SdFat.h"
+#include "consts.h"
+
+namespace PDP {
+
+// Returns the radio channel of candidate channel n (0 <= n < CHANNEL_COUNT)
+uint8_t CandidateChannel(uint8_t n);
+
+// ChannelTable keeps a quality record for each of the CHANNEL_COUNT candidate
+// channels stations meet on. It is kept on the SD card across power cycles.
+//
+// Each field is a moving average scaled to 0..255, so old events fade as new
+// samples arrive.
+class ChannelTable {
+public:
+  ChannelTable();
+  void Load(FatFileSystem &fs);
+  // Write the table to the card if it has changed since it was last saved
+  void Save(FatFileSystem &fs);
+  // Record that carrier was detected busy samples times out of total on radio
+  // channel ch. Channels that are not candidates are ignored.
+  void SampleBusy(uint8_t ch, uint8_t busy, uint8_t total);
+  // Sample radio channel ch for carrier, then return the radio to its previous
+  // channel
+  void Sample(RF24 &radio, uint8_t ch);
+  // Record the multipart messages received ok and dropped on radio channel ch
+  void Transfer(uint8_t ch, uint16_t ok, uint16_t dropped);
+  // Record the end of a transmit session on radio channel ch, and whether it
+  // was ended by interference
+  void Transmitted(uint8_t ch, bool interference);
+  // Returns the radio channel with the least noise, failures and interference
+  uint8_t Quietest();
+  // Returns the radio channel to listen on n'th (0 <= n < CHANNEL_COUNT), the
+  // channels where transfers have worked best first
+  uint8_t Rank(uint8_t n);
+
+private:
+  struct {
+    // share of carrier samples busy
+    uint8_t busy;
+    // share of multipart messages dropped
+    uint8_t dropped;
+    // share of transmit sessions ended by interference
+    uint8_t interference;
+    // share of receive sessions with successful transfers
+    uint8_t activity;
+  } entries[CHANNEL_COUNT];
+  // entries changed since the last Save
+  bool dirty;
+  // candidate index of radio channel ch, or CHANNEL_COUNT if it is not one
+  uint8_t index(uint8_t ch);
+  // the lower the better
+  uint16_t cost(uint8_t n);
+};
+
+} // namespace PDP
+
+#endif // CHANNELS_H
@@ -0,0 +1,173 @@
+#include "RF24.h"
+#include "SdFat.h"
+
+#include "chunkindex.h"
+#include "util.h"
+
+namespace PDP {
+
+struct __attribute__((__packed__)) ChunkIndexRecord {
+  uint8_t prefix[CHUNK_INDEX_PREFIX];
+  // len is zero in unused records
+  ChunkLocation loc;
+};
+
+static bool readRecord(FatFile &f, uint16_t n, ChunkIndexRecord &rec) {
+  return f.seekSet((uint32_t)n * sizeof(rec)) &&
+         f.read(&rec, sizeof(rec)) == sizeof(rec);
+}
+
+static bool writeRecord(FatFile &f, uint16_t n, ChunkIndexRecord &rec) {
+  return f.seekSet((uint32_t)n * sizeof(rec)) &&
+         f.write(&rec, sizeof(rec)) == sizeof(rec);
+}
+
+// the first slot to search for chunkHash
+static uint16_t homeSlot(const uint8_t *chunkHash) {
+  // chunk hashes are uniformly distributed, so their first bytes make a good
+  // table index
+  return (chunkHash[0] | (chunkHash[1] << 8)) % CHUNK_INDEX_SLOTS;
+}
+
+static Error_t add(FatFile &f, const uint8_t *chunkHash, ChunkLocation &loc) {
+  ChunkIndexRecord rec;
+  uint16_t slot = homeSlot(chunkHash), n = slot;
+  for (uint8_t i = 0; i < CHUNK_INDEX_PROBES; i++) {
+    n = (slot + i) % CHUNK_INDEX_SLOTS;
+    if (!readRecord(f, n, rec)) {
+      return ERROR_IO_READ;
+    }
+    if (rec.loc.len == 0 ||
+        !memcmp(rec.prefix, chunkHash, CHUNK_INDEX_PREFIX)) {
+      // unused, or a previous location of this chunk
+      break;
+    }
+    // all probed slots are used, replace the first
+    n = slot;
+  }
+  memcpy(rec.prefix, chunkHash, CHUNK_INDEX_PREFIX);
+  rec.loc = loc;
+  if (!writeRecord(f, n, rec)) {
+    return ERROR_IO_WRITE;
+  }
+  return ERROR_NONE;
+}
+
+static Error_t addFile(FatFile &f, MerkleFile &m, uint16_t dirIndex) {
+  ChunkLocation loc;
+  uint32_t fileSize, chunkSize;
+  uint16_t numChunks, i;
+  Error_t err = ERROR_NONE;
+  m.ReadHeaderBlock();
+  if (m.Error) {
+    return m.Error;
+  }
+  fileSize = m.Block.HeaderBlock.fileSize;
+  chunkSize = m.Block.HeaderBlock.chunkSize;
+  numChunks = m.Block.HeaderBlock.numChunks;
+  loc.dirIndex = dirIndex;
+  for (i = 0; i < numChunks && !err; i++) {
+    m.ReadHashBlock(i);
+    if (m.Error) {
+      return m.Error;
+    }
+    if (!(m.Block.HashBlock.flags & MERKLE_CHUNK_COMPLETE)) {
+      continue;
+    }
+    loc.offset = i * chunkSize;
+    loc.len = (fileSize - loc.offset < chunkSize) ? fileSize - loc.offset
+                                                  : chunkSize;
+    err = add(f, m.Block.HashBlock.hash, loc);
+  }
+  return err;
+}
+
+bool ChunkIndexFind(FatFileSystem &fs, const uint8_t *chunkHash,
+                    ChunkLocation &loc) {
+  FatFile f;
+  bool found;
+  if (OpenFile(fs, CHUNK_INDEX_FILENAME, f, O_READ)) {
+    return false;
+  }
+  found = ChunkIndexFind(f, chunkHash, loc);
+  f.close();
+  return found;
+}
+
+bool ChunkIndexFind(FatFile &f, const uint8_t *chunkHash, ChunkLocation &loc) {
+  ChunkIndexRecord rec;
+  uint16_t slot = homeSlot(chunkHash);
+  for (uint8_t i = 0; i < CHUNK_INDEX_PROBES; i++) {
+    if (!readRecord(f, (slot + i) % CHUNK_INDEX_SLOTS, rec) ||
+        rec.loc.len == 0) {
+      break;
+    }
+    if (!memcmp(rec.prefix, chunkHash, CHUNK_INDEX_PREFIX)) {
+      loc = rec.loc;
+      return true;
+    }
+  }
+  return false;
+}
+
+Error_t ChunkIndexAdd(FatFileSystem &fs, const uint8_t *chunkHash,
+                      ChunkLocation &loc) {
+  FatFile f;
+  Error_t err;
+  if (OpenFile(fs, CHUNK_INDEX_FILENAME, f, O_RDWR)) {
+    return ERROR_IO_OPEN;
+  }
+  err = add(f, chunkHash, loc);
+  f.close();
+  return err;
+}
+
+Error_t ChunkIndexAddFile(FatFileSystem &fs, MerkleFile &m, uint16_t dirIndex) {
+  FatFile f;
+  Error_t err;
+  if (OpenFile(fs, CHUNK_INDEX_FILENAME, f, O_RDWR)) {
+    return ERROR_IO_OPEN;
+  }
+  err = addFile(f, m, dirIndex);
+  f.close();
+  return err;
+}
+
+Error_t ChunkIndexCheck(FatFileSystem &fs) {
+  FatFile f, dir, src;
+  MerkleFile m;
+  char filename[MAX_FILENAME_LENGTH + 1];
+  Error_t err;
+  if (fs.exists(CHUNK_INDEX_FILENAME)) {
+    return ERROR_NONE;
+  }
+  if (!fs.exists(STATE_DIR) && !fs.mkdir(STATE_DIR)) {
+    return ERROR_IO_CREATE;
+  }
+  Serial.println(F("Indexing chunks"));
+  // every slot starts unused
+  strcpy(filename, CHUNK_INDEX_FILENAME);
+  if ((err = Create(fs, f, filename,
+                    (uint32_t)CHUNK_INDEX_SLOTS * sizeof(ChunkIndexRecord),
+                    true))) {
+    return err;
+  }
+  // index every file in the root directory that has a valid merkle file
+  dir.openRoot(&fs);
+  while (!err && src.openNext(&dir, O_READ)) {
+    src.getName(filename, MAX_FILENAME_LENGTH + 1);
+    if (!IsMerkleFilename(filename)) {
+      ToMerkleFilename(filename);
+      m.Open(fs, filename);
+      if (!m.Error) {
+        err = addFile(f, m, src.dirIndex());
+      }
+    }
+    src.close();
+  }
+  dir.close();
+  f.close();
+  return err;
+}
+
+} // namespace PDP
@@ -0,0 +1,48 @@
+#ifndef CHUNKINDEX_H
+#define CHUNKINDEX_H
+
+#include "SdFat.h"
+#include "consts.h"
+#include "merkle.h"
+
+namespace PDP {
+
+// Where a chunk's contents can be found on the SD card
+struct __attribute__((__packed__)) ChunkLocation {
+  // directory index, in the root directory, of the file holding the chunk
+  uint16_t dirIndex;
+  // position and length of the chunk in that file
+  uint32_t offset;
+  uint16_t len;
+};
+
+// The chunk index is a file on the SD card mapping the hashes of complete
+// chunks of local files to their locations, so a chunk another file already
+// holds can be copied instead of received.
+//
+// It is a hash table of CHUNK_INDEX_SLOTS fixed size records, keyed by the
+// first CHUNK_INDEX_PREFIX bytes of the chunk hash. Collisions are resolved
+// by probing the next CHUNK_INDEX_PROBES slots. When they are all used the
+// first is replaced, so the index may forget chunks but never grows.
+// Locations may be stale, so copied chunks must be verified.
+
+// Find a location of the chunk with hash chunkHash. Returns false if there is
+// none.
+bool ChunkIndexFind(FatFileSystem &fs, const uint8_t *chunkHash,
+                    ChunkLocation &loc);
+// As above, in the chunk index already open as f, so a batch of chunks can be
+// looked up with the file opened once
+bool ChunkIndexFind(FatFile &f, const uint8_t *chunkHash, ChunkLocation &loc);
+// Record loc as a location of the chunk with hash chunkHash
+Error_t ChunkIndexAdd(FatFileSystem &fs, const uint8_t *chunkHash,
+                      ChunkLocation &loc);
+// Record every complete chunk of the file with directory index dirIndex,
+// whose merkle file is m. Clobbers m's Block.
+Error_t ChunkIndexAddFile(FatFileSystem &fs, MerkleFile &m, uint16_t dirIndex);
+// Create the chunk index from the merkle files in the root directory if it
+// does not exist
+Error_t ChunkIndexCheck(FatFileSystem &fs);
+
+} // namespace PDP
+
+#endif // CHUNKINDEX_H
@@ -24,6 +24,7 @@ typedef enum {
   ERROR_TX_INTERFERENCE,
   ERROR_MULTIPART_BAD_SEQUENCE,
   ERROR_REFUSE_MERKLE,
+  ERROR_MERKLE_INCOMPLETE,
 } Error_t;
 
 const uint32_t MAX_CHUNK_SIZE = 384;
@@ -32,11 +33,48 @@ const uint32_t MAX_FILE_SIZE =
     (1 << MAX_TREE_DEPTH) *
     MAX_CHUNK_SIZE; // TODO test with files in range [0,MAX_FILE_SIZE) or ]
 const uint8_t RETRANSMITS = 3;
-const uint8_t PROTOCOL_VERSION = 1;
+// Bytes of a multipart message carried by each 32 byte packet
+const uint8_t PACKET_PAYLOAD = 29;
+// If true, the chunk size of each local file is chosen from its size by
+// ChooseChunkSize. Otherwise every file uses MAX_CHUNK_SIZE.
+const bool AUTO_CHUNK_SIZE = true;
+const uint8_t PROTOCOL_VERSION = 4;
 const uint8_t MAX_FILENAME_LENGTH = 32;
 
 const uint16_t MAX_STATION_ID = 0xffff;
 
+// Directory holding the station's own state files. Only files in the root
+// directory are broadcast.
+const char STATE_DIR[] = "PDP";
+// Root hash to filename index, and the number of root hash bytes it keys on
+const char ROOT_INDEX_FILENAME[] = "PDP/ROOTS.IDX";
+const uint8_t ROOT_INDEX_PREFIX = 8;
+// Chunk hash to chunk location index, the number of chunk hash bytes it keys
+// on, its size in records and the number of records searched for a chunk
+const char CHUNK_INDEX_FILENAME[] = "PDP/CHUNKS.IDX";
+const uint8_t CHUNK_INDEX_PREFIX = 8;
+const uint16_t CHUNK_INDEX_SLOTS = 4096;
+const uint8_t CHUNK_INDEX_PROBES = 4;
+// Number of chunks an RX station looks up in the chunk index together, once
+// their hash chains are verified
+const uint8_t COPY_BATCH = 8;
+// Channel quality table
+const char CHANNEL_TABLE_FILENAME[] = "PDP/CHANNELS.DAT";
+// RX session journal, and the number of records it holds before starting over
+const char JOURNAL_FILENAME[] = "PDP/SESSION.JNL";
+const uint8_t JOURNAL_MAX_RECORDS = 64;
+// Number of chunks an RX station receives between session journal records
+const uint8_t JOURNAL_INTERVAL = 16;
+
+// Stations meet on CHANNEL_COUNT candidate channels, CHANNEL_SPACING apart
+// starting at channel 0
+const uint8_t CHANNEL_COUNT = 8;
+const uint8_t CHANNEL_SPACING = 16;
+// Weight of dropped messages and interference against carrier busy rate when
+// choosing a channel
+const uint8_t CHANNEL_DROP_WEIGHT = 2;
+const uint8_t CHANNEL_INTERFERENCE_WEIGHT = 4;
+
 typedef enum {
   // In RX context: don't want to request yield
   // In TX context: file is complete and don't want to offer yield
@@ -49,15 +87,119 @@ typedef enum {
   YIELD_GRANTED,
 } YieldState_t;
 
-// TODO rename MAX_CHUNKQUEUE_LEN
-const uint8_t REQ_QUEUE_LEN = 8;
+// Maximum number of runs of consecutive chunks in a ChunkSet
+const uint8_t MAX_CHUNKSET_RANGES = 8;
+// Number of chunks, from its lowest one, a ChunkSet stored as a bitmap can
+// hold. The bitmap takes the place of the runs.
+const uint16_t CHUNKSET_BITMAP_CHUNKS = (MAX_CHUNKSET_RANGES * 4 - 2) * 8;
+
+// Maximum number of missing chunks added to a ChunkSet in one scan of the
+// merkle file. Bounds the time spent reading leaf hash blocks, which is about a
+// millisecond per chunk, now that a bitmap lets scattered chunks fill the set.
+// A TX keeps no more than SCHED_LEN requested ranges anyway.
+const uint16_t MAX_MISSING_SCAN = 16;
+
+// Maximum number of chunks missing from a TX station that an RX station
+// checks for in its own copy, when deciding whether to request a yield
+const uint8_t MAX_YIELD_SCAN = 32;
+
+// Number of times a TX station offers a channel yield, and how long it waits
+// for the RX station to accept each offer (milliseconds)
+const uint8_t YIELD_TRIES = 5;
+const uint16_t YIELD_ACK_TIMEOUT = 30;
+// Number of root hash bytes in a yield acknowledgement. Kept short so the
+// acknowledgement fits in one packet.
+const uint8_t YIELD_ACK_HASH_LEN = 16;
+
+// Number of distinct requested chunks a transmitter keeps pending
+const uint8_t SCHED_LEN = 16;
+// Number of recently sent chunks the background sweep skips
+const uint8_t SCHED_RECENT_LEN = 8;
+// Priority of a pending request is demand * SCHED_DEMAND_WEIGHT + age, where
+// demand is the number of stations asking for it and age the number of other
+// requests served while it waited
+const uint8_t SCHED_DEMAND_WEIGHT = 4;
+
+// Maximum number of requested chunks a transmitter sends between two runs of
+// the background sweep
+const uint8_t SCHED_BURST = 8;
+// Bytes of consecutive chunks the background sweep sends as a run, so their
+// data is read from the SD card in whole sectors. A run has as many chunks of
+// the file's chunk size as fill it, at most SCHED_BURST: 4 chunks of
+// MAX_CHUNK_SIZE bytes, exactly 3 sectors.
+const uint16_t SCHED_RUN_BYTES = 1536;
 
-// TX request listen duration in milliseconds
-const uint16_t LISTEN_DURATION = 100;
+// Maximum number of files a TX station broadcasts in one carousel session
+const uint8_t CAROUSEL_FILES = 8;
+// Number of background sweep steps given to each file in a carousel round,
+// doubled for each level of demand up to CAROUSEL_DEMAND_MAX
+const uint8_t CAROUSEL_SLICE = 8;
+const uint8_t CAROUSEL_DEMAND_MAX = 3;
+
+// Number of recently completed files a receiver ignores in a carousel
+const uint8_t RX_DONE_LEN = 8;
+
+// When received chunk data is made durable. A chunk is only marked complete
+// in its merkle file once its data is durable.
+typedef enum {
+  // after every chunk
+  DURABLE_CHUNK = 0,
+  // after every SAVE_BATCH chunks, and whenever the RX is idle
+  DURABLE_BATCH,
+} Durability_t;
+const Durability_t DURABILITY = DURABLE_BATCH;
+const uint8_t SAVE_BATCH = 8;
+
+// Number of received packets buffered between the radio IRQ and the protocol
+// code. Must be a power of 2.
+const uint8_t RX_RING_LEN = 8;
+// A packet with the same sequence number and message id as the last one, heard
+// within this many microseconds of it, is one of its RETRANSMITS copies. The
+// copies are sent back to back, so this is a little over one packet's airtime
+// at 250 kbps.
+const uint16_t RX_COPY_WINDOW = 2000;
+
+// A TX request listen period is divided into slots of REQ_SLOT_DURATION
+// milliseconds, long enough for one request. The first REQ_CONTENTION_SLOTS
+// are shared by RX stations the TX has not heard from recently, each picking
+// one at random, and backing off up to REQ_BACKOFF_MAX times until it is heard.
+// The rest belong to REQ_SLOTS of the up to REQ_STATIONS stations the TX
+// has heard from, one each, taken in turn so every station has a slot at
+// least once in REQ_STATIONS / REQ_SLOTS listen periods. A station is dropped
+// after REQ_SLOT_EXPIRY slots without a request.
+const uint8_t REQ_SLOT_DURATION = 20;
+const uint8_t REQ_CONTENTION_SLOTS = 2;
+const uint8_t REQ_SLOTS = 8;
+const uint8_t REQ_STATIONS = 32;
+const uint8_t REQ_SLOT_EXPIRY = 4;
+const uint8_t REQ_BACKOFF_MAX = 4;
+// An RX flushes saved chunks before its request only if its slot is at least
+// this many milliseconds away, otherwise after the request, so an SD card
+// sync never pushes a request out of its slot
+const uint8_t REQ_FLUSH_TIME = 60;
+// An RX updates its missing list before its request only if its slot is at
+// least this many milliseconds away, otherwise it requests with the list it
+// has and updates it after. Scanning the Merkle file takes longer than a slot.
+const uint8_t REQ_UPDATE_TIME = 40;
+// Maximum number of chunks a TX station sends between listen periods, not
+// counting the rest of a sweep run. The
+// interval starts at 1, doubles after each listen period with no requests
+// and drops back to 1 when a request is heard.
+const uint8_t LISTEN_INTERVAL_MAX = 16;
+// Milliseconds a TX station listens for interference after each chunk burst.
+// RX stations verify and save the burst meanwhile, so the check is not cut
+// short when the channel is quiet.
+const uint8_t CARRIER_CHECK_TIME = 100;
 
 const uint8_t BLOCK_INVALID = 0;
 const uint8_t BLOCK_HEADER = 1;
 const uint8_t BLOCK_HASH = 2;
+// header of a merkle file still being built from its local file
+const uint8_t BLOCK_HEADER_PARTIAL = 3;
+
+// Number of merkle file blocks built from a local file in each slice of
+// background indexing
+const uint16_t INDEX_SLICE = 32;
 
 const uint8_t MODE_TRANSMIT = 1;
 const uint8_t MODE_RECEIVE = 2;
@@ -66,6 +208,7 @@ const uint8_t SEQ_CHAIN_START = 32;
 const uint8_t SEQ_CHAIN_FINAL = 32 + MAX_TREE_DEPTH - 1;
 const uint8_t SEQ_CHUNK_START = 64;
 const uint8_t SEQ_TAKING_REQS = 0; // TX is entering request listen period
+const uint8_t SEQ_YIELD_ACK = 16; // RX accepts the channel TX yielded to it
 const uint8_t SEQ_MAKING_REQ =
     8; // RX is making a request during TX's listen period
 
@@ -1,8 +1,15 @@
 #include "driver.h"
+#include "journal.h"
+#include "metrics.h"
 #include "power.h"
 #include "pdp.h"
+#include "radiorx.h"
+#include "rootindex.h"
+#include "util.h"
 
 static bool IncrementChannel;
+// Ranked channels listened on since the last broadcast, or channels moved to
+// while broadcasting
 static uint8_t ChannelsTried;
 
 static bool Transmitting;
@@ -10,18 +17,59 @@ static bool Transmitting;
 // The file being broadcast or received. If not open, receive first transmission
 // heard.
 static FatFile f;
+// The merkle file of f. Kept open with f across role switches.
+static PDP::MerkleFile merkle;
 
-void DoChannelIncrement() {
-  uint8_t nextChannel = radio.getChannel() + 1;
-  if (nextChannel > CHANNEL_MAX) {
-    nextChannel = 0;
-  }
-  ChannelsTried++;
-  radio.setChannel(nextChannel);
+// The channel was just yielded to this station
+static bool TakingOver;
+// This station just yielded the channel, and listens to the station it gave
+// it to
+static bool HandedOver;
+
+void CloseFile() {
+  f.close();
+  merkle.Close();
+}
+
+// The next candidate channel to sample in the background
+static uint8_t SampleNext;
+
+void SetChannel(uint8_t channel) {
+  radio.setChannel(channel);
   radio.openWritingPipe((uint8_t *)"BROAD");
   radio.openReadingPipe(1, (uint8_t *)"BROAD");
   Serial.print(F("Channel "));
-  Serial.println(nextChannel);
+  Serial.println(channel);
+}
+
+void DoChannelIncrement() {
+  // listen on the channels where transfers have worked best first
+  SetChannel(channels.Rank(ChannelsTried));
+  ChannelsTried++;
+}
+
+// The receive session interrupted by the last power off or reset
+static PDP::JournalRecord Session;
+static bool Resuming;
+
+void ResumeSession() {
+  char filename[PDP::MAX_FILENAME_LENGTH + 1];
+  if (!PDP::JournalLoad(sd, Session) ||
+      !PDP::RootIndexFind(sd, Session.rootHash, filename) ||
+      PDP::OpenFile(sd, filename, f, O_RDWR)) {
+    return;
+  }
+  // listen for the file where its TX was last heard
+  Serial.print(F("Resume "));
+  Serial.println(filename);
+  Serial.print(F("TX/missing/from "));
+  Serial.print(Session.txStationId);
+  Serial.print(F(" "));
+  Serial.print(Session.missingCount);
+  Serial.print(F(" "));
+  Serial.println(Session.missingFirst);
+  Resuming = true;
+  SetChannel(Session.channel);
 }
 
 void PrintFilename(FatFile &f) {
@@ -30,23 +78,91 @@ void PrintFilename(FatFile &f) {
   Serial.println(filename);
 }
 
-void OpenNext() {
-  static FatFile srcDir;
-  if (!srcDir.isOpen()) {
-    srcDir.openRoot(&sd);
-    srcDir.rewind();
+// The directory broadcast by carousel sessions
+static FatFile srcDir;
+
+// Background indexing walks the root directory building the merkle files of
+// local files, a slice at a time. IndexFile is the directory index of a file
+// left partly indexed by the last slice.
+static FatFile IndexDir;
+static uint16_t IndexFile;
+static bool IndexBusy;
+// No file needed indexing since the walk last began, and the walk is done
+static bool IndexIdle;
+static bool IndexDone;
+
+void IndexSlice() {
+  FatFile src;
+  PDP::MerkleFile m;
+  char filename[PDP::MAX_FILENAME_LENGTH + 1];
+  uint16_t steps = PDP::INDEX_SLICE;
+  if (IndexDone) {
+    return;
+  }
+  if (!IndexDir.isOpen()) {
+    IndexDir.openRoot(&sd);
   }
-  if (!f.openNext(&srcDir, O_READ)) {
-    srcDir.rewind();
-    f.openNext(&srcDir, O_READ);
+  if (IndexBusy) {
+    IndexBusy = src.open(&IndexDir, IndexFile, O_READ);
   }
+  if (!IndexBusy && !src.openNext(&IndexDir, O_READ)) {
+    // end of the directory. files only appear locally when received, with
+    // their merkle files, so one walk with nothing to index is enough.
+    if (IndexIdle) {
+      IndexDone = true;
+      IndexDir.close();
+      Serial.println(F("Indexed"));
+    }
+    IndexDir.rewind();
+    IndexIdle = true;
+    return;
+  }
+  src.getName(filename, PDP::MAX_FILENAME_LENGTH + 1);
+  if (src.isFile() && !PDP::IsMerkleFilename(filename)) {
+    PDP::ToMerkleFilename(filename);
+    IndexBusy = !m.Build(sd, filename, src, steps) && !m.Error;
+    IndexFile = src.dirIndex();
+    if (steps < PDP::INDEX_SLICE) {
+      IndexIdle = false;
+    }
+  } else {
+    IndexBusy = false;
+  }
+  src.close();
 }
 
 void Broadcast() {
-  PDP::Transmitter t(radio, sd, f);
-  Serial.print(F("TX "));
-  PrintFilename(f);
-  t.Broadcast();
+  PDP::Transmitter t(radio, sd, f, merkle);
+  if (TakingOver) {
+    // begin at once, the previous TX station is waiting for this broadcast
+    TakingOver = false;
+    Serial.print(F("TX takeover "));
+    PrintFilename(f);
+    t.TakeOver();
+  } else if (f.isOpen()) {
+    // broadcast the file the channel was yielded for, or that was interrupted
+    Serial.print(F("TX "));
+    PrintFilename(f);
+    t.Broadcast();
+  } else {
+    // broadcast the next few files in srcDir
+    if (!srcDir.isOpen()) {
+      srcDir.openRoot(&sd);
+    }
+    Serial.println(F("TX carousel"));
+    t.Carousel(srcDir);
+  }
+  channels.Transmitted(radio.getChannel(),
+                       t.Error == PDP::ERROR_TX_INTERFERENCE);
+  Serial.print(F("TX/listen ms "));
+  Serial.print(t.TxMillis);
+  Serial.print(F(" "));
+  Serial.println(t.ListenMillis);
+  Serial.print(F("REQ heard/dropped "));
+  Serial.print(t.RequestsHeard);
+  Serial.print(F(" "));
+  Serial.println(t.RequestsDropped);
+  PDP::Air.End();
   if (FlagShutdown) {
     return;
   }
@@ -56,20 +172,23 @@ void Broadcast() {
     Serial.println(F("interference"));
     if (random(0, 10) >= 1) {
       Transmitting = false;
-      f.close();
+      CloseFile();
     } else {
       delay(random(0, 1000));
-      IncrementChannel = true;
-      if (ChannelsTried > CHANNEL_MAX) {
+      // move to the quietest channel, which this one no longer is
+      ChannelsTried++;
+      SetChannel(channels.Quietest());
+      if (ChannelsTried >= CHANNEL_SCAN) {
         // all channels full, give up TX
-        f.close();
+        CloseFile();
         Transmitting = false;
         ChannelsTried = 0;
       }
     }
-  } else if (t.Error == PDP::ERROR_REFUSE_MERKLE) {
-    // Tried to transmit a merkle file, skip
-    f.close();
+  } else if (t.Error == PDP::ERROR_REFUSE_MERKLE ||
+             t.Error == PDP::ERROR_MERKLE_INCOMPLETE) {
+    // Tried to transmit a merkle file, or a file not indexed yet, skip
+    CloseFile();
   } else if (t.Error) {
     // unknown error, halt.
     Serial.println(F("Error during transmit."));
@@ -80,17 +199,21 @@ void Broadcast() {
     // No error, file was broadcast at least once, or channel yielded
     if (t.YieldState == PDP::YIELD_GRANTED) {
       // Expect to receive this file on this channel
+      Serial.print(F("handoff ms "));
+      Serial.println(t.HandoffMillis);
       Transmitting = false;
+      HandedOver = true;
     } else {
       // Done broadcasting this file, resume listening
       Transmitting = false;
-      f.close();
+      CloseFile();
     }
   }
 }
 
 void Listen() {
-  PDP::Receiver r(radio, sd, f, CHANNEL_TIMEOUT);
+  PDP::Receiver r(radio, sd, f, merkle, CHANNEL_TIMEOUT);
+  HandedOver = false;
   Serial.print(F("RX "));
   if (f.isOpen()) {
     Serial.print(F("expecting: "));
@@ -98,10 +221,25 @@ void Listen() {
   } else {
     Serial.println(F("anything."));
   }
+  if (Resuming) {
+    Resuming = false;
+    if (!r.Resume(Session)) {
+      // the file has changed since the session was recorded
+      PDP::JournalClose(sd);
+      CloseFile();
+      return;
+    }
+  }
   r.Listen();
+  channels.Transfer(radio.getChannel(), r.Received, r.Dropped);
+  Serial.print(F("RX ring hw/ovf "));
+  Serial.print(PDP::RxRing.HighWater);
+  Serial.print(F(" "));
+  Serial.println(PDP::RxRing.Overflows);
+  PDP::Air.End();
   if (r.Error == PDP::ERROR_RX_TIMEOUT) {
     // Nobody on this channel or TX went away before file was done
-    f.close();
+    CloseFile();
     IncrementChannel = true;
   } else if (r.Error) {
     // unknown error, halt
@@ -114,47 +252,62 @@ void Listen() {
     if (r.YieldState == PDP::YIELD_GRANTED) {
       // TX is expecting us to begin transmitting this file
       Transmitting = true;
+      TakingOver = true;
     } else {
       // Done receiving this file, try next channel
-      f.close();
+      CloseFile();
       IncrementChannel = true;
     }
   }
 }
 
 void Run() {
-  radio.setChannel(random(0, CHANNEL_MAX)); // TODO experimental
-  Serial.print(F("Channel "));
-  Serial.println(radio.getChannel());
-  radio.openWritingPipe((uint8_t *)"BROAD");
-  radio.openReadingPipe(1, (uint8_t *)"BROAD");
+  DoChannelIncrement();
+  ResumeSession();
   while (true) {
     if (IncrementChannel) {
-      DoChannelIncrement();
-      if (ChannelsTried > CHANNEL_MAX) {
+      if (ChannelsTried >= CHANNEL_SCAN) {
         // Listened on all channels without receiving anything, switch to TX
+        // on the channel where transfers have worked best, where receivers
+        // listen first. The quietest channel by this station's table is
+        // rarely another station's, as the carrier, drops and collisions of
+        // their own transfers count against the channels they share.
         ChannelsTried = 0;
         Transmitting = true;
+        SetChannel(channels.Rank(0));
+      } else {
+        DoChannelIncrement();
       }
       IncrementChannel = false;
     }
+    if (!TakingOver && !HandedOver) {
+      // index local files between radio operations
+      IndexSlice();
+      // keep the channel table up to date, a channel at a time
+      channels.Sample(radio, PDP::CandidateChannel(SampleNext));
+      SampleNext = (SampleNext + 1) % PDP::CHANNEL_COUNT;
+    }
+    if (Serial.available() > 0 && Serial.read() == PDP::METRICS_DUMP_REQUEST) {
+      PDP::MetricsDump();
+    }
     if (Transmitting) {
-      // If f is not already open, pick a file and open it. Broadcast f.
-      if (!f.isOpen()) {
-        OpenNext();
-      }
-      // TODO is f always open here?
-      if (f.isOpen()) {
-        Broadcast();
-      }
+      // Broadcast f if it is already open, otherwise broadcast the next few
+      // files in a carousel
+      Broadcast();
     } else {
       // Listen and receive anything on this channel
       Listen();
     }
+    if (!TakingOver && !HandedOver) {
+      // keep what the session and the samples taken before it learned. in a
+      // handoff, both stations go straight to their new roles, and this
+      // waits for the next session.
+      channels.Save(sd);
+    }
     if (FlagShutdown) {
       // Shutdown requested. Close file, if any is open, and power off radio,
       // and power off.
-      f.close();
+      CloseFile();
       radio.powerDown();
       PowerOff();
     }
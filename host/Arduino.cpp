@@ -0,0 +1,170 @@
+#include "Arduino.h"
+
+#include <time.h>
+
+HostSerial Serial;
+
+size_t HostSerial::print(const __FlashStringHelper *s) {
+  return this->print((const char *)s);
+}
+
+size_t HostSerial::print(const char *s) {
+  if (!this->Out) {
+    return strlen(s);
+  }
+  return fputs(s, this->Out) < 0 ? 0 : strlen(s);
+}
+
+size_t HostSerial::print(char c) { return this->write(c); }
+
+size_t HostSerial::print(unsigned char n, int base) {
+  return this->print((unsigned long)n, base);
+}
+
+size_t HostSerial::print(int n, int base) {
+  return this->print((long)n, base);
+}
+
+size_t HostSerial::print(unsigned int n, int base) {
+  return this->print((unsigned long)n, base);
+}
+
+size_t HostSerial::print(long n, int base) {
+  char buf[24];
+  if (base != DEC) {
+    // as on Arduino, negative numbers print as their 32-bit two's complement
+    return this->print((unsigned long)(uint32_t)n, base);
+  }
+  snprintf(buf, sizeof(buf), "%ld", n);
+  return this->print(buf);
+}
+
+size_t HostSerial::print(unsigned long n, int base) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%lu", n);
+  return this->print(buf);
+}
+
+size_t HostSerial::print(double n, int digits) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return this->print(buf);
+}
+
+size_t HostSerial::println() { return this->print("\r\n"); }
+
+size_t HostSerial::write(uint8_t b) {
+  if (this->Out) {
+    fputc(b, this->Out);
+  }
+  return 1;
+}
+
+size_t HostSerial::write(const uint8_t *buf, size_t len) {
+  if (this->Out) {
+    fwrite(buf, 1, len, this->Out);
+  }
+  return len;
+}
+
+void HostSerial::flush() {
+  if (this->Out) {
+    fflush(this->Out);
+  }
+}
+
+namespace Host {
+
+class HostBoard : public Board {
+public:
+  HostBoard() : start(0) {}
+  uint64_t Micros() {
+    struct timespec ts;
+    uint64_t now;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (!this->start) {
+      this->start = now;
+    }
+    return now - this->start;
+  }
+  void DelayMicros(uint32_t us) {
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&ts, 0);
+  }
+
+private:
+  uint64_t start;
+};
+
+static HostBoard hostBoard;
+static Board *board = &hostBoard;
+
+void SetBoard(Board *b) { board = b ? b : &hostBoard; }
+
+void CardAccess(uint32_t len, bool sync) { board->CardAccess(len, sync); }
+
+void CardFile(const char *path, uint32_t pos, uint32_t len, bool write) {
+  board->CardFile(path, pos, len, write);
+}
+
+uint32_t RandomSeed = 1;
+
+} // namespace Host
+
+unsigned long millis() { return (uint32_t)(Host::board->Micros() / 1000); }
+
+unsigned long micros() { return (uint32_t)Host::board->Micros(); }
+
+void delay(unsigned long ms) { Host::board->DelayMicros(ms * 1000); }
+
+void delayMicroseconds(unsigned int us) { Host::board->DelayMicros(us); }
+
+long random(long howbig) {
+  if (howbig == 0) {
+    return 0;
+  }
+  // same generator as avr-libc's random()
+  int32_t hi, lo, x;
+  x = Host::RandomSeed ? Host::RandomSeed : 123459876;
+  hi = x / 127773;
+  lo = x % 127773;
+  x = 16807 * lo - 2836 * hi;
+  if (x < 0) {
+    x += 0x7fffffff;
+  }
+  Host::RandomSeed = x;
+  return x % howbig;
+}
+
+long random(long howsmall, long howbig) {
+  if (howsmall >= howbig) {
+    return howsmall;
+  }
+  return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long s) {
+  if (s != 0) {
+    Host::RandomSeed = s;
+  }
+}
+
+int analogRead(uint8_t pin) { return 0; }
+
+// Pins read high: the power switch is never held
+int digitalRead(uint8_t pin) { return HIGH; }
+
+void digitalWrite(uint8_t pin, uint8_t val) {}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode) {
+  Host::board->AttachInterrupt(interrupt, isr);
+}
+
+void detachInterrupt(uint8_t interrupt) {
+  Host::board->DetachInterrupt(interrupt);
+}
@@ -0,0 +1,118 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+// Host version of the Arduino core functions PDP uses
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+#define PROGMEM
+
+#define HEX 16
+#define DEC 10
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : -1))
+
+// Serial output goes to Out, stdout unless changed. If Out is 0, output is
+// discarded.
+class HostSerial {
+public:
+  HostSerial() : Out(stdout) {}
+  void begin(unsigned long baud) {}
+  size_t print(const __FlashStringHelper *s);
+  size_t print(const char *s);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = DEC);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+  template <class T> size_t println(T x) {
+    size_t n = this->print(x);
+    return n + this->println();
+  }
+  template <class T> size_t println(T x, int base) {
+    size_t n = this->print(x, base);
+    return n + this->println();
+  }
+  size_t println();
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buf, size_t len);
+  int available() { return 0; }
+  int read() { return -1; }
+  void flush();
+  FILE *Out;
+};
+
+extern HostSerial Serial;
+
+namespace Host {
+
+// The board a program runs on. By default time is the host's clock, and
+// nothing is charged for SD card access. The simulator installs a board with
+// a virtual clock.
+class Board {
+public:
+  virtual ~Board() {}
+  virtual uint64_t Micros() = 0;
+  virtual void DelayMicros(uint32_t us) = 0;
+  // The program read or wrote len bytes of the SD card, or synced it
+  virtual void CardAccess(uint32_t len, bool sync) {}
+  // The program read, or wrote if write is set, len bytes from pos of the
+  // file at path. Called with CardAccess for file contents, for boards that
+  // model the SD library's block cache.
+  virtual void CardFile(const char *path, uint32_t pos, uint32_t len,
+                        bool write) {}
+  virtual void AttachInterrupt(uint8_t interrupt, void (*isr)(void)) {}
+  virtual void DetachInterrupt(uint8_t interrupt) {}
+};
+
+void SetBoard(Board *b);
+void CardAccess(uint32_t len, bool sync);
+void CardFile(const char *path, uint32_t pos, uint32_t len, bool write);
+
+// State of the generator behind random()
+extern uint32_t RandomSeed;
+
+} // namespace Host
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+int analogRead(uint8_t pin);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t val);
+void pinMode(uint8_t pin, uint8_t mode);
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+#endif // ARDUINO_H
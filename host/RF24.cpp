@@ -0,0 +1,107 @@
+#include "RF24.h"
+
+RF24::RF24(uint16_t cePin, uint16_t csPin)
+    : medium(0), channel(76), rate(RF24_1MBPS), listening(false) {}
+
+void RF24::Attach(Host::Radio *medium) {
+  this->medium = medium;
+  if (medium) {
+    medium->SetChannel(this->channel);
+    medium->SetListening(this->listening);
+  }
+}
+
+bool RF24::begin() { return true; }
+
+void RF24::startListening() {
+  this->listening = true;
+  if (this->medium) {
+    this->medium->SetListening(true);
+  }
+}
+
+void RF24::stopListening() {
+  this->listening = false;
+  if (this->medium) {
+    this->medium->SetListening(false);
+  }
+}
+
+bool RF24::available() {
+  return this->medium ? this->medium->Available() : false;
+}
+
+bool RF24::available(uint8_t *pipe) {
+  if (pipe) {
+    *pipe = 1;
+  }
+  return this->available();
+}
+
+void RF24::read(void *buf, uint8_t len) {
+  if (this->medium) {
+    this->medium->Read(buf, len);
+  } else {
+    memset(buf, 0, len);
+  }
+}
+
+bool RF24::write(const void *buf, uint8_t len) {
+  return this->writeFast(buf, len) && this->txStandBy();
+}
+
+bool RF24::writeFast(const void *buf, uint8_t len, const bool multicast) {
+  if (this->listening) {
+    return false;
+  }
+  return this->medium ? this->medium->Write(buf, len) : true;
+}
+
+bool RF24::txStandBy() {
+  return this->medium ? this->medium->Flush() : true;
+}
+
+bool RF24::testCarrier() {
+  return this->medium ? this->medium->Carrier() : false;
+}
+
+void RF24::setChannel(uint8_t channel) {
+  this->channel = channel;
+  if (this->medium) {
+    this->medium->SetChannel(channel);
+  }
+}
+
+uint8_t RF24::getChannel() { return this->channel; }
+
+void RF24::openWritingPipe(const uint8_t *address) {}
+
+void RF24::openReadingPipe(uint8_t number, const uint8_t *address) {}
+
+void RF24::setPALevel(uint8_t level) {}
+
+bool RF24::setDataRate(rf24_datarate_e speed) {
+  this->rate = speed;
+  if (this->medium) {
+    this->medium->SetDataRate(speed);
+  }
+  return true;
+}
+
+rf24_datarate_e RF24::getDataRate() { return this->rate; }
+
+void RF24::setAutoAck(bool enable) {}
+
+void RF24::disableDynamicPayloads() {}
+
+void RF24::setCRCLength(rf24_crclength_e length) {}
+
+void RF24::powerDown() { this->stopListening(); }
+
+void RF24::powerUp() {}
+
+void RF24::maskIRQ(bool tx_ok, bool tx_fail, bool rx_ready) {}
+
+void RF24::whatHappened(bool &tx_ok, bool &tx_fail, bool &rx_ready) {
+  tx_ok = tx_fail = rx_ready = false;
+}
@@ -0,0 +1,85 @@
+#ifndef RF24_H
+#define RF24_H
+
+// Host version of the RF24 API PDP uses. Unless attached to a medium, the
+// radio is not connected to anything: packets written are discarded, and
+// nothing is ever received.
+
+#include "Arduino.h"
+
+typedef enum {
+  RF24_PA_MIN = 0,
+  RF24_PA_LOW,
+  RF24_PA_HIGH,
+  RF24_PA_MAX,
+  RF24_PA_ERROR
+} rf24_pa_dbm_e;
+
+typedef enum { RF24_1MBPS = 0, RF24_2MBPS, RF24_250KBPS } rf24_datarate_e;
+
+typedef enum {
+  RF24_CRC_DISABLED = 0,
+  RF24_CRC_8,
+  RF24_CRC_16
+} rf24_crclength_e;
+
+namespace Host {
+
+// The medium a radio is attached to, such as the simulator's ether. Calls to
+// the radio are passed on to it.
+class Radio {
+public:
+  virtual ~Radio() {}
+  virtual void SetChannel(uint8_t channel) = 0;
+  virtual void SetDataRate(rf24_datarate_e rate) = 0;
+  virtual void SetListening(bool listening) = 0;
+  // Queue a packet for transmission, waiting while the TX FIFO is full
+  virtual bool Write(const void *buf, uint8_t len) = 0;
+  // Wait for the TX FIFO to empty
+  virtual bool Flush() = 0;
+  virtual bool Available() = 0;
+  virtual void Read(void *buf, uint8_t len) = 0;
+  // Another station transmitted on the channel while listening
+  virtual bool Carrier() = 0;
+};
+
+} // namespace Host
+
+class RF24 {
+public:
+  RF24(uint16_t cePin, uint16_t csPin);
+  // Connect the radio to medium, or disconnect it if 0
+  void Attach(Host::Radio *medium);
+  bool begin();
+  void startListening();
+  void stopListening();
+  bool available();
+  bool available(uint8_t *pipe);
+  void read(void *buf, uint8_t len);
+  bool write(const void *buf, uint8_t len);
+  bool writeFast(const void *buf, uint8_t len, const bool multicast = false);
+  bool txStandBy();
+  bool testCarrier();
+  void setChannel(uint8_t channel);
+  uint8_t getChannel();
+  void openWritingPipe(const uint8_t *address);
+  void openReadingPipe(uint8_t number, const uint8_t *address);
+  void setPALevel(uint8_t level);
+  bool setDataRate(rf24_datarate_e speed);
+  rf24_datarate_e getDataRate();
+  void setAutoAck(bool enable);
+  void disableDynamicPayloads();
+  void setCRCLength(rf24_crclength_e length);
+  void powerDown();
+  void powerUp();
+  void maskIRQ(bool tx_ok, bool tx_fail, bool rx_ready);
+  void whatHappened(bool &tx_ok, bool &tx_fail, bool &rx_ready);
+
+private:
+  Host::Radio *medium;
+  uint8_t channel;
+  rf24_datarate_e rate;
+  bool listening;
+};
+
+#endif // RF24_H
@@ -0,0 +1,16 @@
+#ifndef SPI_H
+#define SPI_H
+
+#include "Arduino.h"
+
+// The host has no SPI bus. Radio IRQs are only raised between calls into the
+// program, so there is nothing to mask.
+class SPIClass {
+public:
+  void begin() {}
+  void usingInterrupt(uint8_t interruptNumber) {}
+};
+
+extern SPIClass SPI;
+
+#endif // SPI_H
@@ -0,0 +1,375 @@
+#include "SdFat.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+// The entries of a host directory, in the order they were first seen. An
+// entry keeps its index while the process runs, even if files are added or
+// removed, as FAT directory entries do.
+struct Directory {
+  std::vector<std::string> names;
+  std::map<std::string, uint16_t> index;
+};
+
+static std::map<std::string, Directory> directories;
+
+// Add entries of the directory at path not seen before, in name order
+static Directory &refresh(const std::string &path) {
+  Directory &d = directories[path];
+  std::vector<std::string> found;
+  struct dirent *de;
+  DIR *h = opendir(path.c_str());
+  if (!h) {
+    return d;
+  }
+  while ((de = readdir(h))) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+      continue;
+    }
+    if (!d.index.count(de->d_name)) {
+      found.push_back(de->d_name);
+    }
+  }
+  closedir(h);
+  std::sort(found.begin(), found.end());
+  for (size_t i = 0; i < found.size(); i++) {
+    d.index[found[i]] = d.names.size();
+    d.names.push_back(found[i]);
+  }
+  return d;
+}
+
+static std::string parentOf(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+static std::string baseOf(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static uint16_t indexOf(const std::string &path) {
+  Directory *d = &directories[parentOf(path)];
+  std::string name = baseOf(path);
+  if (!d->index.count(name)) {
+    d = &refresh(parentOf(path));
+  }
+  if (!d->index.count(name)) {
+    return 0xFFFF;
+  }
+  return d->index[name];
+}
+
+FatFile::FatFile()
+    : file(0), directory(false), writable(false), pos(0), index(0),
+      cursor(0) {}
+
+bool FatFile::isOpen() const { return this->file || this->directory; }
+
+bool FatFile::isDir() const { return this->directory; }
+
+bool FatFile::isFile() const { return this->file; }
+
+bool FatFile::openPath(const std::string &path, uint8_t oflag) {
+  struct stat st;
+  uint8_t flags = Host::STORAGE_READ;
+  if (this->isOpen()) {
+    return false;
+  }
+  // a directory entry is read, or written if the file is created
+  Host::CardAccess(32, false);
+  if (!stat(path.c_str(), &st) && S_ISDIR(st.st_mode)) {
+    if (oflag & O_WRITE) {
+      return false;
+    }
+    this->directory = true;
+    this->cursor = 0;
+    refresh(path);
+  } else {
+    if (oflag & O_WRITE) {
+      flags |= Host::STORAGE_WRITE;
+    }
+    if (oflag & O_CREAT) {
+      flags |= Host::STORAGE_CREATE;
+    }
+    if (oflag & O_TRUNC) {
+      flags |= Host::STORAGE_TRUNC;
+    }
+    if (oflag & O_EXCL) {
+      flags |= Host::STORAGE_EXCL;
+    }
+    this->file = Host::CurrentStorage()->Open(path.c_str(), flags);
+    if (!this->file) {
+      return false;
+    }
+    this->writable = oflag & O_WRITE;
+  }
+  this->path = path;
+  this->pos = (oflag & O_AT_END) ? this->fileSize() : 0;
+  this->index = indexOf(path);
+  return true;
+}
+
+bool FatFile::open(FatFile *dirFile, const char *path, uint8_t oflag) {
+  if (!dirFile->isDir()) {
+    return false;
+  }
+  return this->openPath(dirFile->path + "/" + path, oflag);
+}
+
+bool FatFile::open(FatFile *dirFile, uint16_t index, uint8_t oflag) {
+  Directory *d;
+  if (!dirFile->isDir()) {
+    return false;
+  }
+  d = &directories[dirFile->path];
+  if (index >= d->names.size()) {
+    d = &refresh(dirFile->path);
+  }
+  if (index >= d->names.size()) {
+    return false;
+  }
+  return this->openPath(dirFile->path + "/" + d->names[index], oflag);
+}
+
+bool FatFile::open(FatFileSystem *fs, const char *path, uint8_t oflag) {
+  return this->open(fs->vwd(), path, oflag);
+}
+
+bool FatFile::openNext(FatFile *dirFile, uint8_t oflag) {
+  Directory *d;
+  if (!dirFile->isDir() || this->isOpen()) {
+    return false;
+  }
+  d = &directories[dirFile->path];
+  while (true) {
+    if (dirFile->cursor >= d->names.size()) {
+      // pick up files created since the directory was last read
+      d = &refresh(dirFile->path);
+    }
+    if (dirFile->cursor >= d->names.size()) {
+      return false;
+    }
+    // skip entries of files that have been removed
+    if (this->openPath(dirFile->path + "/" + d->names[dirFile->cursor++],
+                       oflag)) {
+      return true;
+    }
+  }
+}
+
+bool FatFile::openRoot(FatVolume *vol) {
+  if (!this->openPath(vol->Root(), O_READ)) {
+    return false;
+  }
+  this->index = 0;
+  return true;
+}
+
+bool FatFile::close() {
+  delete this->file;
+  this->file = 0;
+  this->directory = false;
+  this->writable = false;
+  this->path.clear();
+  return true;
+}
+
+bool FatFile::getName(char *name, size_t size) {
+  std::string base;
+  if (!this->isOpen() || size == 0) {
+    return false;
+  }
+  base = baseOf(this->path);
+  if (base.size() + 1 > size) {
+    return false;
+  }
+  strcpy(name, base.c_str());
+  return true;
+}
+
+bool FatFile::seekSet(uint32_t pos) {
+  if (!this->file || pos > this->fileSize()) {
+    return false;
+  }
+  this->pos = pos;
+  return true;
+}
+
+bool FatFile::seekCur(int32_t offset) {
+  return this->seekSet(this->pos + offset);
+}
+
+uint32_t FatFile::curPosition() const { return this->pos; }
+
+int FatFile::read(void *buf, size_t nbyte) {
+  int n;
+  if (!this->file) {
+    return -1;
+  }
+  n = this->file->Read(this->pos, buf, nbyte);
+  Host::CardAccess(n > 0 ? n : 0, false);
+  Host::CardFile(this->path.c_str(), this->pos, n > 0 ? n : 0, false);
+  if (n > 0) {
+    this->pos += n;
+  }
+  return n;
+}
+
+int FatFile::read() {
+  uint8_t b;
+  return this->read(&b, 1) == 1 ? b : -1;
+}
+
+int FatFile::peek() {
+  uint8_t b;
+  Host::CardAccess(1, false);
+  if (!this->file || this->file->Read(this->pos, &b, 1) != 1) {
+    return -1;
+  }
+  Host::CardFile(this->path.c_str(), this->pos, 1, false);
+  return b;
+}
+
+int FatFile::write(const void *buf, size_t nbyte) {
+  int n;
+  if (!this->file || !this->writable) {
+    return -1;
+  }
+  n = this->file->Write(this->pos, buf, nbyte);
+  Host::CardAccess(n > 0 ? n : 0, false);
+  Host::CardFile(this->path.c_str(), this->pos, n > 0 ? n : 0, true);
+  if (n > 0) {
+    this->pos += n;
+  }
+  return n;
+}
+
+bool FatFile::sync() {
+  if (!this->isOpen()) {
+    return false;
+  }
+  Host::CardAccess(0, true);
+  return this->file ? this->file->Sync() : true;
+}
+
+uint32_t FatFile::fileSize() const {
+  return this->file ? this->file->Size() : 0;
+}
+
+bool FatFile::getModifyDateTime(uint16_t *pdate, uint16_t *ptime) {
+  struct stat st;
+  struct tm tm;
+  if (stat(this->path.c_str(), &st) || !localtime_r(&st.st_mtime, &tm)) {
+    return false;
+  }
+  *pdate = (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+  *ptime = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+  return true;
+}
+
+void FatFile::rewind() {
+  this->pos = 0;
+  this->cursor = 0;
+}
+
+bool FatFile::remove() {
+  std::string path = this->path;
+  if (!this->writable) {
+    return false;
+  }
+  this->close();
+  return unlink(path.c_str()) == 0;
+}
+
+bool FatFile::truncate(uint32_t length) {
+  if (!this->writable || length > this->fileSize() ||
+      !this->file->Truncate(length)) {
+    return false;
+  }
+  if (this->pos > length) {
+    this->pos = length;
+  }
+  return true;
+}
+
+bool FatFile::createContiguous(FatFile *dirFile, const char *path,
+                               uint32_t size) {
+  if (size == 0 || !this->open(dirFile, path, O_RDWR | O_CREAT | O_EXCL)) {
+    return false;
+  }
+  if (!this->file->Allocate(size)) {
+    this->remove();
+    return false;
+  }
+  return true;
+}
+
+uint16_t FatFile::dirIndex() { return this->index; }
+
+bool SdSpiCard::readBlock(uint32_t block, uint8_t *dst) {
+  char *root;
+  memset(dst, 0, 512);
+  if (block != 0) {
+    return true;
+  }
+  root = realpath(this->vol->Root(), 0);
+  if (root) {
+    strncpy((char *)dst, root, 511);
+    free(root);
+  }
+  return true;
+}
+
+bool FatFileSystem::begin(const char *root) {
+  this->root = root;
+  ::mkdir(root, 0755);
+  this->root_.close();
+  return this->root_.openRoot(this);
+}
+
+std::string FatFileSystem::hostPath(const char *path) {
+  return this->root + (path[0] == '/' ? "" : "/") + path;
+}
+
+File FatFileSystem::open(const char *path, uint8_t mode) {
+  File f;
+  f.open(this, path, mode);
+  return f;
+}
+
+bool FatFileSystem::exists(const char *path) {
+  struct stat st;
+  return stat(this->hostPath(path).c_str(), &st) == 0;
+}
+
+bool FatFileSystem::remove(const char *path) {
+  return unlink(this->hostPath(path).c_str()) == 0;
+}
+
+bool FatFileSystem::mkdir(const char *path, bool pFlag) {
+  std::string full = this->hostPath(path);
+  size_t slash = this->root.size() + 1;
+  if (this->exists(path)) {
+    return false;
+  }
+  while (pFlag && (slash = full.find('/', slash)) != std::string::npos) {
+    ::mkdir(full.substr(0, slash++).c_str(), 0755);
+  }
+  return ::mkdir(full.c_str(), 0755) == 0;
+}
+
+bool FatFileSystem::rename(const char *oldPath, const char *newPath) {
+  return ::rename(this->hostPath(oldPath).c_str(),
+                  this->hostPath(newPath).c_str()) == 0;
+}
+
+FatFile *FatFileSystem::vwd() { return &this->root_; }
@@ -0,0 +1,141 @@
+#ifndef SDFAT_H
+#define SDFAT_H
+
+// Host version of the subset of the SdFat API PDP uses. The SD card is a
+// directory of the host filesystem, and files are read and written through
+// the storage backend chosen with Host::SetStorage.
+
+#include "Arduino.h"
+#include "storage.h"
+
+#include <string>
+
+#define O_READ 0x01
+#define O_RDONLY O_READ
+#define O_WRITE 0x02
+#define O_WRONLY O_WRITE
+#define O_RDWR (O_READ | O_WRITE)
+#define O_APPEND 0x04
+#define O_AT_END O_APPEND
+#define O_CREAT 0x10
+#define O_TRUNC 0x20
+#define O_EXCL 0x40
+
+class FatFileSystem;
+
+class FatVolume {
+public:
+  // Host directory holding the volume's files
+  const char *Root() { return this->root.c_str(); }
+
+protected:
+  std::string root;
+};
+
+// Copies of a FatFile share the open file, as with SdFat. Only one of them
+// may be closed.
+class FatFile {
+public:
+  FatFile();
+  bool isOpen() const;
+  bool isDir() const;
+  bool isFile() const;
+  bool close();
+  bool getName(char *name, size_t size);
+  bool seekSet(uint32_t pos);
+  bool seekCur(int32_t offset);
+  uint32_t curPosition() const;
+  int read(void *buf, size_t nbyte);
+  int read();
+  int peek();
+  int write(const void *buf, size_t nbyte);
+  bool sync();
+  uint32_t fileSize() const;
+  // FAT date and time of the file's last modification
+  bool getModifyDateTime(uint16_t *pdate, uint16_t *ptime);
+  bool openNext(FatFile *dirFile, uint8_t oflag = O_READ);
+  bool openRoot(FatVolume *vol);
+  bool open(FatFile *dirFile, const char *path, uint8_t oflag);
+  bool open(FatFile *dirFile, uint16_t index, uint8_t oflag);
+  bool open(FatFileSystem *fs, const char *path, uint8_t oflag);
+  void rewind();
+  bool remove();
+  bool truncate(uint32_t length);
+  // The file is created with size bytes reserved and not written
+  bool createContiguous(FatFile *dirFile, const char *path, uint32_t size);
+  // Index of the file in its directory. Indices are kept as long as the
+  // directory is open in this process, as entries are on a FAT volume.
+  uint16_t dirIndex();
+
+private:
+  // Host path of the file or directory
+  std::string path;
+  Host::StorageFile *file;
+  bool directory;
+  bool writable;
+  uint32_t pos;
+  uint16_t index;
+  // Index of the next entry openNext opens, if this is a directory
+  uint16_t cursor;
+  bool openPath(const std::string &path, uint8_t oflag);
+};
+
+class File : public FatFile {};
+
+class SdSpiCard {
+public:
+  SdSpiCard(FatVolume *vol) : vol(vol) {}
+  // Block 0 is made from the volume's path, so cards differ as FAT volume
+  // ids do. Other blocks read as zeros.
+  bool readBlock(uint32_t block, uint8_t *dst);
+
+private:
+  FatVolume *vol;
+};
+
+class FatFileSystem : public FatVolume {
+public:
+  FatFileSystem() : card_(this) {}
+  // The card of a copy is the copy's volume
+  FatFileSystem(const FatFileSystem &fs)
+      : FatVolume(fs), root_(fs.root_), card_(this) {}
+  FatFileSystem(FatFileSystem &&fs)
+      : FatVolume(std::move(fs)), root_(std::move(fs.root_)), card_(this) {}
+  FatFileSystem &operator=(const FatFileSystem &fs) {
+    FatVolume::operator=(fs);
+    this->root_ = fs.root_;
+    return *this;
+  }
+  FatFileSystem &operator=(FatFileSystem &&fs) {
+    FatVolume::operator=(std::move(fs));
+    this->root_ = std::move(fs.root_);
+    return *this;
+  }
+  // Use directory root as the card, creating it if needed
+  bool begin(const char *root);
+  File open(const char *path, uint8_t mode = O_READ);
+  bool exists(const char *path);
+  bool remove(const char *path);
+  bool mkdir(const char *path, bool pFlag = true);
+  bool rename(const char *oldPath, const char *newPath);
+  FatFile *vwd();
+  SdSpiCard *card() { return &this->card_; }
+
+private:
+  FatFile root_;
+  SdSpiCard card_;
+  std::string hostPath(const char *path);
+};
+
+// The card is the directory named by the PDP_CARD environment variable, or
+// the working directory
+template <uint8_t MisoPin, uint8_t MosiPin, uint8_t SckPin>
+class SdFatSoftSpi : public FatFileSystem {
+public:
+  bool begin(uint8_t csPin) {
+    const char *root = getenv("PDP_CARD");
+    return FatFileSystem::begin(root ? root : ".");
+  }
+};
+
+#endif // SDFAT_H
@@ -0,0 +1,15 @@
+#ifndef PGMSPACE_H
+#define PGMSPACE_H
+
+// Program memory is ordinary memory on the host
+
+#include <stdint.h>
+
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+
+#endif // PGMSPACE_H
@@ -0,0 +1,428 @@
+// pdp-bench times the hot paths of the protocol engine, and writes the results
+// as JSON so runs can be compared.
+//
+//   pdp-bench [-d DIR] [-s posix|mmap] [-t MS] [-o FILE]
+//
+// Each benchmark repeats passes of its operation for at least MS milliseconds
+// (200 by default). Work a pass needs done first, such as creating a blank
+// merkle file to save into, is not timed. Every result has the benchmark's
+// name and parameters, the number of operations timed and the time per
+// operation, and for benchmarks that touch storage, the storage operations
+// per operation:
+//
+//   {"name": "merkle_load", "depth": 4, "ops": 40960, "ns_per_op": 2140.5,
+//    "opens": 0, "reads": 6.0, "writes": 0, "syncs": 0, "read_bytes": 204.0,
+//    "write_bytes": 0}
+//
+// Byte stream benchmarks also report "mb_per_s". The merkle benchmarks use a
+// file of 2^depth MAX_CHUNK_SIZE chunks for each depth 0 to MAX_TREE_DEPTH,
+// in a temporary directory unless DIR is given.
+
+#include <ftw.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "pdp.h"
+#include "util.h"
+
+// Storage operations done through the counting backend
+struct Counts {
+  uint64_t opens, reads, writes, syncs, readBytes, writeBytes;
+};
+
+static Counts counts;
+
+static Counts operator-(const Counts &a, const Counts &b) {
+  Counts c = {a.opens - b.opens,           a.reads - b.reads,
+              a.writes - b.writes,         a.syncs - b.syncs,
+              a.readBytes - b.readBytes,   a.writeBytes - b.writeBytes};
+  return c;
+}
+
+static Counts &operator+=(Counts &a, const Counts &b) {
+  a.opens += b.opens;
+  a.reads += b.reads;
+  a.writes += b.writes;
+  a.syncs += b.syncs;
+  a.readBytes += b.readBytes;
+  a.writeBytes += b.writeBytes;
+  return a;
+}
+
+class CountingFile : public Host::StorageFile {
+public:
+  CountingFile(Host::StorageFile *f) : f(f) {}
+  ~CountingFile() { delete this->f; }
+  int Read(uint32_t pos, void *buf, size_t len) {
+    int n = this->f->Read(pos, buf, len);
+    counts.reads++;
+    counts.readBytes += n > 0 ? n : 0;
+    return n;
+  }
+  int Write(uint32_t pos, const void *buf, size_t len) {
+    int n = this->f->Write(pos, buf, len);
+    counts.writes++;
+    counts.writeBytes += n > 0 ? n : 0;
+    return n;
+  }
+  uint32_t Size() { return this->f->Size(); }
+  bool Truncate(uint32_t size) { return this->f->Truncate(size); }
+  bool Allocate(uint32_t size) { return this->f->Allocate(size); }
+  bool Sync() {
+    counts.syncs++;
+    return this->f->Sync();
+  }
+  int Fd() { return this->f->Fd(); }
+
+private:
+  Host::StorageFile *f;
+};
+
+// Counts the operations on the files of another backend
+class CountingStorage : public Host::Storage {
+public:
+  CountingStorage(Host::Storage *s) : s(s) {}
+  Host::StorageFile *Open(const char *path, uint8_t flags) {
+    Host::StorageFile *f = this->s->Open(path, flags);
+    counts.opens++;
+    return f ? new CountingFile(f) : 0;
+  }
+  const char *Name() { return this->s->Name(); }
+
+private:
+  Host::Storage *s;
+};
+
+static uint64_t nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t budget = 200 * 1000000ull;
+static FILE *out;
+static bool firstResult = true;
+
+// Write one result. params is the JSON members naming the benchmark's
+// parameters, bytes the bytes processed per operation, or 0.
+static void report(const char *name, const std::string &params,
+                   uint64_t ops, uint64_t nanos, uint32_t bytes,
+                   const Counts *c) {
+  fprintf(out, "%s\n    {\"name\": \"%s\"%s, \"ops\": %llu, "
+               "\"ns_per_op\": %.1f",
+          firstResult ? "" : ",", name, params.c_str(),
+          (unsigned long long)ops, (double)nanos / ops);
+  if (bytes) {
+    fprintf(out, ", \"mb_per_s\": %.2f", (double)bytes * ops * 1e3 / nanos);
+  }
+  if (c) {
+    fprintf(out, ", \"opens\": %.2f, \"reads\": %.2f, \"writes\": %.2f, "
+                 "\"syncs\": %.2f, \"read_bytes\": %.1f, "
+                 "\"write_bytes\": %.1f",
+            (double)c->opens / ops, (double)c->reads / ops,
+            (double)c->writes / ops, (double)c->syncs / ops,
+            (double)c->readBytes / ops, (double)c->writeBytes / ops);
+  }
+  fprintf(out, "}");
+  fflush(out);
+  firstResult = false;
+  fprintf(stderr, "%-26s %-14s %12.1f ns\n", name,
+          params.empty() ? "" : params.c_str() + 2, (double)nanos / ops);
+}
+
+// Time passes of op(0) .. op(pass - 1), calling setup untimed before each
+// pass, until the budget is spent
+template <class Setup, class Op>
+static void measure(const char *name, const std::string &params,
+                    uint32_t pass, uint32_t bytes, bool storage, Setup setup,
+                    Op op) {
+  Counts used = {}, before;
+  uint64_t ops = 0, nanos = 0, start;
+  while (nanos < budget) {
+    setup();
+    before = counts;
+    start = nowNanos();
+    for (uint32_t i = 0; i < pass; i++) {
+      op(i);
+    }
+    nanos += nowNanos() - start;
+    used += counts - before;
+    ops += pass;
+  }
+  report(name, params, ops, nanos, bytes, storage ? &used : 0);
+}
+
+static void nothing() {}
+
+static std::string param(const char *key, unsigned value) {
+  return ", \"" + std::string(key) + "\": " + std::to_string(value);
+}
+
+static void fill(uint8_t *buf, uint32_t len) {
+  for (uint32_t i = 0; i < len; i++) {
+    buf[i] = random(256);
+  }
+}
+
+static void benchSha256() {
+  static uint8_t buf[1 << 20];
+  const uint32_t sizes[] = {64, PDP::MAX_CHUNK_SIZE, sizeof(buf)};
+  uint8_t hash[32];
+  fill(buf, sizeof(buf));
+  for (int k = 0; k < 3; k++) {
+    uint32_t size = sizes[k];
+    measure("sha256", param("bytes", size), size < 4096 ? 256 : 1, size,
+            false, nothing, [&](uint32_t i) {
+              Sha256Context ctx;
+              sha256_init(&ctx);
+              // sha256_update takes at most 64 KiB at a time
+              for (uint32_t pos = 0; pos < size; pos += 32768) {
+                sha256_update(&ctx, buf + pos,
+                              size - pos < 32768 ? size - pos : 32768);
+              }
+              sha256_final(&ctx, hash);
+            });
+  }
+}
+
+// The merkle benchmarks at one tree depth
+static void benchMerkle(FatFileSystem &fs, uint8_t depth) {
+  static uint8_t buf[PDP::MAX_CHUNK_SIZE];
+  uint32_t fileSize = (uint32_t)PDP::MAX_CHUNK_SIZE << depth;
+  char name[] = "BENCH.DAT", merkleName[] = "BENCH.DAT";
+  const char *rxName = "BENCHRX.MRK";
+  std::string p = param("depth", depth);
+  std::vector<PDP::HashChainMessage> msgs;
+  PDP::MerkleFile m, rx;
+  FatFile src;
+  uint16_t numChunks, steps;
+  PDP::ToMerkleFilename(merkleName);
+  // the source file
+  fs.remove(name);
+  fs.remove(merkleName);
+  src.open(&fs, name, O_CREAT | O_TRUNC | O_RDWR);
+  for (uint32_t pos = 0; pos < fileSize; pos += sizeof(buf)) {
+    fill(buf, sizeof(buf));
+    src.write(buf, sizeof(buf));
+  }
+  src.sync();
+
+  measure("merkle_build", p, 1, fileSize, true,
+          [&]() { fs.remove(merkleName); },
+          [&](uint32_t i) {
+            do {
+              steps = 0xFFFF;
+            } while (!m.Build(fs, merkleName, src, steps) && !m.Error);
+          });
+  m.Open(fs, merkleName, src);
+  m.ReadHeaderBlock();
+  numChunks = m.Block.HeaderBlock.numChunks;
+  if (m.Error || m.Block.HeaderBlock.treeDepth != depth) {
+    fprintf(stderr, "depth %u: merkle file error %d\n", depth, m.Error);
+    exit(1);
+  }
+
+  measure("merkle_load", p, numChunks, 0, true, nothing, [&](uint32_t i) {
+    PDP::HashChainMessage msg;
+    m.Load(msg, i);
+  });
+  msgs.resize(numChunks);
+  for (uint16_t i = 0; i < numChunks; i++) {
+    m.Load(msgs[i], i);
+    strcpy(msgs[i].Message.Header.filename, name);
+  }
+
+  // A receiver saving every hash chain in order. Verify is timed against a
+  // blank merkle file, which knows only the root hash. Save and
+  // SetChunkComplete replay the chains in order, as verified against the file
+  // they are saved into, into a blank file each pass.
+  auto blank = [&]() {
+    rx.Close();
+    fs.remove(rxName);
+    rx.Open(fs, rxName, msgs[0]);
+  };
+  auto received = [&]() {
+    blank();
+    for (uint16_t i = 0; i < numChunks; i++) {
+      rx.Verify(msgs[i]);
+      rx.Save(msgs[i]);
+    }
+  };
+  blank();
+  measure("merkle_verify", p, numChunks, 0, true, nothing,
+          [&](uint32_t i) { rx.Verify(msgs[i]); });
+  measure("merkle_save", p, numChunks, 0, true,
+          [&]() {
+            received();
+            blank();
+          },
+          [&](uint32_t i) { rx.Save(msgs[i]); });
+  measure("merkle_set_chunk_complete", p, numChunks, 0, true, received,
+          [&](uint32_t i) { rx.SetChunkComplete(i); });
+  rx.Close();
+  fs.remove(rxName);
+
+  measure("merkle_check", p, 1, fileSize, true, nothing,
+          [&](uint32_t i) { m.Check(src); });
+  m.Close();
+  src.close();
+  fs.remove(name);
+  fs.remove(merkleName);
+}
+
+// Split and recombine a hash chain message of the deepest tree, and a data
+// chunk message, packet by packet
+static void benchMultipart() {
+  static uint8_t msg[sizeof(PDP::HashChainMessage().Message)];
+  static uint8_t copy[sizeof(msg)];
+  const uint16_t sizes[] = {sizeof(PDP::DataChunkHeader) +
+                                PDP::MAX_CHUNK_SIZE,
+                            sizeof(msg)};
+  uint8_t packets[sizeof(msg) / (32 - 3) + 1]
+                 [32];
+  fill(msg, sizeof(msg));
+  for (int k = 0; k < 2; k++) {
+    uint16_t len = sizes[k];
+    uint8_t n = 0;
+    PDP::MultipartSplitter<32> s(msg, len, 0, 1);
+    while (s.More()) {
+      s.Get(packets[n++]);
+    }
+    measure("multipart_split", param("bytes", len), 256, len, false, nothing,
+            [&](uint32_t i) {
+              PDP::MultipartSplitter<32> s(msg, len, 0, i);
+              uint8_t j = 0;
+              while (s.Get(packets[j++]))
+                ;
+            });
+    measure("multipart_combine", param("bytes", len), 256, len, false,
+            nothing, [&](uint32_t i) {
+              PDP::MultipartCombiner<32> c(copy, len, 0);
+              for (uint8_t j = 0; j < n; j++) {
+                c.Put(packets[j]);
+              }
+            });
+    if (memcmp(msg, copy, len)) {
+      fprintf(stderr, "multipart: message corrupted\n");
+      exit(1);
+    }
+  }
+}
+
+// ChunkSet, the receiver's set of missing chunks, and the transmitter's
+// ChunkScheduler
+static void benchChunks() {
+  const uint16_t numChunks = 1 << PDP::MAX_TREE_DEPTH;
+  PDP::ChunkSet set;
+  PDP::ChunkScheduler sched;
+  uint16_t chunks[256], chunk;
+  for (int i = 0; i < 256; i++) {
+    chunks[i] = random(numChunks);
+  }
+  measure("chunkset_push", "", 256, 0, false, [&]() { set.Clear(); },
+          [&](uint32_t i) { set.Push(chunks[i]); });
+  measure("chunkset_pop", "", 256, 0, false,
+          [&]() { set.Push(0, numChunks); },
+          [&](uint32_t i) { set.Pop(); });
+  measure("chunkset_remove", "", 256, 0, false,
+          [&]() {
+            set.Clear();
+            set.Push(0, numChunks);
+          },
+          [&](uint32_t i) { set.Remove(chunks[i]); });
+  measure("scheduler_request", "", PDP::SCHED_LEN, 0, false,
+          [&]() { sched.Reset(numChunks, PDP::MAX_CHUNK_SIZE); },
+          [&](uint32_t i) { sched.Request(chunks[i], 1 + (i & 7), i); });
+  measure("scheduler_next_requested", "", PDP::SCHED_LEN, 0, false,
+          [&]() {
+            sched.Reset(numChunks, PDP::MAX_CHUNK_SIZE);
+            for (uint8_t i = 0; i < PDP::SCHED_LEN; i++) {
+              sched.Request(chunks[i], 1, i);
+            }
+          },
+          [&](uint32_t i) { sched.NextRequested(chunk); });
+  sched.Reset(numChunks, PDP::MAX_CHUNK_SIZE);
+  measure("scheduler_sweep", "", 256, 0, false, nothing, [&](uint32_t i) {
+    chunk = sched.Sweep(chunks[i]);
+    if (!sched.RecentlySent(chunk)) {
+      sched.Sent(chunk);
+    }
+  });
+}
+
+static int removeEntry(const char *path, const struct stat *st, int flag,
+                       struct FTW *ftw) {
+  return remove(path);
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: pdp-bench [-d DIR] [-s posix|mmap] [-t MS] [-o FILE]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  FatFileSystem fs;
+  std::string dir;
+  const char *outName = 0;
+  char tmp[] = "/tmp/pdp-bench.XXXXXX";
+  Host::Storage *backend = Host::PosixStorage();
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:t:o:")) != -1) {
+    if (opt == 'd') {
+      dir = optarg;
+    } else if (opt == 's' && Host::StorageNamed(optarg)) {
+      backend = Host::StorageNamed(optarg);
+    } else if (opt == 't' && atoi(optarg) > 0) {
+      budget = atoi(optarg) * 1000000ull;
+    } else if (opt == 'o') {
+      outName = optarg;
+    } else {
+      usage();
+    }
+  }
+  if (optind != argc) {
+    usage();
+  }
+  out = outName ? fopen(outName, "w") : stdout;
+  if (!out) {
+    perror(outName);
+    return 1;
+  }
+  if (dir.empty()) {
+    if (!mkdtemp(tmp)) {
+      perror(tmp);
+      return 1;
+    }
+  } else {
+    mkdir(dir.c_str(), 0755);
+  }
+  if (!fs.begin(dir.empty() ? tmp : dir.c_str())) {
+    fprintf(stderr, "cannot use %s\n", dir.empty() ? tmp : dir.c_str());
+    return 1;
+  }
+  Host::SetStorage(new CountingStorage(backend));
+  // the protocol code's progress messages
+  Serial.Out = 0;
+  randomSeed(1);
+  fprintf(out, "{\"storage\": \"%s\", \"budget_ms\": %llu, \"benchmarks\": [",
+          backend->Name(), (unsigned long long)(budget / 1000000));
+  benchSha256();
+  for (uint8_t depth = 0; depth <= PDP::MAX_TREE_DEPTH; depth++) {
+    benchMerkle(fs, depth);
+  }
+  benchMultipart();
+  benchChunks();
+  fprintf(out, "\n]}\n");
+  if (out != stdout) {
+    fclose(out);
+  }
+  if (dir.empty()) {
+    nftw(tmp, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+  return 0;
+}
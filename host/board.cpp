@@ -0,0 +1,18 @@
+#include "Arduino.h"
+#include "SPI.h"
+
+#include "power.h"
+
+// The parts of the sketch and its board support the protocol sources call
+// into, for host programs that do not run the driver
+
+SPIClass SPI;
+
+// The host has no power switch
+bool FlagShutdown;
+
+void InitPowerSwitch() { FlagShutdown = false; }
+
+void CheckPowerSwitch() {}
+
+void PowerOff() { exit(0); }
@@ -0,0 +1,288 @@
+// pdp-iobench measures the storage IO of a host serving many sessions at
+// once, with each IoEngine.
+//
+//   pdp-iobench [-d DIR] [-t MS] [-f BYTES] [-n SESSIONS,...]
+//
+// Every session alternates a broadcast step and a receive step, doing the IO
+// the protocol code does for them:
+//
+// - broadcast: read the merkle header block, the hash chain of a random chunk
+//   and the chunk's data
+// - receive: write a chunk and its leaf hash block. Every SAVE_BATCH chunks
+//   the received file is synced, then the leaf blocks are marked complete.
+//
+// A session's requests for a step are queued together and the next step
+// begins from the completion callback of the last one, so up to one step per
+// session is in flight. IOPS and request latency are reported per engine.
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "pdp.h"
+#include "ioengine.h"
+
+// size of a merkle file block
+static const uint32_t BLOCK = sizeof(((PDP::MerkleFile *)0)->Block);
+
+static uint64_t nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct Session;
+
+struct Op {
+  Host::IoRequest req;
+  Session *s;
+  uint64_t queuedAt;
+};
+
+struct Session {
+  // file broadcast, and file received, with their merkle files
+  Host::StorageFile *files[4];
+  int tx, txMerkle, rx, rxMerkle;
+  // requests of the current step, and the number not yet complete
+  Op ops[PDP::MAX_TREE_DEPTH + PDP::SAVE_BATCH + 2];
+  uint8_t numOps, waiting;
+  bool receiving;
+  // chunks received since the last sync
+  uint8_t unsynced;
+  bool flushing;
+  uint8_t chunk[PDP::MAX_CHUNK_SIZE];
+  uint8_t blocks[PDP::MAX_TREE_DEPTH + PDP::SAVE_BATCH + 1][64];
+};
+
+// The file layout every session uses
+static uint32_t fileSize, chunkSize;
+static uint16_t numChunks, numLeafs;
+static uint8_t treeDepth;
+
+static Host::IoEngine *engine;
+static std::vector<Session *> ready;
+// request latencies in nanoseconds
+static std::vector<uint64_t> latencies;
+static uint64_t requests;
+
+static void opDone(Host::IoRequest *req) {
+  Op *op = (Op *)req->context;
+  if (req->result < 0) {
+    fprintf(stderr, "IO error %d\n", req->result);
+    exit(1);
+  }
+  latencies.push_back(nowNanos() - op->queuedAt);
+  requests++;
+  if (--op->s->waiting == 0) {
+    ready.push_back(op->s);
+  }
+}
+
+static void addOp(Session *s, Host::IoOp kind, int fd, uint64_t pos,
+                  void *buf, uint32_t len) {
+  Op *op = &s->ops[s->numOps++];
+  op->req.op = kind;
+  op->req.fd = fd;
+  op->req.pos = pos;
+  op->req.buf = buf;
+  op->req.len = len;
+  op->req.done = opDone;
+  op->req.context = op;
+  op->s = s;
+}
+
+// Offset in a merkle file of hash block n
+static uint64_t blockAt(uint32_t n) { return (uint64_t)(n + 1) * BLOCK; }
+
+// Fill in the requests of s's next step
+static void nextStep(Session *s) {
+  uint16_t chunk = random(numChunks);
+  uint32_t base = 0, len;
+  s->numOps = 0;
+  if (s->flushing) {
+    // the synced chunks are marked complete
+    for (uint8_t i = 0; i < PDP::SAVE_BATCH; i++) {
+      addOp(s, Host::IO_WRITE, s->rxMerkle, blockAt(random(numChunks)),
+            s->blocks[i], BLOCK);
+    }
+    s->flushing = false;
+  } else if (s->unsynced == PDP::SAVE_BATCH) {
+    addOp(s, Host::IO_DATASYNC, s->rx, 0, 0, 0);
+    s->unsynced = 0;
+    s->flushing = true;
+  } else if (s->receiving) {
+    len = chunk == numChunks - 1 ? fileSize - chunk * chunkSize : chunkSize;
+    addOp(s, Host::IO_WRITE, s->rx, chunk * chunkSize, s->chunk, len);
+    addOp(s, Host::IO_WRITE, s->rxMerkle, blockAt(chunk), s->blocks[0],
+          BLOCK);
+    s->unsynced++;
+    s->receiving = false;
+  } else {
+    // header, hash chain, then data
+    addOp(s, Host::IO_READ, s->txMerkle, 0, s->blocks[0], BLOCK);
+    for (uint8_t k = 0; k < treeDepth; k++) {
+      addOp(s, Host::IO_READ, s->txMerkle, blockAt(base + ((chunk >> k) ^ 1)),
+            s->blocks[k + 1], BLOCK);
+      base += numLeafs >> k;
+    }
+    len = chunk == numChunks - 1 ? fileSize - chunk * chunkSize : chunkSize;
+    addOp(s, Host::IO_READ, s->tx, chunk * chunkSize, s->chunk, len);
+    s->receiving = true;
+  }
+  s->waiting = s->numOps;
+}
+
+static Host::StorageFile *createFile(const std::string &path, uint32_t size) {
+  uint8_t buf[4096];
+  Host::StorageFile *f = Host::PosixStorage()->Open(
+      path.c_str(),
+      Host::STORAGE_WRITE | Host::STORAGE_CREATE | Host::STORAGE_TRUNC);
+  if (!f) {
+    perror(path.c_str());
+    exit(1);
+  }
+  for (uint32_t pos = 0; pos < size; pos += sizeof(buf)) {
+    for (size_t i = 0; i < sizeof(buf); i++) {
+      buf[i] = random(256);
+    }
+    f->Write(pos, buf, std::min<uint32_t>(sizeof(buf), size - pos));
+  }
+  return f;
+}
+
+static std::vector<Session *> makeSessions(const std::string &dir,
+                                           unsigned n) {
+  std::vector<Session *> sessions;
+  uint32_t merkleSize = blockAt(2 * numLeafs - 1);
+  for (unsigned i = 0; i < n; i++) {
+    Session *s = new Session();
+    std::string name = dir + "/" + std::to_string(i);
+    s->files[0] = createFile(name + ".tx", fileSize);
+    s->files[1] = createFile(name + ".txm", merkleSize);
+    s->files[2] = createFile(name + ".rx", fileSize);
+    s->files[3] = createFile(name + ".rxm", merkleSize);
+    s->tx = s->files[0]->Fd();
+    s->txMerkle = s->files[1]->Fd();
+    s->rx = s->files[2]->Fd();
+    s->rxMerkle = s->files[3]->Fd();
+    s->receiving = i & 1;
+    sessions.push_back(s);
+  }
+  return sessions;
+}
+
+static void removeSessions(const std::string &dir,
+                           std::vector<Session *> &sessions) {
+  const char *ext[] = {".tx", ".txm", ".rx", ".rxm"};
+  for (size_t i = 0; i < sessions.size(); i++) {
+    for (int j = 0; j < 4; j++) {
+      delete sessions[i]->files[j];
+      unlink((dir + "/" + std::to_string(i) + ext[j]).c_str());
+    }
+    delete sessions[i];
+  }
+}
+
+// Run every session for ms milliseconds with e, and print the results
+static void run(Host::IoEngine *e, std::vector<Session *> &sessions,
+                uint32_t ms) {
+  uint64_t start, end, elapsed;
+  engine = e;
+  ready = sessions;
+  latencies.clear();
+  requests = 0;
+  start = nowNanos();
+  end = start + (uint64_t)ms * 1000000;
+  while (true) {
+    bool stopping = nowNanos() >= end;
+    std::vector<Session *> starting;
+    starting.swap(ready);
+    for (size_t i = 0; i < starting.size() && !stopping; i++) {
+      Session *s = starting[i];
+      nextStep(s);
+      for (uint8_t j = 0; j < s->numOps; j++) {
+        s->ops[j].queuedAt = nowNanos();
+        if (!engine->Queue(&s->ops[j].req)) {
+          // full, make room and carry on
+          engine->Submit();
+          engine->Complete(1);
+          j--;
+        }
+      }
+    }
+    if (stopping && engine->Pending() == 0) {
+      break;
+    }
+    engine->Submit();
+    engine->Complete(1);
+  }
+  elapsed = nowNanos() - start;
+  std::sort(latencies.begin(), latencies.end());
+  printf("%-7s %8u %10.0f %8.1f %8.1f %8.1f\n", e->Name(),
+         (unsigned)sessions.size(), requests * 1e9 / elapsed,
+         latencies[latencies.size() / 2] / 1e3,
+         latencies[latencies.size() * 99 / 100] / 1e3,
+         latencies.back() / 1e3);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  std::string dir = ".";
+  std::vector<unsigned> counts;
+  uint32_t ms = 1000;
+  char list[64] = "1,16,256";
+  int opt;
+  fileSize = 128 * 1024;
+  while ((opt = getopt(argc, argv, "d:t:f:n:")) != -1) {
+    switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 't':
+      ms = atoi(optarg);
+      break;
+    case 'f':
+      fileSize = atoi(optarg);
+      break;
+    case 'n':
+      strncpy(list, optarg, sizeof(list) - 1);
+      break;
+    default:
+      fprintf(stderr, "usage: pdp-iobench [-d DIR] [-t MS] [-f BYTES] "
+                      "[-n SESSIONS,...]\n");
+      return 2;
+    }
+  }
+  for (char *n = strtok(list, ","); n;
+       n = strtok(0, ",")) {
+    counts.push_back(atoi(n));
+  }
+  chunkSize = PDP::ChooseChunkSize(fileSize);
+  numChunks = (fileSize + chunkSize - 1) / chunkSize;
+  for (treeDepth = 0; (1u << treeDepth) < numChunks; treeDepth++)
+    ;
+  numLeafs = 1 << treeDepth;
+  printf("# %s: %u byte files, %u byte chunks, depth %u\n", dir.c_str(),
+         fileSize, chunkSize, treeDepth);
+  printf("%-7s %8s %10s %8s %8s %8s\n", "engine", "sessions", "IOPS",
+         "p50 us", "p99 us", "max us");
+  for (size_t i = 0; i < counts.size(); i++) {
+    std::vector<Session *> sessions = makeSessions(dir, counts[i]);
+    unsigned depth = counts[i] * (treeDepth + 2);
+    Host::IoEngine *engines[] = {Host::NewSyncEngine(),
+                                 Host::NewThreadEngine(depth, 8),
+                                 Host::NewUringEngine(depth),
+                                 Host::NewUringEngine(depth, true)};
+    for (int j = 0; j < 4; j++) {
+      if (engines[j]) {
+        run(engines[j], sessions, ms);
+        delete engines[j];
+      }
+    }
+    removeSessions(dir, sessions);
+  }
+  return 0;
+}
@@ -0,0 +1,378 @@
+#include "ioengine.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Host {
+
+// Carry out req with a blocking syscall
+static void perform(IoRequest *req) {
+  ssize_t n;
+  switch (req->op) {
+  case IO_READ:
+    n = pread(req->fd, req->buf, req->len, req->pos);
+    break;
+  case IO_WRITE:
+    n = pwrite(req->fd, req->buf, req->len, req->pos);
+    break;
+  default:
+    n = fdatasync(req->fd);
+    break;
+  }
+  req->result = n < 0 ? -errno : n;
+}
+
+class SyncEngine : public IoEngine {
+public:
+  bool Queue(IoRequest *req) {
+    perform(req);
+    req->done(req);
+    return true;
+  }
+  void Submit() {}
+  unsigned Complete(unsigned min) { return 0; }
+  unsigned Pending() { return 0; }
+  const char *Name() { return "sync"; }
+};
+
+class ThreadEngine : public IoEngine {
+public:
+  ThreadEngine(unsigned depth, unsigned threads)
+      : depth(depth), inFlight(0), stopping(false) {
+    for (unsigned i = 0; i < threads; i++) {
+      this->workers.push_back(std::thread(&ThreadEngine::work, this));
+    }
+  }
+  ~ThreadEngine() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->workReady.notify_all();
+    for (size_t i = 0; i < this->workers.size(); i++) {
+      this->workers[i].join();
+    }
+  }
+  bool Queue(IoRequest *req) {
+    if (this->queued.size() + this->inFlight >= this->depth) {
+      return false;
+    }
+    this->queued.push_back(req);
+    return true;
+  }
+  void Submit() {
+    if (this->queued.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->jobs.insert(this->jobs.end(), this->queued.begin(),
+                        this->queued.end());
+    }
+    this->inFlight += this->queued.size();
+    this->queued.clear();
+    this->workReady.notify_all();
+  }
+  unsigned Complete(unsigned min) {
+    std::vector<IoRequest *> done;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      if (min > this->inFlight) {
+        min = this->inFlight;
+      }
+      this->doneReady.wait(
+          lock, [this, min] { return this->completed.size() >= min; });
+      done.swap(this->completed);
+    }
+    this->inFlight -= done.size();
+    for (size_t i = 0; i < done.size(); i++) {
+      done[i]->done(done[i]);
+    }
+    return done.size();
+  }
+  unsigned Pending() { return this->queued.size() + this->inFlight; }
+  const char *Name() { return "thread"; }
+
+private:
+  unsigned depth;
+  // only touched by the submitting thread
+  std::vector<IoRequest *> queued;
+  unsigned inFlight;
+  std::mutex mutex;
+  std::condition_variable workReady, doneReady;
+  std::deque<IoRequest *> jobs;
+  std::vector<IoRequest *> completed;
+  bool stopping;
+  std::vector<std::thread> workers;
+  void work() {
+    while (true) {
+      IoRequest *req;
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->workReady.wait(
+            lock, [this] { return this->stopping || !this->jobs.empty(); });
+        if (this->stopping) {
+          return;
+        }
+        req = this->jobs.front();
+        this->jobs.pop_front();
+      }
+      perform(req);
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->completed.push_back(req);
+      }
+      this->doneReady.notify_one();
+    }
+  }
+};
+
+// Whether the io_uring fd supports every opcode in ops. Kernels before 5.6
+// have no IORING_REGISTER_PROBE, nor IORING_OP_READ and IORING_OP_WRITE.
+static bool uringSupports(int fd, const uint8_t *ops, unsigned n) {
+  const unsigned len = 256;
+  std::vector<uint8_t> buf(sizeof(struct io_uring_probe) +
+                           len * sizeof(struct io_uring_probe_op));
+  struct io_uring_probe *probe = (struct io_uring_probe *)&buf[0];
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, len) <
+      0) {
+    return false;
+  }
+  for (unsigned i = 0; i < n; i++) {
+    if (ops[i] > probe->last_op ||
+        !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// io_uring through its system calls, as liburing is not assumed. Reads and
+// writes use IORING_OP_READ and IORING_OP_WRITE where the kernel has them,
+// otherwise IORING_OP_READV and IORING_OP_WRITEV, which io_uring has had
+// since it was added in 5.1.
+class UringEngine : public IoEngine {
+public:
+  UringEngine()
+      : fd(-1), sqRing(0), cqRing(0), sqes(0), queued(0), inFlight(0),
+        vectored(false) {}
+  ~UringEngine() {
+    if (this->sqes) {
+      munmap(this->sqes, this->sqesSize);
+    }
+    if (this->cqRing && this->cqRing != this->sqRing) {
+      munmap(this->cqRing, this->cqRingSize);
+    }
+    if (this->sqRing) {
+      munmap(this->sqRing, this->sqRingSize);
+    }
+    if (this->fd >= 0) {
+      close(this->fd);
+    }
+  }
+  bool Setup(unsigned depth, bool vectored) {
+    static const uint8_t plain[] = {IORING_OP_READ, IORING_OP_WRITE};
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+    memset(&p, 0, sizeof(p));
+    this->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (this->fd < 0) {
+      return false;
+    }
+    this->depth = p.sq_entries;
+    this->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    this->cqRingSize =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (this->cqRingSize > this->sqRingSize) {
+        this->sqRingSize = this->cqRingSize;
+      }
+      this->cqRingSize = this->sqRingSize;
+    }
+    this->sqRing = mmap(0, this->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQ_RING);
+    if (this->sqRing == MAP_FAILED) {
+      this->sqRing = 0;
+      return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      this->cqRing = this->sqRing;
+    } else {
+      this->cqRing =
+          mmap(0, this->cqRingSize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_CQ_RING);
+      if (this->cqRing == MAP_FAILED) {
+        this->cqRing = 0;
+        return false;
+      }
+    }
+    this->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    this->sqes = (struct io_uring_sqe *)mmap(
+        0, this->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        this->fd, IORING_OFF_SQES);
+    if (this->sqes == MAP_FAILED) {
+      this->sqes = 0;
+      return false;
+    }
+    sq = (uint8_t *)this->sqRing;
+    cq = (uint8_t *)this->cqRing;
+    this->sqTail = (uint32_t *)(sq + p.sq_off.tail);
+    this->sqMask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+    this->sqArray = (uint32_t *)(sq + p.sq_off.array);
+    this->cqHead = (uint32_t *)(cq + p.cq_off.head);
+    this->cqTail = (uint32_t *)(cq + p.cq_off.tail);
+    this->cqMask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    this->tail = *this->sqTail;
+    this->vectored = vectored || !uringSupports(this->fd, plain, 2);
+    this->slots.resize(this->depth);
+    for (unsigned i = this->depth; i > 0; i--) {
+      this->freeSlots.push_back(i - 1);
+    }
+    return true;
+  }
+  bool Queue(IoRequest *req) {
+    struct io_uring_sqe *sqe;
+    uint32_t i;
+    unsigned slot;
+    if (this->queued + this->inFlight >= this->depth) {
+      return false;
+    }
+    slot = this->freeSlots.back();
+    this->freeSlots.pop_back();
+    this->slots[slot].req = req;
+    i = this->tail & this->sqMask;
+    sqe = &this->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    sqe->user_data = slot;
+    if (req->op == IO_DATASYNC) {
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    } else if (this->vectored) {
+      // the iovec is read when the request is issued, which may be after
+      // Submit, so it lives in the slot until the request completes
+      struct iovec *iov = &this->slots[slot].iov;
+      iov->iov_base = req->buf;
+      iov->iov_len = req->len;
+      sqe->opcode = req->op == IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+      sqe->off = req->pos;
+      sqe->addr = (uint64_t)(uintptr_t)iov;
+      sqe->len = 1;
+    } else {
+      sqe->opcode = req->op == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+      sqe->off = req->pos;
+      sqe->addr = (uint64_t)(uintptr_t)req->buf;
+      sqe->len = req->len;
+    }
+    this->sqArray[i] = i;
+    this->tail++;
+    this->queued++;
+    return true;
+  }
+  void Submit() {
+    int n;
+    if (this->queued == 0) {
+      return;
+    }
+    __atomic_store_n(this->sqTail, this->tail, __ATOMIC_RELEASE);
+    while (this->queued > 0) {
+      n = syscall(__NR_io_uring_enter, this->fd, this->queued, 0, 0, 0, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        // the kernel is out of resources, try again once some complete
+        break;
+      }
+      this->queued -= n;
+      this->inFlight += n;
+    }
+  }
+  unsigned Complete(unsigned min) {
+    unsigned done = 0;
+    if (min > this->inFlight) {
+      min = this->inFlight;
+    }
+    if (min > 0 && this->ready() < min) {
+      while (syscall(__NR_io_uring_enter, this->fd, 0, min,
+                     IORING_ENTER_GETEVENTS, 0, 0) < 0 &&
+             errno == EINTR)
+        ;
+    }
+    while (this->ready() > 0) {
+      uint32_t head = *this->cqHead;
+      struct io_uring_cqe *cqe = &this->cqes[head & this->cqMask];
+      unsigned slot = (unsigned)cqe->user_data;
+      IoRequest *req = this->slots[slot].req;
+      this->freeSlots.push_back(slot);
+      req->result = cqe->res;
+      __atomic_store_n(this->cqHead, head + 1, __ATOMIC_RELEASE);
+      this->inFlight--;
+      done++;
+      req->done(req);
+    }
+    return done;
+  }
+  unsigned Pending() { return this->queued + this->inFlight; }
+  const char *Name() { return this->vectored ? "uringv" : "uring"; }
+
+private:
+  int fd;
+  unsigned depth;
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize, sqesSize;
+  struct io_uring_sqe *sqes;
+  uint32_t *sqTail, *sqArray, sqMask;
+  uint32_t *cqHead, *cqTail, cqMask;
+  struct io_uring_cqe *cqes;
+  // next submission queue tail, published by Submit
+  uint32_t tail;
+  unsigned queued, inFlight;
+  // whether reads and writes use the vectored opcodes
+  bool vectored;
+  // a request queued or in flight, and its iovec for the vectored opcodes
+  struct Slot {
+    IoRequest *req;
+    struct iovec iov;
+  };
+  std::vector<Slot> slots;
+  std::vector<unsigned> freeSlots;
+  // Number of completions waiting to be reaped
+  unsigned ready() {
+    return __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE) - *this->cqHead;
+  }
+};
+
+IoEngine *NewSyncEngine() { return new SyncEngine(); }
+
+IoEngine *NewThreadEngine(unsigned depth, unsigned threads) {
+  return new ThreadEngine(depth, threads);
+}
+
+IoEngine *NewUringEngine(unsigned depth, bool vectored) {
+  UringEngine *e = new UringEngine();
+  if (!e->Setup(depth, vectored)) {
+    delete e;
+    return 0;
+  }
+  return e;
+}
+
+IoEngine *NewIoEngine(unsigned depth) {
+  IoEngine *e = NewUringEngine(depth);
+  return e ? e : NewThreadEngine(depth, 8);
+}
+
+} // namespace Host
@@ -0,0 +1,57 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include <stdint.h>
+
+// Asynchronous file IO for hosts serving many sessions at once. Requests are
+// queued, submitted in batches, and completed by calling their done callback
+// from Complete, on the thread that called it, so session state needs no
+// locking.
+namespace Host {
+
+enum IoOp { IO_READ, IO_WRITE, IO_DATASYNC };
+
+struct IoRequest {
+  IoOp op;
+  int fd;
+  uint64_t pos;
+  void *buf;
+  uint32_t len;
+  // bytes transferred, 0 for IO_DATASYNC, or -errno
+  int result;
+  void (*done)(IoRequest *req);
+  void *context;
+};
+
+class IoEngine {
+public:
+  virtual ~IoEngine() {}
+  // Queue req for the next Submit. Returns false if the engine already holds
+  // as many requests as its depth; Complete some first.
+  virtual bool Queue(IoRequest *req) = 0;
+  // Submit the queued requests as one batch
+  virtual void Submit() = 0;
+  // Wait for at least min requests to complete, or for none to be in
+  // flight, then call done for every completed request. Returns the number
+  // completed.
+  virtual unsigned Complete(unsigned min) = 0;
+  // Number of requests queued or in flight
+  virtual unsigned Pending() = 0;
+  virtual const char *Name() = 0;
+};
+
+// Requests are carried out, and completed, as they are queued, with blocking
+// pread, pwrite and fdatasync calls, as the protocol code does
+IoEngine *NewSyncEngine();
+// Requests are carried out by a pool of threads
+IoEngine *NewThreadEngine(unsigned depth, unsigned threads);
+// Requests are submitted to an io_uring. Returns 0 if the kernel does not
+// support io_uring. Reads and writes use the vectored opcodes if the kernel
+// lacks the plain ones, or if vectored is set.
+IoEngine *NewUringEngine(unsigned depth, bool vectored = false);
+// io_uring, or a thread pool if it is not supported
+IoEngine *NewIoEngine(unsigned depth);
+
+} // namespace Host
+
+#endif // IOENGINE_H
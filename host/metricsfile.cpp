@@ -0,0 +1,122 @@
+#include <string>
+
+#include "metricsfile.h"
+
+namespace Host {
+
+static const char *const counterNames[PDP::METRIC_COUNT] = {
+    "packets_rx",        "packets_tx",         "drop_timeout",
+    "drop_sequence",     "drop_invalid",       "chains_verified",
+    "chains_rejected",   "chunks_saved",       "chunks_copied",
+    "chunks_dup",        "chunks_nhs",         "chunks_drj",
+    "requests_sent",     "requests_heard",     "yields_given",
+    "yields_taken",      "interference",       "sd_block_reads",
+    "sd_block_writes",   "sd_chunk_reads",     "sd_chunk_writes",
+    "sd_syncs",
+};
+
+static const char *const histogramNames[PDP::HIST_COUNT] = {
+    "chain_verify_seconds", "chunk_flush_seconds", "handoff_seconds"};
+
+// Size of each histogram's unit, in seconds
+static const double histogramUnits[PDP::HIST_COUNT] = {1e-6, 1e-6, 1e-3};
+
+// Upper bound of bucket i of histogram h, in seconds
+static double bound(int h, int i) {
+  return (double)((uint32_t)1 << (PDP::HIST_BASE_SHIFT[h] + i)) *
+         histogramUnits[h];
+}
+
+void WriteMetricsJson(FILE *f, const PDP::Metrics_t &m) {
+  fprintf(f, "{\"counters\": {");
+  for (int i = 0; i < PDP::METRIC_COUNT; i++) {
+    fprintf(f, "%s\"%s\": %u", i ? ", " : "", counterNames[i],
+            m.counters[i]);
+  }
+  fprintf(f, "}, \"histograms\": {");
+  for (int h = 0; h < PDP::HIST_COUNT; h++) {
+    fprintf(f, "%s\"%s\": {\"sum\": %g, \"buckets\": [", h ? ", " : "",
+            histogramNames[h], m.sums[h] * histogramUnits[h]);
+    for (int i = 0; i < PDP::HIST_BUCKETS; i++) {
+      if (i < PDP::HIST_BUCKETS - 1) {
+        fprintf(f, "%s{\"le\": %g, \"count\": %u}", i ? ", " : "",
+                bound(h, i), m.buckets[h][i]);
+      } else {
+        fprintf(f, ", {\"le\": null, \"count\": %u}", m.buckets[h][i]);
+      }
+    }
+    fprintf(f, "]}");
+  }
+  fprintf(f, "}}");
+}
+
+// Labels of a sample, with extra appended
+static std::string labelSet(const char *labels, const std::string &extra) {
+  std::string s = labels;
+  if (!s.empty() && !extra.empty()) {
+    s += ",";
+  }
+  s += extra;
+  return s.empty() ? s : "{" + s + "}";
+}
+
+void WriteMetricsPrometheus(FILE *f, const PDP::Metrics_t *const *m,
+                            const char *const *labels, unsigned n) {
+  char le[32];
+  for (int i = 0; i < PDP::METRIC_COUNT; i++) {
+    fprintf(f, "# TYPE pdp_%s_total counter\n", counterNames[i]);
+    for (unsigned j = 0; j < n; j++) {
+      fprintf(f, "pdp_%s_total%s %u\n", counterNames[i],
+              labelSet(labels[j], "").c_str(), m[j]->counters[i]);
+    }
+  }
+  for (int h = 0; h < PDP::HIST_COUNT; h++) {
+    fprintf(f, "# TYPE pdp_%s histogram\n", histogramNames[h]);
+    for (unsigned j = 0; j < n; j++) {
+      uint32_t count = 0;
+      for (int i = 0; i < PDP::HIST_BUCKETS; i++) {
+        count += m[j]->buckets[h][i];
+        if (i < PDP::HIST_BUCKETS - 1) {
+          snprintf(le, sizeof(le), "le=\"%g\"", bound(h, i));
+        } else {
+          strcpy(le, "le=\"+Inf\"");
+        }
+        fprintf(f, "pdp_%s_bucket%s %u\n", histogramNames[h],
+                labelSet(labels[j], le).c_str(), count);
+      }
+      fprintf(f, "pdp_%s_sum%s %g\n", histogramNames[h],
+              labelSet(labels[j], "").c_str(),
+              m[j]->sums[h] * histogramUnits[h]);
+      fprintf(f, "pdp_%s_count%s %u\n", histogramNames[h],
+              labelSet(labels[j], "").c_str(), count);
+    }
+  }
+}
+
+bool WriteMetricsFile(const char *path, const PDP::Metrics_t *const *m,
+                      const char *const *labels, unsigned n) {
+  std::string name = path, tmp = name + ".tmp";
+  bool prometheus = name.size() > 5 &&
+                    name.compare(name.size() - 5, 5, ".prom") == 0;
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f) {
+    return false;
+  }
+  if (prometheus) {
+    WriteMetricsPrometheus(f, m, labels, n);
+  } else {
+    fprintf(f, "[");
+    for (unsigned j = 0; j < n; j++) {
+      fprintf(f, "%s\n  ", j ? "," : "");
+      WriteMetricsJson(f, *m[j]);
+    }
+    fprintf(f, "\n]\n");
+  }
+  if (fclose(f) != 0 || rename(tmp.c_str(), name.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace Host
@@ -0,0 +1,28 @@
+#ifndef METRICSFILE_H
+#define METRICSFILE_H
+
+#include <stdio.h>
+
+#include "metrics.h"
+
+// Export of the protocol metrics registry from host programs
+namespace Host {
+
+// Write m as a JSON object of counters and histograms. Histogram bounds are
+// in seconds.
+void WriteMetricsJson(FILE *f, const PDP::Metrics_t &m);
+// Write the n registries m in the Prometheus text format. Every sample of
+// m[i] gets the labels labels[i], such as station="3", which may be empty.
+void WriteMetricsPrometheus(FILE *f, const PDP::Metrics_t *const *m,
+                            const char *const *labels, unsigned n);
+// Replace path with the n registries, in the Prometheus text format if path
+// ends in .prom, as for the node exporter's textfile collector, otherwise as a
+// JSON array of the registries in order. The file is written under a
+// temporary name and renamed, so readers never see part of it. Returns false
+// on error.
+bool WriteMetricsFile(const char *path, const PDP::Metrics_t *const *m,
+                      const char *const *labels, unsigned n);
+
+} // namespace Host
+
+#endif // METRICSFILE_H
@@ -0,0 +1,108 @@
+// pdp-index prepares a directory to be served by a host running the protocol
+// engine, as a unit does at power on: the merkle file of every file in the
+// directory is built, and the files and their chunks are indexed.
+//
+//   pdp-index [-s posix|mmap] [-c] DIR
+//
+// -s chooses the storage backend, -c checks every file against its merkle
+// file afterwards.
+
+#include <unistd.h>
+
+#include "pdp.h"
+#include "chunkindex.h"
+#include "rootindex.h"
+#include "util.h"
+
+static FatFileSystem fs;
+
+static void usage() {
+  fprintf(stderr, "usage: pdp-index [-s posix|mmap] [-c] DIR\n");
+  exit(2);
+}
+
+// Build and index the merkle file of src. Returns false on error.
+static bool index(FatFile &src, bool check) {
+  PDP::MerkleFile m;
+  char filename[PDP::MAX_FILENAME_LENGTH + 1];
+  char merkleFilename[PDP::MAX_FILENAME_LENGTH + 1];
+  uint16_t steps, numLeafs;
+  bool ok;
+  src.getName(filename, PDP::MAX_FILENAME_LENGTH + 1);
+  strcpy(merkleFilename, filename);
+  PDP::ToMerkleFilename(merkleFilename);
+  do {
+    steps = 0xFFFF;
+  } while (!m.Build(fs, merkleFilename, src, steps) && !m.Error);
+  if (!m.Error) {
+    m.Open(fs, merkleFilename, src);
+  }
+  if (!m.Error) {
+    m.ReadRootHashBlock();
+  }
+  if (m.Error == PDP::ERROR_CHUNKFILE_EMPTY_OR_TOO_BIG) {
+    // not broadcast, as on a unit
+    fprintf(stderr, "%s: skipped, empty or too big\n", filename);
+    return true;
+  }
+  if (m.Error) {
+    fprintf(stderr, "%s: error %d\n", filename, m.Error);
+    return false;
+  }
+  Serial.print(filename);
+  Serial.print(F(" "));
+  PDP::PrintHash(m.Block.HashBlock.hash);
+  if (PDP::RootIndexAdd(fs, m.Block.HashBlock.hash, filename) ==
+      PDP::ERROR_NONE) {
+    PDP::ChunkIndexAddFile(fs, m, src.dirIndex());
+  }
+  if (check) {
+    m.Check(src);
+    m.ReadHeaderBlock();
+    numLeafs = m.Block.HeaderBlock.numLeafs;
+    if (!m.Error && m.NextIncomplete(0) < numLeafs) {
+      // a chunk no longer matches its hash
+      m.Error = PDP::ERROR_MERKLE_ROOT_MISMATCH;
+    }
+  }
+  ok = !m.Error;
+  if (!ok) {
+    fprintf(stderr, "%s: check failed, error %d\n", filename, m.Error);
+  }
+  m.Close();
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  FatFile dir, src;
+  char filename[PDP::MAX_FILENAME_LENGTH + 1];
+  bool check = false;
+  int failed = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:c")) != -1) {
+    if (opt == 's' && Host::StorageNamed(optarg)) {
+      Host::SetStorage(Host::StorageNamed(optarg));
+    } else if (opt == 'c') {
+      check = true;
+    } else {
+      usage();
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+  if (!fs.begin(argv[optind]) || PDP::RootIndexCheck(fs) ||
+      PDP::ChunkIndexCheck(fs)) {
+    fprintf(stderr, "cannot use %s\n", argv[optind]);
+    return 1;
+  }
+  dir.openRoot(&fs);
+  while (src.openNext(&dir, O_READ)) {
+    src.getName(filename, PDP::MAX_FILENAME_LENGTH + 1);
+    if (src.isFile() && !PDP::IsMerkleFilename(filename)) {
+      failed += !index(src, check);
+    }
+    src.close();
+  }
+  return failed ? 1 : 0;
+}
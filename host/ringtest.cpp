@@ -0,0 +1,174 @@
+// pdp-ringtest checks PacketRing, and RadioRxDrain run as the IRQ handler of
+// a scripted radio on a virtual clock.
+//
+//   pdp-ringtest
+//
+// Exits with status 1 if any case fails.
+
+#include <deque>
+#include <vector>
+
+#include "pdp.h"
+#include "radiorx.h"
+
+static unsigned failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line) {
+  if (!ok) {
+    fprintf(stderr, "line %d: %s\n", line, what);
+    failures++;
+  }
+}
+
+// a board whose clock only moves when told to, and which keeps the ISR the
+// program attaches so the test can raise the IRQ
+class TestBoard : public Host::Board {
+public:
+  TestBoard() : now(0), isr(0) {}
+  uint64_t Micros() { return this->now; }
+  void DelayMicros(uint32_t us) { this->now += us; }
+  void AttachInterrupt(uint8_t interrupt, void (*isr)(void)) {
+    this->isr = isr;
+  }
+  uint64_t now;
+  void (*isr)(void);
+};
+
+// a radio whose RX FIFO is filled by the test
+class TestRadio : public Host::Radio {
+public:
+  void SetChannel(uint8_t channel) {}
+  void SetDataRate(rf24_datarate_e rate) {}
+  void SetListening(bool listening) {}
+  bool Write(const void *buf, uint8_t len) { return true; }
+  bool Flush() { return true; }
+  bool Available() { return !this->fifo.empty(); }
+  void Read(void *buf, uint8_t len) {
+    memcpy(buf, &this->fifo.front()[0], len);
+    this->fifo.pop_front();
+  }
+  bool Carrier() { return false; }
+  std::deque<std::vector<uint8_t> > fifo;
+};
+
+static TestBoard board;
+static TestRadio medium;
+
+// airtime of a packet at 250 kbps, in microseconds
+static const uint32_t PACKET_MICROS = 1284;
+
+// queue copies of the packet with sequence number seq and message id mid in
+// the radio's FIFO, a packet time apart, raising the IRQ after each if irq is
+// set
+static void hear(uint8_t seq, uint16_t mid, uint8_t copies, bool irq = true) {
+  std::vector<uint8_t> packet(32, 0);
+  PDP::MultipartHeader *header = (PDP::MultipartHeader *)&packet[0];
+  header->sequenceNum = seq;
+  header->messageId = mid;
+  for (uint8_t i = 0; i < copies; i++) {
+    medium.fifo.push_back(packet);
+    board.now += PACKET_MICROS;
+    if (irq) {
+      board.isr();
+    }
+  }
+}
+
+// take every packet in RxRing, returning their number
+static uint8_t drain() {
+  uint8_t packet[32], n = 0;
+  while (PDP::RxRing.Get(packet)) {
+    n++;
+  }
+  return n;
+}
+
+static void testRing() {
+  PDP::PacketRing<4> r;
+  uint8_t packet[32];
+  CHECK(r.Last() == 0);
+  CHECK(!r.Get(packet));
+  for (uint8_t i = 0; i < 4; i++) {
+    uint8_t *slot = r.Reserve();
+    CHECK(slot != 0);
+    if (slot) {
+      slot[0] = i;
+      r.Commit();
+    }
+  }
+  CHECK(r.Length() == 4 && r.HighWater == 4);
+  CHECK(r.Reserve() == 0 && r.Overflows == 1);
+  CHECK(r.Last() != 0 && r.Last()[0] == 3);
+  // oldest first
+  CHECK(r.Get(packet) && packet[0] == 0);
+  CHECK(r.Get(packet) && packet[0] == 1);
+  // the last packet is still known once taken, until the ring is cleared
+  r.Clear();
+  CHECK(r.Length() == 0 && !r.Get(packet));
+  CHECK(r.Last() == 0);
+  // indices wrap around
+  for (uint16_t i = 0; i < 300; i++) {
+    uint8_t *slot = r.Reserve();
+    CHECK(slot != 0);
+    if (slot) {
+      slot[0] = (uint8_t)i;
+      r.Commit();
+    }
+    CHECK(r.Get(packet) && packet[0] == (uint8_t)i);
+  }
+  CHECK(r.HighWater == 4 && r.Overflows == 1);
+}
+
+static void testDrain() {
+  uint16_t overflows = PDP::RxRing.Overflows;
+  RF24 radio(0, 0);
+  radio.Attach(&medium);
+  Host::SetBoard(&board);
+  PDP::RadioRxBegin(radio, 3);
+  CHECK(board.isr != 0);
+  if (!board.isr) {
+    return;
+  }
+  // copies of a packet are committed once
+  hear(PDP::SEQ_TAKING_REQS, PDP::SEQ_TAKING_REQS, PDP::RETRANSMITS);
+  CHECK(PDP::RxRing.Length() == 1);
+  // the same header in a later message, after the consumer has emptied the
+  // ring, is a new packet
+  CHECK(drain() == 1);
+  board.now += 100000;
+  hear(PDP::SEQ_TAKING_REQS, PDP::SEQ_TAKING_REQS, PDP::RETRANSMITS);
+  CHECK(drain() == 1);
+  // as it is right after Clear
+  hear(PDP::SEQ_CHUNK_START, 7, 1);
+  PDP::RxRing.Clear();
+  hear(PDP::SEQ_CHUNK_START, 7, 1);
+  CHECK(drain() == 1);
+  // parts of a message differ in sequence number, and consecutive messages in
+  // message id
+  hear(PDP::SEQ_CHUNK_START, 8, PDP::RETRANSMITS);
+  hear(PDP::SEQ_CHUNK_START + 1, 8, PDP::RETRANSMITS);
+  hear(PDP::SEQ_CHAIN_START, 9, PDP::RETRANSMITS);
+  hear(PDP::SEQ_CHUNK_START, 9, PDP::RETRANSMITS);
+  CHECK(drain() == 4);
+  // copies still in the radio's FIFO when the IRQ is served are dropped too
+  hear(PDP::SEQ_CHUNK_START, 10, PDP::RETRANSMITS, false);
+  board.isr();
+  CHECK(drain() == 1);
+  // a full ring drops new packets, and counts them
+  for (uint8_t i = 0; i < PDP::RX_RING_LEN + 2; i++) {
+    hear(PDP::SEQ_CHUNK_START + i, 11, 1);
+  }
+  CHECK(PDP::RxRing.Length() == PDP::RX_RING_LEN);
+  CHECK(PDP::RxRing.Overflows == overflows + 2);
+  CHECK(drain() == PDP::RX_RING_LEN);
+  Host::SetBoard(0);
+}
+
+int main(int argc, char **argv) {
+  testRing();
+  testDrain();
+  printf("ring: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
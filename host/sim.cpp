@@ -0,0 +1,1109 @@
+// pdp-sim runs a swarm of stations on a simulated ether, in virtual time, and
+// reports how long each took to receive its files.
+//
+//   pdp-sim [-d DIR] [-r 250k|1m|2m] [-l LOSS] [-b BURST] [-c CARD]
+//           [-n LOW-HIGH[,LOW-HIGH...]] [-u BUSY] [-t SECONDS] [-f BYTES]
+//           [-F FILES] [-s SEED] [-m FILE] [-S] [-w] [-v] SCENARIO
+//
+// SCENARIO is 1:N, one source broadcasting FILES files to N receivers, or
+// mesh:N, N stations each with one file that all the others want. Runs stop
+// when every station has its files, or after SECONDS (3600) of virtual time.
+// Files are FILES (1) files of BYTES (16384) random bytes, the same for a
+// given SEED.
+//
+// Every station runs the unmodified driver, Transmitter and Receiver in a
+// coroutine of its own, with its own card, a directory under DIR (a temporary
+// directory, removed afterwards, by default). With -v each station's serial
+// output is written next to its card. With -m each station's protocol metrics
+// are written to FILE at the end, in the Prometheus text format if FILE ends
+// in .prom, otherwise as JSON. With -S transmitters send the newest request
+// first and sweep files in order, as before ChunkScheduler, for comparison.
+// With -w every packet written waits until it is sent, as the blocking
+// RF24::write the protocol used before writeFast does, for comparison.
+// The report's eff column is the share of each station's transfer sessions
+// spent on chunk contents, as measured by the protocol's own airtime
+// accounting. The report ends with the time from each
+// channel handoff's acknowledgement to the new transmitter's first broadcast
+// packet, the sectors of data files transmitters read per data chunk they
+// send, through a cache of one 512 byte block per card as SdFat keeps on the
+// ATmega, and the packets sent per second of broadcasting, from a station's
+// first packet to the TX FIFO emptied before it next listens. The driver's
+// globals are swapped in while a station runs, as if each station had the
+// program to itself. Radio, card access, hashing and delays take virtual
+// time; the rest of the protocol code takes none.
+//
+// The ether delivers a packet to every station listening on its channel at
+// its data rate from before the packet began, unless another transmission on
+// the channel overlapped it, or the link lost it. Links lose packets in
+// bursts: each link is good or bad, losing LOSS (0.01) or half of its packets.
+// After a packet a good link turns bad with probability BURST (0.001), and a
+// bad one good with probability 1/4. With -n, a foreign network such as WiFi
+// is busy on each range of radio channels LOW to HIGH for BUSY (0.5) of the
+// time, in bursts of 2ms on average. Stations hear its carrier, and packets
+// that overlap a burst are lost. Packets take the airtime of a 32 byte
+// payload with a 5 byte address and 1 byte CRC, plus 130us to settle the PLL
+// when the radio leaves standby, and the 3 packet TX and RX FIFOs are
+// modelled. Received packets raise the radio IRQ of the station.
+//
+// Each station's clock is off by up to 0.5%. Card access costs CARD (1) times
+// 100us per call and 8us per byte, and 2ms per sync. Hashing costs 2ms per
+// SHA-256 block, roughly what an ATmega328 at 16MHz takes.
+
+#include <ftw.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "../driver.cpp"
+
+#include "chunkindex.h"
+#include "metricsfile.h"
+
+SdFatSoftSpi<PIN_SD_MISO, PIN_SD_MOSI, PIN_SD_SCK> sd;
+RF24 radio(PIN_RADIO_CE, PIN_RADIO_CS);
+PDP::ChannelTable channels;
+
+namespace Sim {
+
+const uint32_t STACK_SIZE = 256 * 1024;
+// How often stations are checked for complete files (microseconds)
+const uint64_t CHECK_INTERVAL = 1000000;
+// Poll waits begin this long, and double up to POLL_MAX (microseconds)
+const uint32_t POLL_MIN = 50;
+const uint32_t POLL_MAX = 4000;
+const uint32_t SETTLE = 130;
+// Stations' clocks run fast or slow by up to this share, as ceramic
+// resonators do. Without it, stations with nothing to receive would keep in
+// step forever.
+const double CLOCK_TOLERANCE = 0.005;
+const uint8_t FIFO_LEN = 3;
+// Time to hash a 64 byte block (microseconds)
+const uint32_t HASH_BLOCK = 2000;
+// Mean length of a foreign network's bursts (microseconds)
+const uint32_t NOISE_BURST = 2000;
+// Size of the SD card block SdFat caches
+const uint32_t BLOCK_SIZE = 512;
+
+// Radio channels low to high, where a foreign network is busy
+struct Noise {
+  uint8_t low, high;
+};
+
+struct Options {
+  std::string dir, metrics;
+  rf24_datarate_e rate;
+  double loss, burst, card, busy;
+  uint32_t seconds, fileSize, files, seed;
+  bool blockingWrites, verbose;
+  std::vector<Noise> noise;
+};
+
+static Options opt;
+
+// Virtual time (microseconds)
+static uint64_t now;
+
+// xorshift64*, so runs do not depend on the host's random()
+class Dice {
+public:
+  Dice(uint64_t seed) : x(seed * 2685821657736338717ULL + 1) {}
+  uint64_t Next() {
+    this->x ^= this->x >> 12;
+    this->x ^= this->x << 25;
+    this->x ^= this->x >> 27;
+    return this->x * 2685821657736338717ULL;
+  }
+  double Uniform() { return (this->Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+  uint64_t x;
+};
+
+static Dice *dice;
+
+struct Station;
+
+struct Transmission {
+  uint64_t start, end;
+  // 0 for a burst of noise
+  Station *from;
+  // channel to lastChannel, which differ only for noise
+  uint8_t channel, lastChannel;
+  rf24_datarate_e rate;
+  uint8_t packet[32];
+  bool Covers(uint8_t ch) const {
+    return ch >= this->channel && ch <= this->lastChannel;
+  }
+};
+
+struct Event {
+  uint64_t at;
+  uint64_t seq;
+  Station *s;
+  // the station's wake token, if a wake up
+  uint32_t token;
+  // the transmission ending, if not
+  Transmission *t;
+  bool operator<(const Event &e) const {
+    return this->at != e.at ? this->at > e.at : this->seq > e.seq;
+  }
+};
+
+static std::priority_queue<Event> events;
+static uint64_t nextSeq;
+// Transmissions recently on the air, oldest first
+static std::vector<Transmission *> air;
+static std::vector<Station *> stations;
+// Link states, from * stations + to, true if bad
+static std::vector<bool> bad;
+static ucontext_t scheduler;
+// The station running or taking an IRQ, if any
+static Station *current;
+// The station whose program state is in the globals
+static Station *resident;
+// The station running, and the number of times stations have been resumed,
+// for the watchdog
+static Station *running;
+static uint32_t resumes, watched;
+// Time from each handoff's acknowledgement to the new transmitter's next
+// packet (microseconds)
+static std::vector<uint64_t> handoffs;
+
+static void schedule(uint64_t at, Station *s, uint32_t token,
+                     Transmission *t) {
+  Event e = {at, nextSeq++, s, token, t};
+  events.push(e);
+}
+
+static uint32_t airtime(rf24_datarate_e rate) {
+  // preamble, address, packet control field, payload and CRC
+  uint32_t bits = 8 * (1 + 5 + 32 + 1) + 9;
+  switch (rate) {
+  case RF24_250KBPS:
+    return bits * 4;
+  case RF24_2MBPS:
+    // 2 byte preamble
+    return (bits + 8 + 1) / 2;
+  default:
+    return bits;
+  }
+}
+
+struct Station : public Host::Radio {
+  Station(uint8_t id);
+  // Swap the station's program state with the globals
+  void Exchange();
+  // Make the globals the station's
+  void Load();
+  void Resume();
+  // Give up the CPU until at, or until a packet is received if wakeOnRx
+  void Sleep(uint64_t at, bool wakeOnRx);
+  // Wait out the time card access has taken
+  void Pay();
+  // The program did something besides read the clock
+  void Active();
+  uint64_t Micros();
+  void Delay(uint32_t us);
+  void Deliver(Transmission *t);
+  bool CarrierDuring(uint64_t from, uint64_t to);
+
+  void SetChannel(uint8_t channel);
+  void SetDataRate(rf24_datarate_e rate);
+  void SetListening(bool listening);
+  bool Write(const void *buf, uint8_t len);
+  bool Flush();
+  bool Available();
+  void Read(void *buf, uint8_t len);
+  bool Carrier();
+  // Wait until the packets in the TX FIFO are sent
+  void drain();
+
+  uint8_t id;
+  std::string dir;
+  // files the station should end up with
+  std::vector<std::string> wants;
+  ucontext_t context;
+  std::vector<char> stack;
+  void (*isr)(void);
+  bool inIrq;
+  // rate of the station's clock
+  double clock;
+
+  // program state
+  bool incrementChannel;
+  uint8_t channelsTried;
+  bool transmitting;
+  FatFile file;
+  PDP::MerkleFile merkleFile;
+  bool takingOver, handedOver;
+  uint8_t sampleNext;
+  PDP::JournalRecord journal;
+  bool resuming;
+  FatFile srcDir, indexDir;
+  uint16_t indexFile;
+  bool indexBusy, indexIdle, indexDone;
+  SdFatSoftSpi<PIN_SD_MISO, PIN_SD_MOSI, PIN_SD_SCK> card;
+  RF24 radio;
+  PDP::ChannelTable channels;
+  PDP::PacketRing<PDP::RX_RING_LEN> rxRing;
+  FILE *out;
+  uint32_t randomSeed;
+  PDP::Metrics_t metrics;
+  PDP::Airtime session, airtimeTotal;
+
+  // radio state
+  uint8_t channel;
+  rf24_datarate_e rate;
+  bool listening;
+  // receiving since, and carrier seen during the last listen
+  uint64_t listenSince;
+  bool carrier;
+  uint8_t fifo[FIFO_LEN][32];
+  uint8_t fifoHead, fifoLen;
+  // ends of the packets in the TX FIFO
+  std::vector<uint64_t> txEnds;
+  // start of the broadcast in progress, or 0
+  uint64_t txSince;
+
+  // scheduling
+  uint64_t debt;
+  uint32_t token;
+  bool waitingRx;
+  uint8_t polls;
+  uint32_t quantum;
+
+  // results
+  bool halted;
+  // broadcastTime is the time from the first packet of each broadcast to the
+  // TX FIFO being emptied after its last
+  uint64_t txAir, broadcastTime, doneAt;
+  // end of the station's last acknowledgement of a channel handoff, until
+  // it broadcasts
+  uint64_t ackedAt;
+  uint32_t txPackets, rxPackets, collided, lost, overflowed;
+  // the file and block in the card's block cache
+  std::string cachedPath;
+  uint32_t cachedBlock;
+  // data file blocks loaded into the cache while transmitting, and data
+  // chunk message packets sent, copies included
+  uint32_t dataReads, chunkPackets;
+};
+
+Station::Station(uint8_t id)
+    : id(id), stack(STACK_SIZE), isr(0), inIrq(false),
+      clock(1 + CLOCK_TOLERANCE * (2 * dice->Uniform() - 1)),
+      incrementChannel(false), channelsTried(0), transmitting(false),
+      takingOver(false), handedOver(false), sampleNext(0), resuming(false),
+      indexFile(0), indexBusy(false), indexIdle(false), indexDone(false),
+      radio(PIN_RADIO_CE, PIN_RADIO_CS), out(0), randomSeed(1), channel(76),
+      rate(RF24_1MBPS), listening(false), listenSince(0), carrier(false),
+      fifoHead(0), fifoLen(0), txSince(0), debt(0), token(0), waitingRx(false),
+      polls(0), quantum(POLL_MIN), halted(false), txAir(0), broadcastTime(0),
+      doneAt(0), ackedAt(0), txPackets(0), rxPackets(0), collided(0), lost(0),
+      overflowed(0), cachedBlock(0), dataReads(0), chunkPackets(0) {
+  memset(&this->journal, 0, sizeof(this->journal));
+  memset(&this->metrics, 0, sizeof(this->metrics));
+  this->radio.Attach(this);
+}
+
+void Station::Exchange() {
+  std::swap(::IncrementChannel, this->incrementChannel);
+  std::swap(::ChannelsTried, this->channelsTried);
+  std::swap(::Transmitting, this->transmitting);
+  std::swap(::f, this->file);
+  std::swap(::merkle, this->merkleFile);
+  std::swap(::TakingOver, this->takingOver);
+  std::swap(::HandedOver, this->handedOver);
+  std::swap(::SampleNext, this->sampleNext);
+  std::swap(::Session, this->journal);
+  std::swap(::Resuming, this->resuming);
+  std::swap(::srcDir, this->srcDir);
+  std::swap(::IndexDir, this->indexDir);
+  std::swap(::IndexFile, this->indexFile);
+  std::swap(::IndexBusy, this->indexBusy);
+  std::swap(::IndexIdle, this->indexIdle);
+  std::swap(::IndexDone, this->indexDone);
+  std::swap(::sd, this->card);
+  std::swap(::radio, this->radio);
+  std::swap(::channels, this->channels);
+  std::swap(PDP::RxRing, this->rxRing);
+  std::swap(Serial.Out, this->out);
+  std::swap(Host::RandomSeed, this->randomSeed);
+  std::swap(PDP::Metrics, this->metrics);
+  std::swap(PDP::Air, this->session);
+  std::swap(PDP::AirtimeTotal, this->airtimeTotal);
+}
+
+void Station::Load() {
+  if (resident != this) {
+    if (resident) {
+      resident->Exchange();
+    }
+    this->Exchange();
+    resident = this;
+  }
+}
+
+void Station::Resume() {
+  current = running = this;
+  resumes++;
+  this->Load();
+  swapcontext(&scheduler, &this->context);
+  current = running = 0;
+}
+
+void Station::Sleep(uint64_t at, bool wakeOnRx) {
+  this->waitingRx = wakeOnRx;
+  schedule(at, this, ++this->token, 0);
+  swapcontext(&this->context, &scheduler);
+  this->waitingRx = false;
+}
+
+void Station::Pay() {
+  if (this->debt) {
+    uint64_t at = now + this->debt;
+    this->debt = 0;
+    this->Sleep(at, false);
+  }
+}
+
+void Station::Active() {
+  this->Pay();
+  this->polls = 0;
+  this->quantum = POLL_MIN;
+}
+
+uint64_t Station::Micros() {
+  if (this->inIrq) {
+    // the IRQ handler runs on the scheduler's stack, and can't wait
+    return (uint64_t)(now * this->clock);
+  }
+  this->Pay();
+  // reading the clock over and over, with nothing else in between, is waiting
+  // for a packet or a timeout
+  if (this->polls < 2) {
+    this->polls++;
+  } else {
+    this->Sleep(now + this->quantum, true);
+    this->quantum = std::min(2 * this->quantum, POLL_MAX);
+  }
+  return (uint64_t)(now * this->clock);
+}
+
+void Station::Delay(uint32_t us) {
+  this->Active();
+  this->Sleep(now + (uint64_t)(us / this->clock), false);
+}
+
+bool Station::CarrierDuring(uint64_t from, uint64_t to) {
+  for (size_t i = 0; i < air.size(); i++) {
+    Transmission *t = air[i];
+    if (t->from != this && t->Covers(this->channel) && t->start < to &&
+        t->end > from) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Station::Deliver(Transmission *t) {
+  size_t link = t->from->id * stations.size() + this->id;
+  if (!this->listening || this->channel != t->channel ||
+      this->rate != t->rate || this->listenSince > t->start) {
+    return;
+  }
+  if (dice->Uniform() < (bad[link] ? 0.5 : opt.loss)) {
+    this->lost++;
+  } else if (this->fifoLen == FIFO_LEN) {
+    this->overflowed++;
+  } else {
+    memcpy(this->fifo[(this->fifoHead + this->fifoLen++) % FIFO_LEN],
+           t->packet, 32);
+    this->rxPackets++;
+    if (this->isr) {
+      // the IRQ handler only needs the radio and the ring
+      current = this;
+      if (resident != this) {
+        std::swap(::radio, this->radio);
+        std::swap(PDP::RxRing, this->rxRing);
+      }
+      this->inIrq = true;
+      this->isr();
+      this->inIrq = false;
+      if (resident != this) {
+        std::swap(::radio, this->radio);
+        std::swap(PDP::RxRing, this->rxRing);
+      }
+      current = 0;
+    }
+    if (this->waitingRx) {
+      this->waitingRx = false;
+      this->polls = 0;
+      this->quantum = POLL_MIN;
+      schedule(now, this, ++this->token, 0);
+    }
+  }
+  // bursts
+  bad[link] = bad[link] ? dice->Uniform() >= 0.25 : dice->Uniform() < opt.burst;
+}
+
+void Station::SetChannel(uint8_t channel) {
+  this->Flush();
+  this->channel = channel;
+  this->listenSince = now + SETTLE;
+}
+
+void Station::SetDataRate(rf24_datarate_e rate) {
+  this->Flush();
+  this->rate = rate;
+  this->listenSince = now + SETTLE;
+}
+
+void Station::SetListening(bool listening) {
+  this->Flush();
+  if (listening && !this->listening) {
+    this->listenSince = now + SETTLE;
+  } else if (!listening && this->listening) {
+    this->carrier = this->CarrierDuring(this->listenSince, now);
+  }
+  this->listening = listening;
+}
+
+bool Station::Write(const void *buf, uint8_t len) {
+  Transmission *t;
+  uint64_t start;
+  this->Active();
+  while (!this->txEnds.empty() && this->txEnds.front() <= now) {
+    this->txEnds.erase(this->txEnds.begin());
+  }
+  if (this->txEnds.size() == FIFO_LEN) {
+    this->Sleep(this->txEnds.front(), false);
+    this->txEnds.erase(this->txEnds.begin());
+  }
+  start = this->txEnds.empty() ? now + SETTLE : this->txEnds.back();
+  t = new Transmission();
+  t->start = start;
+  t->end = start + airtime(this->rate);
+  t->from = this;
+  t->channel = t->lastChannel = this->channel;
+  t->rate = this->rate;
+  memset(t->packet, 0, 32);
+  memcpy(t->packet, buf, std::min<uint8_t>(len, 32));
+  if (t->packet[0] == PDP::SEQ_CHUNK_START) {
+    this->chunkPackets++;
+  }
+  if (t->packet[0] >= PDP::SEQ_YIELD_ACK &&
+      t->packet[0] < PDP::SEQ_CHAIN_START) {
+    this->ackedAt = t->end;
+  } else if (this->ackedAt) {
+    handoffs.push_back(t->start - this->ackedAt);
+    this->ackedAt = 0;
+  }
+  air.push_back(t);
+  schedule(t->end, 0, 0, t);
+  this->txEnds.push_back(t->end);
+  this->txAir += t->end - t->start;
+  this->txPackets++;
+  if (!this->txSince) {
+    this->txSince = now;
+  }
+  if (opt.blockingWrites) {
+    this->drain();
+  }
+  return true;
+}
+
+void Station::drain() {
+  if (!this->txEnds.empty() && this->txEnds.back() > now) {
+    this->Sleep(this->txEnds.back(), false);
+  }
+  this->txEnds.clear();
+}
+
+bool Station::Flush() {
+  this->Active();
+  this->drain();
+  if (this->txSince) {
+    this->broadcastTime += now - this->txSince;
+    this->txSince = 0;
+  }
+  return true;
+}
+
+bool Station::Available() { return this->fifoLen > 0; }
+
+void Station::Read(void *buf, uint8_t len) {
+  if (!this->fifoLen) {
+    memset(buf, 0, len);
+    return;
+  }
+  memcpy(buf, this->fifo[this->fifoHead], std::min<uint8_t>(len, 32));
+  this->fifoHead = (this->fifoHead + 1) % FIFO_LEN;
+  this->fifoLen--;
+}
+
+bool Station::Carrier() {
+  this->Active();
+  if (this->listening) {
+    return this->CarrierDuring(this->listenSince, now);
+  }
+  return this->carrier;
+}
+
+// Clock and card of the running station
+class Board : public Host::Board {
+public:
+  uint64_t Micros() { return current ? current->Micros() : now; }
+  void DelayMicros(uint32_t us) {
+    if (current) {
+      current->Delay(us);
+    }
+  }
+  void CardAccess(uint32_t len, bool sync) {
+    if (current) {
+      current->polls = 0;
+      current->debt +=
+          (uint64_t)(opt.card * (sync ? 2000 : 100 + 8 * len) + 0.5);
+    }
+  }
+  // every block the access touches passes through the cache. Reads of data
+  // files, the ones outside PDP/ that are not merkle files, are counted while
+  // the station transmits.
+  void CardFile(const char *path, uint32_t pos, uint32_t len, bool write) {
+    bool data;
+    if (!current || len == 0) {
+      return;
+    }
+    data = !strstr(path, "/PDP/") && !PDP::IsMerkleFilename(path);
+    for (uint32_t b = pos / BLOCK_SIZE; b <= (pos + len - 1) / BLOCK_SIZE;
+         b++) {
+      if (b == current->cachedBlock && current->cachedPath == path) {
+        continue;
+      }
+      if (data && !write && ::Transmitting) {
+        current->dataReads++;
+      }
+      current->cachedPath = path;
+      current->cachedBlock = b;
+    }
+  }
+  void AttachInterrupt(uint8_t interrupt, void (*isr)(void)) {
+    if (current && interrupt == digitalPinToInterrupt(PIN_RADIO_IRQ)) {
+      current->isr = isr;
+    }
+  }
+  void DetachInterrupt(uint8_t interrupt) {
+    if (current && interrupt == digitalPinToInterrupt(PIN_RADIO_IRQ)) {
+      current->isr = 0;
+    }
+  }
+};
+
+static Board board;
+
+// Hashing is charged to the running station. The linker directs the
+// protocol code's calls here (see the Makefile).
+void realSha256Update(Sha256Context *ctx, uint8_t *data, uint16_t len)
+    __asm__("__real__Z13sha256_updateP13Sha256ContextPht");
+void realSha256Final(Sha256Context *ctx, uint8_t hash[])
+    __asm__("__real__Z12sha256_finalP13Sha256ContextPh");
+
+void wrapSha256Update(Sha256Context *ctx, uint8_t *data, uint16_t len)
+    __asm__("__wrap__Z13sha256_updateP13Sha256ContextPht");
+void wrapSha256Final(Sha256Context *ctx, uint8_t hash[])
+    __asm__("__wrap__Z12sha256_finalP13Sha256ContextPh");
+
+void wrapSha256Update(Sha256Context *ctx, uint8_t *data, uint16_t len) {
+  if (current) {
+    current->debt += (uint64_t)len * HASH_BLOCK / 64;
+  }
+  realSha256Update(ctx, data, len);
+}
+
+void wrapSha256Final(Sha256Context *ctx, uint8_t hash[]) {
+  if (current) {
+    current->debt += HASH_BLOCK;
+  }
+  realSha256Final(ctx, hash);
+}
+
+// What setup() does at power on, without the entropy collection: stations
+// are seeded from the simulation's seed
+static void boot() {
+  Station *s = current;
+  InitPowerSwitch();
+  if (!sd.FatFileSystem::begin(s->dir.c_str())) {
+    Serial.println(F("SDERR"));
+    return;
+  }
+  radio.begin();
+  radio.setPALevel(RF24_PA_MAX);
+  radio.setDataRate(opt.rate);
+  radio.setChannel(0);
+  radio.setAutoAck(false);
+  radio.disableDynamicPayloads();
+  radio.setCRCLength(RF24_CRC_8);
+  radio.openWritingPipe((uint8_t *)"BROAD");
+  radio.openReadingPipe(1, (uint8_t *)"BROAD");
+  channels.Load(sd);
+  randomSeed(opt.seed * 1000003 + s->id + 1);
+  if (PDP::RootIndexCheck(sd) || PDP::ChunkIndexCheck(sd)) {
+    Serial.println(F("IDXERR"));
+  }
+  PDP::RadioRxBegin(radio, PIN_RADIO_IRQ);
+  Run();
+}
+
+static void start() {
+  boot();
+  current->halted = true;
+  swapcontext(&current->context, &scheduler);
+}
+
+// A station that has run for a second of CPU time without waiting for
+// anything has halted, in one of the driver's while (1) loops. Return to the
+// scheduler, never to resume it.
+static void watchdog(int sig) {
+  if (running && resumes == watched) {
+    running->halted = true;
+    fprintf(stderr, "station %u halted at %.3f s\n", running->id, now / 1e6);
+    swapcontext(&running->context, &scheduler);
+  }
+  watched = resumes;
+}
+
+// The content of file n of a scenario
+static void fileContent(uint32_t n, std::vector<uint8_t> &data) {
+  Dice d(opt.seed * 7919 + n);
+  data.resize(opt.fileSize);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = d.Next() >> 56;
+  }
+}
+
+static std::string fileName(uint32_t n) {
+  char name[16];
+  snprintf(name, sizeof(name), "SIM%03u.DAT", n);
+  return name;
+}
+
+static void writeFile(Station *s, uint32_t n) {
+  std::vector<uint8_t> data;
+  std::string path = s->dir + "/" + fileName(n);
+  FILE *file = fopen(path.c_str(), "wb");
+  fileContent(n, data);
+  if (!file || fwrite(&data[0], 1, data.size(), file) != data.size()) {
+    perror(path.c_str());
+    exit(1);
+  }
+  fclose(file);
+}
+
+// Returns true if the station has every file it wants, intact
+static bool complete(Station *s) {
+  std::vector<uint8_t> data, want;
+  for (size_t i = 0; i < s->wants.size(); i++) {
+    std::string path = s->dir + "/" + s->wants[i];
+    FILE *file = fopen(path.c_str(), "rb");
+    size_t n;
+    if (!file) {
+      return false;
+    }
+    data.resize(opt.fileSize + 1);
+    n = fread(&data[0], 1, data.size(), file);
+    fclose(file);
+    fileContent(atoi(s->wants[i].c_str() + 3), want);
+    if (n != want.size() || memcmp(&data[0], &want[0], n)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Put the next burst of noise on the air, after a gap so that the channels
+// are busy opt.busy of the time
+static void noiseBurst(uint8_t low, uint8_t high) {
+  Transmission *t = new Transmission();
+  double gap = NOISE_BURST * (1 - opt.busy) / opt.busy;
+  t->start = now + (uint64_t)(-gap * log(1 - dice->Uniform()));
+  t->end = t->start + 1 + (uint64_t)(-(double)NOISE_BURST *
+                                     log(1 - dice->Uniform()));
+  t->from = 0;
+  t->channel = low;
+  t->lastChannel = high;
+  t->rate = opt.rate;
+  memset(t->packet, 0, 32);
+  air.push_back(t);
+  schedule(t->end, 0, 0, t);
+}
+
+// Parse a list of radio channel ranges, LOW-HIGH[,LOW-HIGH...], into
+// opt.noise
+static bool parseNoise(const char *s) {
+  while (*s) {
+    char *end;
+    Noise n;
+    long low = strtol(s, &end, 10), high;
+    if (end == s || *end != '-') {
+      return false;
+    }
+    s = end + 1;
+    high = strtol(s, &end, 10);
+    if (end == s || low < 0 || high < low || high > 125) {
+      return false;
+    }
+    n.low = low;
+    n.high = high;
+    opt.noise.push_back(n);
+    if (*end == ',') {
+      s = end + 1;
+    } else if (*end) {
+      return false;
+    } else {
+      s = end;
+    }
+  }
+  return !opt.noise.empty();
+}
+
+// Set up the stations of scenario
+static bool build(const char *scenario) {
+  const char *colon = strchr(scenario, ':');
+  uint32_t n = colon ? atoi(colon + 1) : 0;
+  bool mesh = colon && !strncmp(scenario, "mesh", colon - scenario);
+  if (!colon || n < 1 || n > 250 ||
+      !(mesh || !strncmp(scenario, "1", colon - scenario))) {
+    return false;
+  }
+  if (mesh && n < 2) {
+    return false;
+  }
+  uint32_t count = mesh ? n : n + 1;
+  for (uint32_t i = 0; i < count; i++) {
+    Station *s = new Station(i);
+    char name[8];
+    snprintf(name, sizeof(name), "/%03u", i);
+    s->dir = opt.dir + name;
+    mkdir(s->dir.c_str(), 0755);
+    stations.push_back(s);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    Station *s = stations[i];
+    if (mesh) {
+      writeFile(s, i);
+      for (uint32_t j = 0; j < count; j++) {
+        if (j != i) {
+          s->wants.push_back(fileName(j));
+        }
+      }
+    } else if (i == 0) {
+      for (uint32_t j = 0; j < opt.files; j++) {
+        writeFile(s, j);
+      }
+    } else {
+      for (uint32_t j = 0; j < opt.files; j++) {
+        s->wants.push_back(fileName(j));
+      }
+    }
+    if (opt.verbose) {
+      s->out = fopen((s->dir + ".log").c_str(), "w");
+    }
+    getcontext(&s->context);
+    s->context.uc_stack.ss_sp = &s->stack[0];
+    s->context.uc_stack.ss_size = s->stack.size();
+    s->context.uc_link = 0;
+    makecontext(&s->context, start, 0);
+    // don't all power on at the same moment
+    schedule(dice->Next() % 100000, s, 0, 0);
+  }
+  bad.assign(count * count, false);
+  for (size_t i = 0; i < opt.noise.size(); i++) {
+    noiseBurst(opt.noise[i].low, opt.noise[i].high);
+  }
+  return true;
+}
+
+// Run until every station is complete or time runs out
+static void run() {
+  uint64_t limit = (uint64_t)opt.seconds * 1000000;
+  uint64_t checkAt = CHECK_INTERVAL;
+  size_t waiting = 0;
+  for (size_t i = 0; i < stations.size(); i++) {
+    waiting += !stations[i]->wants.empty();
+  }
+  while (!events.empty() && waiting) {
+    Event e = events.top();
+    if (e.at > checkAt) {
+      now = checkAt;
+      for (size_t i = 0; i < stations.size(); i++) {
+        Station *s = stations[i];
+        if (!s->wants.empty() && !s->doneAt && complete(s)) {
+          s->doneAt = now;
+          waiting--;
+        }
+      }
+      checkAt += CHECK_INTERVAL;
+      if (now >= limit) {
+        break;
+      }
+      continue;
+    }
+    events.pop();
+    now = e.at;
+    if (e.t) {
+      Transmission *t = e.t;
+      bool collision = false;
+      for (size_t i = 0; i < air.size(); i++) {
+        Transmission *u = air[i];
+        if (u != t && u->Covers(t->channel) && u->start < t->end &&
+            u->end > t->start) {
+          collision = true;
+        }
+      }
+      if (!t->from) {
+        // noise is never received, the network just goes on
+        noiseBurst(t->channel, t->lastChannel);
+      } else if (collision) {
+        t->from->collided++;
+      } else {
+        for (size_t i = 0; i < stations.size(); i++) {
+          if (stations[i] != t->from) {
+            stations[i]->Deliver(t);
+          }
+        }
+      }
+      // keep transmissions for carrier and collision checks while they may
+      // still overlap one on the air
+      while (!air.empty() && air.front()->end + 10000 < now) {
+        delete air.front();
+        air.erase(air.begin());
+      }
+    } else if (e.token == e.s->token) {
+      e.s->Resume();
+    }
+  }
+}
+
+static void report() {
+  uint64_t elapsed = now ? now : 1, reads = 0, chunks = 0, broadcast = 0;
+  uint32_t sent = 0;
+  if (resident) {
+    // the resident station's airtime is in the globals
+    resident->Exchange();
+    resident = 0;
+  }
+  printf("%-4s %9s %10s %9s %6s %6s %8s %8s %8s %8s %8s\n", "sta", "done s",
+         "goodput", "TX ms", "TX %", "eff %", "TX pkts", "RX pkts", "collide",
+         "lost", "overflow");
+  for (size_t i = 0; i < stations.size(); i++) {
+    Station *s = stations[i];
+    char done[16], goodput[16];
+    if (s->wants.empty()) {
+      strcpy(done, "-");
+      strcpy(goodput, "-");
+    } else if (s->halted && !s->doneAt) {
+      strcpy(done, "halted");
+      strcpy(goodput, "-");
+    } else if (s->doneAt) {
+      snprintf(done, sizeof(done), "%.0f", s->doneAt / 1e6);
+      snprintf(goodput, sizeof(goodput), "%.0f B/s",
+               (double)s->wants.size() * opt.fileSize * 1e6 / s->doneAt);
+    } else {
+      strcpy(done, "never");
+      strcpy(goodput, "-");
+    }
+    printf("%-4u %9s %10s %9.0f %6.1f %6.1f %8u %8u %8u %8u %8u\n", s->id,
+           done, goodput, s->txAir / 1e3, 100.0 * s->txAir / elapsed,
+           s->airtimeTotal.Permille(PDP::AIR_CHUNK) / 10.0, s->txPackets,
+           s->rxPackets, s->collided, s->lost, s->overflowed);
+  }
+  printf("# %.0f s simulated\n", now / 1e6);
+  if (!handoffs.empty()) {
+    std::vector<uint64_t> h(handoffs);
+    double sum = 0;
+    std::sort(h.begin(), h.end());
+    for (size_t i = 0; i < h.size(); i++) {
+      sum += h[i];
+    }
+    printf("# %zu handoffs, acknowledgement to first broadcast ms: median "
+           "%.1f mean %.1f 90th %.1f\n",
+           h.size(), h[h.size() / 2] / 1e3, sum / h.size() / 1e3,
+           h[h.size() * 9 / 10] / 1e3);
+  }
+  for (size_t i = 0; i < stations.size(); i++) {
+    reads += stations[i]->dataReads;
+    chunks += stations[i]->chunkPackets;
+    broadcast += stations[i]->broadcastTime;
+    sent += stations[i]->txPackets;
+  }
+  // every part of a message is sent RETRANSMITS times
+  chunks /= PDP::RETRANSMITS;
+  if (chunks > 0) {
+    printf("# %llu data chunks sent, data sectors read per chunk %.2f\n",
+           (unsigned long long)chunks, (double)reads / chunks);
+  }
+  if (broadcast > 0) {
+    printf("# %u packets sent in %.1f s of broadcasting, %.0f per second\n",
+           sent, broadcast / 1e6, sent * 1e6 / broadcast);
+  }
+}
+
+// Write every station's metrics to opt.metrics
+static bool writeMetrics() {
+  std::vector<const PDP::Metrics_t *> m;
+  std::vector<std::string> labels;
+  std::vector<const char *> labelPtrs;
+  if (resident) {
+    // the resident station's metrics are in the globals
+    resident->Exchange();
+    resident = 0;
+  }
+  for (size_t i = 0; i < stations.size(); i++) {
+    m.push_back(&stations[i]->metrics);
+    labels.push_back("station=\"" + std::to_string(stations[i]->id) + "\"");
+  }
+  for (size_t i = 0; i < labels.size(); i++) {
+    labelPtrs.push_back(labels[i].c_str());
+  }
+  return Host::WriteMetricsFile(opt.metrics.c_str(), m.data(),
+                                labelPtrs.data(), m.size());
+}
+
+static int removeEntry(const char *path, const struct stat *st, int flag,
+                       struct FTW *ftw) {
+  return remove(path);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: pdp-sim [-d DIR] [-r 250k|1m|2m] [-l LOSS] "
+                  "[-b BURST] [-c CARD] [-n LOW-HIGH[,LOW-HIGH...]] "
+                  "[-u BUSY] [-t SECONDS] [-f BYTES] [-F FILES] [-s SEED] "
+                  "[-m FILE] [-S] [-w] [-v] 1:N|mesh:N\n");
+  exit(2);
+}
+
+} // namespace Sim
+
+int main(int argc, char **argv) {
+  using namespace Sim;
+  char tmp[] = "/tmp/pdp-sim.XXXXXX";
+  bool keep = false;
+  int c;
+  opt.rate = RF24_250KBPS;
+  opt.loss = 0.01;
+  opt.burst = 0.001;
+  opt.card = 1;
+  opt.busy = 0.5;
+  opt.seconds = 3600;
+  opt.fileSize = 16 * 1024;
+  opt.files = 1;
+  opt.seed = 1;
+  opt.verbose = false;
+  while ((c = getopt(argc, argv, "d:r:l:b:c:n:u:t:f:F:s:m:Swv")) != -1) {
+    switch (c) {
+    case 'd':
+      opt.dir = optarg;
+      keep = true;
+      break;
+    case 'r':
+      if (!strcmp(optarg, "250k")) {
+        opt.rate = RF24_250KBPS;
+      } else if (!strcmp(optarg, "1m")) {
+        opt.rate = RF24_1MBPS;
+      } else if (!strcmp(optarg, "2m")) {
+        opt.rate = RF24_2MBPS;
+      } else {
+        usage();
+      }
+      break;
+    case 'l':
+      opt.loss = atof(optarg);
+      break;
+    case 'b':
+      opt.burst = atof(optarg);
+      break;
+    case 'c':
+      opt.card = atof(optarg);
+      break;
+    case 'n':
+      if (!parseNoise(optarg)) {
+        usage();
+      }
+      break;
+    case 'u':
+      opt.busy = atof(optarg);
+      if (opt.busy <= 0 || opt.busy >= 1) {
+        usage();
+      }
+      break;
+    case 't':
+      opt.seconds = atoi(optarg);
+      break;
+    case 'f':
+      opt.fileSize = atoi(optarg);
+      break;
+    case 'F':
+      opt.files = atoi(optarg);
+      break;
+    case 's':
+      opt.seed = atoi(optarg);
+      break;
+    case 'm':
+      opt.metrics = optarg;
+      break;
+    case 'S':
+      PDP::SchedSequential = true;
+      break;
+    case 'w':
+      opt.blockingWrites = true;
+      break;
+    case 'v':
+      opt.verbose = true;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1 || opt.fileSize == 0 || opt.files == 0) {
+    usage();
+  }
+  if (opt.dir.empty()) {
+    if (!mkdtemp(tmp)) {
+      perror(tmp);
+      return 1;
+    }
+    opt.dir = tmp;
+  } else {
+    mkdir(opt.dir.c_str(), 0755);
+  }
+  dice = new Dice(opt.seed);
+  Serial.Out = 0;
+  if (!build(argv[optind])) {
+    usage();
+  }
+  Host::SetBoard(&board);
+  struct sigaction sa;
+  struct itimerval tick = {{1, 0}, {1, 0}};
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = watchdog;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGVTALRM, &sa, 0);
+  setitimer(ITIMER_VIRTUAL, &tick, 0);
+  run();
+  report();
+  if (!opt.metrics.empty() && !writeMetrics()) {
+    perror(opt.metrics.c_str());
+  }
+  if (!keep) {
+    nftw(opt.dir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+  return 0;
+}
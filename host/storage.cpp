@@ -0,0 +1,262 @@
+#include "storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Host {
+
+static int openFd(const char *path, uint8_t flags) {
+  int oflag = (flags & STORAGE_WRITE) ? O_RDWR : O_RDONLY;
+  int fd;
+  if (flags & STORAGE_CREATE) {
+    oflag |= O_CREAT;
+  }
+  if (flags & STORAGE_TRUNC) {
+    oflag |= O_TRUNC;
+  }
+  if (flags & STORAGE_EXCL) {
+    oflag |= O_EXCL;
+  }
+  fd = ::open(path, oflag | O_CLOEXEC, 0644);
+  if (fd >= 0 && !(flags & STORAGE_WRITE)) {
+    // files opened read only are broadcast, and read front to back
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return fd;
+}
+
+static uint32_t fdSize(int fd) {
+  struct stat st;
+  if (fstat(fd, &st)) {
+    return 0;
+  }
+  return st.st_size;
+}
+
+static bool allocate(int fd, uint32_t size) {
+  int err = posix_fallocate(fd, 0, size);
+  if (err == EOPNOTSUPP || err == EINVAL) {
+    // filesystem cannot reserve blocks, a sparse file will do
+    return ftruncate(fd, size) == 0;
+  }
+  return err == 0;
+}
+
+class PosixFile : public StorageFile {
+public:
+  PosixFile(int fd) : fd(fd) {}
+  ~PosixFile() { ::close(this->fd); }
+  int Read(uint32_t pos, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+      ssize_t n = pread(this->fd, (uint8_t *)buf + done, len - done, pos + done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        return -1;
+      }
+      if (n == 0) {
+        // end of file
+        break;
+      }
+      done += n;
+    }
+    return done;
+  }
+  int Write(uint32_t pos, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+      ssize_t n =
+          pwrite(this->fd, (const uint8_t *)buf + done, len - done, pos + done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      done += n;
+    }
+    return len;
+  }
+  uint32_t Size() { return fdSize(this->fd); }
+  bool Truncate(uint32_t size) { return ftruncate(this->fd, size) == 0; }
+  bool Allocate(uint32_t size) { return allocate(this->fd, size); }
+  bool Sync() { return fdatasync(this->fd) == 0; }
+  int Fd() { return this->fd; }
+
+private:
+  int fd;
+};
+
+// The mapping is grown in steps of at least this many bytes, so a file
+// written front to back is not remapped on every write
+const size_t MMAP_GROW = 1 << 16;
+
+class MmapFile : public StorageFile {
+public:
+  MmapFile(int fd, bool writable)
+      : fd(fd), writable(writable), map(0), mapped(0) {
+    this->size = fdSize(fd);
+    this->remap(this->size);
+  }
+  ~MmapFile() {
+    if (this->map) {
+      munmap(this->map, this->mapped);
+    }
+    ::close(this->fd);
+  }
+  int Read(uint32_t pos, void *buf, size_t len) {
+    if (pos >= this->size) {
+      return 0;
+    }
+    if (len > this->size - pos) {
+      len = this->size - pos;
+    }
+    memcpy(buf, this->map + pos, len);
+    return len;
+  }
+  int Write(uint32_t pos, const void *buf, size_t len) {
+    if (!this->writable) {
+      return -1;
+    }
+    if (pos + len > this->size && !this->resize(pos + len)) {
+      return -1;
+    }
+    memcpy(this->map + pos, buf, len);
+    return len;
+  }
+  uint32_t Size() { return this->size; }
+  // false if the file could not be mapped
+  bool Mapped() { return this->map || this->size == 0; }
+  bool Truncate(uint32_t size) { return this->resize(size); }
+  bool Allocate(uint32_t size) {
+    if (!allocate(this->fd, size)) {
+      return false;
+    }
+    // as with posix_fallocate, a file is never shrunk
+    if (size > this->size) {
+      this->size = size;
+    }
+    return this->remap(this->size);
+  }
+  bool Sync() {
+    if (this->map && msync(this->map, this->size, MS_SYNC)) {
+      return false;
+    }
+    return fdatasync(this->fd) == 0;
+  }
+  int Fd() { return this->fd; }
+
+private:
+  int fd;
+  bool writable;
+  uint8_t *map;
+  // bytes mapped, which may run past the end of the file. Only bytes before
+  // size are ever touched.
+  size_t mapped;
+  uint32_t size;
+  bool resize(uint32_t size) {
+    if (ftruncate(this->fd, size)) {
+      return false;
+    }
+    this->size = size;
+    return this->remap(size);
+  }
+  // Make sure at least size bytes are mapped
+  bool remap(size_t size) {
+    size_t want;
+    void *p;
+    if (size <= this->mapped) {
+      return true;
+    }
+    want = this->mapped * 2;
+    if (want < size) {
+      want = size;
+    }
+    if (want < MMAP_GROW) {
+      want = MMAP_GROW;
+    }
+    if (this->map) {
+      munmap(this->map, this->mapped);
+      this->map = 0;
+      this->mapped = 0;
+    }
+    p = mmap(0, want, PROT_READ | (this->writable ? PROT_WRITE : 0),
+             MAP_SHARED, this->fd, 0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    this->map = (uint8_t *)p;
+    this->mapped = want;
+    return true;
+  }
+};
+
+class PosixStorageImpl : public Storage {
+public:
+  StorageFile *Open(const char *path, uint8_t flags) {
+    int fd = openFd(path, flags);
+    if (fd < 0) {
+      return 0;
+    }
+    return new PosixFile(fd);
+  }
+  const char *Name() { return "posix"; }
+};
+
+class MmapStorageImpl : public Storage {
+public:
+  StorageFile *Open(const char *path, uint8_t flags) {
+    int fd = openFd(path, flags);
+    MmapFile *f;
+    if (fd < 0) {
+      return 0;
+    }
+    f = new MmapFile(fd, flags & STORAGE_WRITE);
+    if (!f->Mapped()) {
+      // could not be mapped
+      delete f;
+      return 0;
+    }
+    return f;
+  }
+  const char *Name() { return "mmap"; }
+};
+
+Storage *PosixStorage() {
+  static PosixStorageImpl s;
+  return &s;
+}
+
+Storage *MmapStorage() {
+  static MmapStorageImpl s;
+  return &s;
+}
+
+Storage *StorageNamed(const char *name) {
+  if (!strcmp(name, "posix")) {
+    return PosixStorage();
+  }
+  if (!strcmp(name, "mmap")) {
+    return MmapStorage();
+  }
+  return 0;
+}
+
+static Storage *current;
+
+Storage *CurrentStorage() {
+  if (!current) {
+    current = PosixStorage();
+  }
+  return current;
+}
+
+void SetStorage(Storage *s) { current = s; }
+
+} // namespace Host
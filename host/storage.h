@@ -0,0 +1,57 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Storage backends of the host port. The protocol code only sees the SdFat
+// API, which host/SdFat.cpp implements on top of a Storage. On AVR the real
+// SdFat library is the backend.
+namespace Host {
+
+// Open flags
+const uint8_t STORAGE_READ = 0x01;
+const uint8_t STORAGE_WRITE = 0x02;
+const uint8_t STORAGE_CREATE = 0x04;
+const uint8_t STORAGE_TRUNC = 0x08;
+const uint8_t STORAGE_EXCL = 0x10;
+
+// An open file. Reads and writes are positional, FatFile keeps the position.
+class StorageFile {
+public:
+  virtual ~StorageFile() {}
+  // Returns the number of bytes read, short at end of file, or -1 on error
+  virtual int Read(uint32_t pos, void *buf, size_t len) = 0;
+  // Returns len, or -1 on error. Writing past the end grows the file.
+  virtual int Write(uint32_t pos, const void *buf, size_t len) = 0;
+  virtual uint32_t Size() = 0;
+  virtual bool Truncate(uint32_t size) = 0;
+  // Grow the file to size bytes, reserving the storage without writing it
+  virtual bool Allocate(uint32_t size) = 0;
+  virtual bool Sync() = 0;
+  // The file descriptor, for requests to an IoEngine
+  virtual int Fd() = 0;
+};
+
+class Storage {
+public:
+  virtual ~Storage() {}
+  // Returns 0 if path cannot be opened
+  virtual StorageFile *Open(const char *path, uint8_t flags) = 0;
+  virtual const char *Name() = 0;
+};
+
+// pread/pwrite on a file descriptor
+Storage *PosixStorage();
+// Reads and writes are copies to and from a shared mapping of the file
+Storage *MmapStorage();
+// Returns the backend named name, "posix" or "mmap", or 0
+Storage *StorageNamed(const char *name);
+
+// The backend files are opened with. PosixStorage by default.
+Storage *CurrentStorage();
+void SetStorage(Storage *s);
+
+} // namespace Host
+
+#endif // STORAGE_H
@@ -0,0 +1,222 @@
+// pdp-storagetest runs the same cases against every storage backend, so the
+// protocol code sees the same files whichever backend a host uses.
+//
+//   pdp-storagetest [-d DIR]
+//
+// Each backend gets its own directory in DIR, which must not hold files from
+// an earlier run, a new temporary directory by default. Exits with status 1 if
+// any case fails.
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "pdp.h"
+#include "storage.h"
+
+static const char *backend;
+static unsigned failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line) {
+  if (!ok) {
+    fprintf(stderr, "%s: line %d: %s\n", backend, line, what);
+    failures++;
+  }
+}
+
+// byte i of the test pattern
+static uint8_t pattern(uint32_t i) { return (uint8_t)(i * 7 + (i >> 8)); }
+
+static void fill(uint8_t *buf, uint32_t from, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = pattern(from + i);
+  }
+}
+
+// true if len bytes of f from pos are the test pattern, or zero if zero is set
+static bool holds(Host::StorageFile *f, uint32_t pos, size_t len,
+                  bool zero = false) {
+  uint8_t buf[4096], want[4096];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    if (f->Read(pos, buf, n) != (int)n) {
+      return false;
+    }
+    if (zero) {
+      memset(want, 0, n);
+    } else {
+      fill(want, pos, n);
+    }
+    if (memcmp(buf, want, n)) {
+      return false;
+    }
+    pos += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool writePattern(Host::StorageFile *f, uint32_t pos, size_t len) {
+  uint8_t buf[4096];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    fill(buf, pos, n);
+    if (f->Write(pos, buf, n) != (int)n) {
+      return false;
+    }
+    pos += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void testReadWrite(Host::Storage *s, const std::string &dir) {
+  std::string path = dir + "/rw";
+  uint8_t buf[64];
+  Host::StorageFile *f = s->Open(path.c_str(), Host::STORAGE_READ);
+  CHECK(f == 0);
+  f = s->Open(path.c_str(), Host::STORAGE_READ | Host::STORAGE_WRITE |
+                                Host::STORAGE_CREATE);
+  CHECK(f != 0);
+  if (!f) {
+    return;
+  }
+  CHECK(f->Size() == 0);
+  CHECK(f->Read(0, buf, sizeof(buf)) == 0);
+  CHECK(writePattern(f, 0, 3000));
+  CHECK(f->Size() == 3000);
+  CHECK(holds(f, 0, 3000));
+  // short at the end of the file, nothing past it
+  CHECK(f->Read(2990, buf, sizeof(buf)) == 10);
+  CHECK(f->Read(3000, buf, sizeof(buf)) == 0);
+  CHECK(f->Read(5000, buf, sizeof(buf)) == 0);
+  // overwrite within the file, across a page boundary
+  CHECK(writePattern(f, 4090, 10) && f->Size() == 4100);
+  CHECK(holds(f, 3000, 1090, true));
+  CHECK(holds(f, 4090, 10));
+  CHECK(writePattern(f, 2000, 2000));
+  CHECK(holds(f, 0, 4000));
+  CHECK(f->Sync());
+  delete f;
+  // the contents outlive the open file
+  f = s->Open(path.c_str(), Host::STORAGE_READ);
+  CHECK(f != 0);
+  if (f) {
+    CHECK(f->Size() == 4100 && holds(f, 0, 4000) && holds(f, 4090, 10));
+    CHECK(f->Write(0, buf, 1) < 0);
+    delete f;
+  }
+  // exclusive creation of an existing file fails, truncation empties it
+  CHECK(s->Open(path.c_str(), Host::STORAGE_READ | Host::STORAGE_WRITE |
+                                  Host::STORAGE_CREATE | Host::STORAGE_EXCL) ==
+        0);
+  f = s->Open(path.c_str(), Host::STORAGE_READ | Host::STORAGE_WRITE |
+                                Host::STORAGE_TRUNC);
+  CHECK(f != 0);
+  if (f) {
+    CHECK(f->Size() == 0);
+    delete f;
+  }
+}
+
+static void testTruncateAllocate(Host::Storage *s, const std::string &dir) {
+  std::string path = dir + "/ta";
+  Host::StorageFile *f =
+      s->Open(path.c_str(), Host::STORAGE_READ | Host::STORAGE_WRITE |
+                                Host::STORAGE_CREATE | Host::STORAGE_EXCL);
+  struct stat st;
+  CHECK(f != 0);
+  if (!f) {
+    return;
+  }
+  CHECK(f->Allocate(10000));
+  CHECK(f->Size() == 10000);
+  CHECK(holds(f, 0, 10000, true));
+  CHECK(writePattern(f, 0, 10000));
+  CHECK(f->Truncate(5000));
+  CHECK(f->Size() == 5000);
+  CHECK(holds(f, 0, 5000));
+  // the bytes cut off read as zeros once the file grows again
+  CHECK(f->Truncate(6000));
+  CHECK(holds(f, 0, 5000) && holds(f, 5000, 1000, true));
+  // allocating less than the file keeps it
+  CHECK(f->Allocate(100) && f->Size() == 6000 && holds(f, 0, 5000));
+  CHECK(f->Truncate(0) && f->Size() == 0);
+  CHECK(f->Allocate(4096) && writePattern(f, 0, 4096) && f->Sync());
+  CHECK(stat(path.c_str(), &st) == 0 && st.st_size == 4096);
+  CHECK(f->Fd() >= 0);
+  delete f;
+}
+
+// Directory indices are kept by the SdFat layer over every backend, as they
+// are on a FAT volume
+static void testDirIndex(Host::Storage *s, const std::string &dir) {
+  static const char *names[] = {"A.TXT", "B.TXT", "C.TXT"};
+  FatFileSystem fs;
+  FatFile root, f;
+  uint16_t index[3];
+  char name[16];
+  Host::SetStorage(s);
+  CHECK(fs.begin((dir + "/card").c_str()));
+  for (int i = 0; i < 3; i++) {
+    f = fs.open(names[i], O_CREAT | O_RDWR);
+    CHECK(f.isOpen());
+    CHECK(f.write(names[i], 5) == 5);
+    index[i] = f.dirIndex();
+    f.close();
+  }
+  CHECK(index[0] != index[1] && index[1] != index[2] && index[0] != index[2]);
+  CHECK(root.openRoot(&fs));
+  for (int i = 0; i < 3; i++) {
+    CHECK(f.open(&root, index[i], O_READ));
+    CHECK(f.getName(name, sizeof(name)) && !strcmp(name, names[i]));
+    CHECK(f.fileSize() == 5);
+    f.close();
+  }
+  // removing a file keeps the indices of the others
+  CHECK(fs.remove(names[1]));
+  CHECK(!f.open(&root, index[1], O_READ));
+  f = fs.open(names[2], O_READ);
+  CHECK(f.isOpen() && f.dirIndex() == index[2]);
+  f.close();
+  root.close();
+  Host::SetStorage(Host::PosixStorage());
+}
+
+int main(int argc, char **argv) {
+  static const char *backends[] = {"posix", "mmap"};
+  std::string root;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:")) != -1) {
+    if (opt == 'd') {
+      root = optarg;
+    } else {
+      fprintf(stderr, "usage: pdp-storagetest [-d DIR]\n");
+      return 2;
+    }
+  }
+  if (root.empty()) {
+    char tmp[] = "/tmp/pdp-storagetest.XXXXXX";
+    if (!mkdtemp(tmp)) {
+      perror("mkdtemp");
+      return 2;
+    }
+    root = tmp;
+  }
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    std::string dir = root + "/" + backends[i];
+    unsigned before = failures;
+    Host::Storage *s = Host::StorageNamed(backends[i]);
+    backend = backends[i];
+    mkdir(dir.c_str(), 0755);
+    testReadWrite(s, dir);
+    testTruncateAllocate(s, dir);
+    testDirIndex(s, dir);
+    printf("%s: %s\n", backend, failures == before ? "ok" : "FAILED");
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+#include "RF24.h"
+#include "SdFat.h"
+
+#include "journal.h"
+#include "util.h"
+
+namespace PDP {
+
+static uint8_t checksum(JournalRecord &rec) {
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < sizeof(rec) - 1; i++) {
+    sum += ((uint8_t *)&rec)[i];
+  }
+  return sum;
+}
+
+Error_t JournalAppend(FatFileSystem &fs, JournalRecord &rec) {
+  FatFile f;
+  if (OpenFile(fs, JOURNAL_FILENAME, f, O_RDWR | O_CREAT)) {
+    return ERROR_IO_OPEN;
+  }
+  if (f.fileSize() >= JOURNAL_MAX_RECORDS * sizeof(rec)) {
+    // only the last record matters, start over
+    f.truncate(0);
+  }
+  // append after the last whole record, overwriting any torn one
+  rec.check = checksum(rec);
+  if (!f.seekSet(f.fileSize() - f.fileSize() % sizeof(rec)) ||
+      f.write(&rec, sizeof(rec)) != sizeof(rec)) {
+    f.close();
+    return ERROR_IO_WRITE;
+  }
+  f.close();
+  return ERROR_NONE;
+}
+
+Error_t JournalClose(FatFileSystem &fs) {
+  JournalRecord rec;
+  if (!JournalLoad(fs, rec)) {
+    // nothing to close
+    return ERROR_NONE;
+  }
+  rec.open = false;
+  return JournalAppend(fs, rec);
+}
+
+bool JournalLoad(FatFileSystem &fs, JournalRecord &rec) {
+  FatFile f;
+  uint16_t n;
+  if (OpenFile(fs, JOURNAL_FILENAME, f, O_READ)) {
+    return false;
+  }
+  // the last record may have been torn by a power cut, fall back to the one
+  // before it
+  for (n = f.fileSize() / sizeof(rec); n > 0; n--) {
+    if (f.seekSet((uint32_t)(n - 1) * sizeof(rec)) &&
+        f.read(&rec, sizeof(rec)) == sizeof(rec) &&
+        rec.check == checksum(rec)) {
+      f.close();
+      return rec.open;
+    }
+  }
+  f.close();
+  return false;
+}
+
+} // namespace PDP
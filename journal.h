@@ -0,0 +1,49 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "SdFat.h"
+#include "consts.h"
+
+namespace PDP {
+
+// The session journal is a file on the SD card recording the file an RX station
+// is receiving, so the transfer can be resumed at once after a reboot or power
+// cycle instead of waiting for a hash chain on a channel found by timeouts.
+//
+// Records are only ever appended, and the last intact record describes the
+// current session. The journal is started over once it holds
+// JOURNAL_MAX_RECORDS records.
+typedef struct __attribute__((__packed__)) {
+  // root hash of the file being received
+  uint8_t rootHash[32];
+  // station id the RX was using. A TX that has heard from the station keeps
+  // its request slot for a few listen periods.
+  uint16_t stationId;
+  // where the scan for missing chunks continues
+  uint16_t lastScanned;
+  // the lowest chunk of the missing set the RX last requested, and the number
+  // of chunks in it. The set holds at most MAX_MISSING_SCAN chunks.
+  uint16_t missingFirst, missingCount;
+  // channel the file's TX was last heard on
+  uint8_t channel;
+  // station id of the file's TX, if the channel was handed to it while the RX
+  // listened, otherwise 0. A TX does not send its own id, so the source the
+  // RX first heard is never known by id.
+  uint16_t txStationId;
+  // false once the file is complete, or the session was abandoned
+  bool open;
+  // sum of the record's other bytes, to detect a torn write
+  uint8_t check;
+} JournalRecord;
+
+// Append rec to the journal
+Error_t JournalAppend(FatFileSystem &fs, JournalRecord &rec);
+// Record that the current session is over
+Error_t JournalClose(FatFileSystem &fs);
+// Load the current session into rec. Returns false if there is no open
+// session.
+bool JournalLoad(FatFileSystem &fs, JournalRecord &rec);
+
+} // namespace PDP
+
+#endif // JOURNAL_H
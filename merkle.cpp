@@ -1,4 +1,5 @@
 #include "merkle.h"
+#include "metrics.h"
 #include "stackmon.h"
 #include "util.h"
 
@@ -71,6 +72,85 @@ void MerkleFile::SetChunkComplete(uint16_t chunk) {
   this->WriteHashBlock(j);
 }
 
+uint16_t MerkleFile::NextIncomplete(uint16_t chunk) {
+  uint8_t k = 0, treeDepth;
+  uint16_t numLeafs, base = 0;
+  this->ReadHeaderBlock();
+  treeDepth = this->Block.HeaderBlock.treeDepth;
+  numLeafs = this->Block.HeaderBlock.numLeafs;
+  // chunk is the index of a node within tree layer k, which holds numLeafs >>
+  // k nodes beginning at hash block base
+  while (!this->Error && chunk < (numLeafs >> k)) {
+    this->ReadHashBlock(base + chunk);
+    if (!(this->Block.HashBlock.flags & MERKLE_CHUNK_COMPLETE)) {
+      if (k == 0) {
+        return chunk;
+      }
+      // some leaf below this node is incomplete, descend to left child
+      k--;
+      base -= numLeafs >> k;
+      chunk <<= 1;
+      continue;
+    }
+    // every leaf below this node is complete, skip to the next node. while
+    // that node is a left child, its parent's subtree begins at the same
+    // leaf, so check the parent instead.
+    chunk++;
+    while (!(chunk & 0x01) && k < treeDepth) {
+      base += numLeafs >> k;
+      k++;
+      chunk >>= 1;
+    }
+  }
+  return numLeafs;
+}
+
+uint32_t ChooseChunkSize(uint32_t fileSize) {
+  uint32_t chunkSize, best = MAX_CHUNK_SIZE, packets, bestPackets = 0xffffffff;
+  uint16_t numChunks, chainPackets;
+  uint8_t treeDepth = 0, waste;
+  if (fileSize == 0) {
+    return MAX_CHUNK_SIZE;
+  }
+  // the shallowest tree that can hold the file
+  while (treeDepth < MAX_TREE_DEPTH &&
+         (MAX_CHUNK_SIZE << treeDepth) < fileSize) {
+    treeDepth++;
+  }
+  chainPackets =
+      (sizeof(HashChainHeader) + 32 * treeDepth + PACKET_PAYLOAD - 1) /
+      PACKET_PAYLOAD;
+  // start from the smallest chunk that fits the file in the tree's leaves,
+  // grown to the end of its data message's last packet
+  chunkSize = ((fileSize - 1) >> treeDepth) + 1;
+  waste = (sizeof(DataChunkHeader) + chunkSize) % PACKET_PAYLOAD;
+  if (waste > 0) {
+    chunkSize += PACKET_PAYLOAD - waste;
+  }
+  // try each larger chunk that fills whole packets, then MAX_CHUNK_SIZE, and
+  // keep the one that sends the file, hash chains included, in the fewest
+  // packets. MAX_CHUNK_SIZE wins ties, as it lines up with sectors.
+  while (true) {
+    if (chunkSize > MAX_CHUNK_SIZE) {
+      chunkSize = MAX_CHUNK_SIZE;
+    }
+    numChunks = (fileSize - 1) / chunkSize + 1;
+    packets = (uint32_t)numChunks *
+              (chainPackets + (sizeof(DataChunkHeader) + chunkSize +
+                               PACKET_PAYLOAD - 1) /
+                                  PACKET_PAYLOAD);
+    if (packets < bestPackets ||
+        (chunkSize == MAX_CHUNK_SIZE && packets == bestPackets)) {
+      best = chunkSize;
+      bestPackets = packets;
+    }
+    if (chunkSize == MAX_CHUNK_SIZE) {
+      return best;
+    }
+    chunkSize += PACKET_PAYLOAD;
+  }
+}
+
 void MerkleFile::Open(FatFileSystem &fs, const char *merkleFilename,
                       FatFile &src) {
   this->reset();
@@ -79,20 +159,93 @@ void MerkleFile::Open(FatFileSystem &fs, const char *merkleFilename,
     this->ReadHeaderBlock();
   }
   if (this->Error) {
-    // error opening merkle tree or reading header block, create it from
-    // srcFilename
-    this->Error = ERROR_NONE;
+    // missing, or still being built. merkle files of local files are built a
+    // slice at a time by Build, so the radio is never kept waiting.
+    this->reset();
+    this->Error = ERROR_MERKLE_INCOMPLETE;
+  }
+}
+
+bool MerkleFile::Build(FatFileSystem &fs, const char *merkleFilename,
+                       FatFile &src, uint16_t &steps) {
+  Sha256Context ctx;
+  uint8_t buf[MAX_CHUNK_SIZE];
+  uint16_t numChunks, numLeafs, numNodes, built;
+  uint32_t chunkSize;
+  int len;
+  this->reset();
+  this->Error = OpenFile(fs, merkleFilename, this->m, O_RDWR);
+  if (!this->Error) {
+    this->readBlock(0);
+  }
+  if (!this->Error && this->Block.type == BLOCK_HEADER) {
+    // already built
+    this->m.close();
+    return true;
+  }
+  if (src.fileSize() == 0 || src.fileSize() > MAX_FILE_SIZE) {
+    // never indexed, so don't leave a merkle file behind for the next walk
+    if (this->m.isOpen()) {
+      this->m.remove();
+    }
+    this->reset();
+    this->Error = ERROR_CHUNKFILE_EMPTY_OR_TOO_BIG;
+    return false;
+  }
+  if (this->Error || this->Block.type != BLOCK_HEADER_PARTIAL ||
+      !this->buildMatches(src)) {
+    // start over
+    this->reset();
     this->Error =
         OpenFile(fs, merkleFilename, this->m, O_CREAT | O_TRUNC | O_RDWR);
+    if (!this->Error) {
+      this->buildBegin(src);
+    }
     if (this->Error) {
-      // give up
-      return;
+      this->m.close();
+      return false;
     }
-    this->createFrom(src, MAX_CHUNK_SIZE);
-    if (!this->Error) {
-      this->ReadHeaderBlock();
+  }
+  chunkSize = this->Block.HeaderBlock.chunkSize;
+  numChunks = this->Block.HeaderBlock.numChunks;
+  numLeafs = this->Block.HeaderBlock.numLeafs;
+  numNodes = this->Block.HeaderBlock.numNodes;
+  built = this->Block.HeaderBlock.built;
+  // hash blocks are written in order: the chunks' leafs, the empty leafs,
+  // then each internal node from its children, which are always written
+  // before it
+  for (; steps > 0 && built < numNodes && !this->Error; steps--, built++) {
+    sha256_init(&ctx);
+    if (built < numChunks) {
+      if (!src.seekSet((uint32_t)built * chunkSize) ||
+          (len = src.read(buf, chunkSize)) <= 0) {
+        this->Error = ERROR_IO_READCHUNK;
+        break;
+      }
+      sha256_update(&ctx, buf, len);
+    } else if (built >= numLeafs) {
+      this->ReadHashBlock(2 * (built - numLeafs));
+      sha256_update(&ctx, this->Block.HashBlock.hash, 32);
+      this->ReadHashBlock(2 * (built - numLeafs) + 1);
+      sha256_update(&ctx, this->Block.HashBlock.hash, 32);
+    }
+    sha256_final(&ctx, this->Block.HashBlock.hash);
+    // the whole file is local, so every node is complete
+    this->Block.HashBlock.flags = MERKLE_HASH_KNOWN | MERKLE_CHUNK_COMPLETE;
+    this->WriteHashBlock(built);
+  }
+  if (!this->Error) {
+    // record progress once the blocks it covers are written
+    this->readBlock(0);
+    this->Block.HeaderBlock.built = built;
+    if (built == numNodes) {
+      this->Block.type = BLOCK_HEADER;
     }
+    this->writeBlock(0);
+    this->sync();
   }
+  this->m.close();
+  return !this->Error && built == numNodes;
 }
 
 void MerkleFile::Open(FatFileSystem &fs, const char *merkleFilename,
@@ -152,16 +305,18 @@ void MerkleFile::Open(FatFileSystem &fs, const char *merkleFilename,
       this->SetChunkComplete(i);
     }
     // merkle file created ok
-    this->m.sync();
+    this->sync();
     this->ReadHeaderBlock();
   }
 }
 
-/*void MerkleFile::Open(FatFileSystem &fs, const char *merkleFilename) {
+void MerkleFile::Open(FatFileSystem &fs, const char *merkleFilename) {
   this->reset();
   this->Error = OpenFile(fs, merkleFilename, this->m, O_RDWR);
-  this->ReadHeaderBlock();
-}*/
+  if (!this->Error) {
+    this->ReadHeaderBlock();
+  }
+}
 
 bool MerkleFile::Verify(DataChunkMessage &msg) {
   Sha256Context ctx;
@@ -192,22 +347,25 @@ bool MerkleFile::Verify(DataChunkMessage &msg) {
     return false;
   }
   // compute chunk hash and compare to merkle file
-  if (!this->HashKnown(msg.Message.Header.chunk)) {
-    // don't know the hash for this chunk yet, impossible to verify
-    Serial.println(F("DRJ NOHASH ERR"));
-    return false;
-  }
   sha256_init(&ctx);
   sha256_update(&ctx, msg.Message.chunk, msg.Message.Header.chunkSize);
   sha256_final(&ctx, hash);
-  if (memcmp(hash, this->Block.HashBlock.hash, 32)) {
-    // hash mismatch, reject
+  if (!this->VerifyChunkHash(msg.Message.Header.chunk, hash)) {
+    // hash unknown or mismatch, reject
     Serial.println(StackCount());
     Serial.println(F("DRJ CORRUPT ERR"));
     return false;
   }
   return true;
 }
+
+bool MerkleFile::VerifyChunkHash(uint16_t chunk, uint8_t *hash) {
+  if (!this->HashKnown(chunk)) {
+    // don't know the hash for this chunk yet, impossible to verify
+    return false;
+  }
+  return (memcmp(hash, this->Block.HashBlock.hash, 32) == 0);
+}
 // Scans chunks of src, comparing them to the stored hashes
 // in this MerkleFile.
 // If writeHashes is false, computed hashes that match those in this MerkleFile
@@ -221,7 +379,7 @@ void MerkleFile::scanChunks(FatFile &src, bool writeHashes,
   const uint32_t chunkSize = this->Block.HeaderBlock.chunkSize;
   const uint16_t numLeafs = this->Block.HeaderBlock.numLeafs;
   const uint16_t numChunks = this->Block.HeaderBlock.numChunks;
-  void *hashTarget = writeHashes ? this->Block.HashBlock.hash : buf;
+  uint8_t *hashTarget = writeHashes ? this->Block.HashBlock.hash : buf;
   uint16_t i;
   src.seekSet(0);
   for (i = 0; i < numChunks; i++) {
@@ -250,15 +408,12 @@ void MerkleFile::scanChunks(FatFile &src, bool writeHashes,
   }
 }
 
-void MerkleFile::createFrom(FatFile &src, const uint32_t chunkSize) {
-  Sha256Context ctx;
-  uint16_t numChunks, numLeafs, numNodes, i;
-  uint32_t srcSize = src.fileSize();
+void MerkleFile::buildBegin(FatFile &src) {
+  uint16_t numChunks, numLeafs, numNodes;
+  uint32_t srcSize = src.fileSize(), chunkSize;
+  uint16_t date = 0, time = 0;
   uint8_t treeDepth = 0;
-  if (srcSize == 0 || srcSize > MAX_FILE_SIZE) {
-    this->Error = ERROR_CHUNKFILE_EMPTY_OR_TOO_BIG;
-    return;
-  }
+  chunkSize = AUTO_CHUNK_SIZE ? ChooseChunkSize(srcSize) : MAX_CHUNK_SIZE;
   numChunks = (srcSize - 1) / chunkSize + 1;
   // compute treeDepth = ceil(log_2(numChunks)) and numLeafs = 2^treeDepth
   while ((numLeafs = (1 << treeDepth)) < numChunks) {
@@ -267,24 +422,26 @@ void MerkleFile::createFrom(FatFile &src, const uint32_t chunkSize) {
   // compute number of internal and leaf nodes in merkle tree
   numNodes = (1 << (treeDepth + 1)) - 1;
   // write header block
-  this->Block.type = BLOCK_HEADER;
+  this->Block.type = BLOCK_HEADER_PARTIAL;
   this->Block.HeaderBlock.fileSize = srcSize;
   this->Block.HeaderBlock.chunkSize = chunkSize;
   this->Block.HeaderBlock.numChunks = numChunks;
   this->Block.HeaderBlock.numLeafs = numLeafs;
   this->Block.HeaderBlock.numNodes = numNodes;
   this->Block.HeaderBlock.treeDepth = treeDepth;
+  this->Block.HeaderBlock.built = 0;
+  src.getModifyDateTime(&date, &time);
+  this->Block.HeaderBlock.modifyDate = date;
+  this->Block.HeaderBlock.modifyTime = time;
   this->writeBlock(0);
-  // Initialize hash blocks with zeroes
-  memset(&this->Block, 0, sizeof(this->Block));
-  for (i = 0; i < numNodes; i++) {
-    this->WriteHashBlock(i);
-  }
-  // scan src file and write hashes to leaf nodes
-  this->scanChunks(src, true, ctx);
-  // fill in internal hash nodes
-  this->fill(ctx);
-  this->m.sync();
+}
+
+bool MerkleFile::buildMatches(FatFile &src) {
+  uint16_t date = 0, time = 0;
+  src.getModifyDateTime(&date, &time);
+  return this->Block.HeaderBlock.fileSize == src.fileSize() &&
+         this->Block.HeaderBlock.modifyDate == date &&
+         this->Block.HeaderBlock.modifyTime == time;
 }
 
 void MerkleFile::ReadHashBlock(uint16_t n) {
@@ -330,6 +487,7 @@ void MerkleFile::writeBlock(uint16_t n) {
     this->Error = ERROR_IO_SEEK;
     return;
   }
+  MetricInc(METRIC_SD_BLOCK_WRITES);
   if (m.write(&this->Block, sizeof(this->Block)) != sizeof(this->Block)) {
     // short write
     this->Error = ERROR_IO_WRITE;
@@ -355,6 +513,7 @@ void MerkleFile::readBlock(uint16_t n) {
     this->Error = ERROR_IO_SEEK;
     return;
   }
+  MetricInc(METRIC_SD_BLOCK_READS);
   if (m.read(&this->Block, sizeof(this->Block)) != sizeof(this->Block)) {
     // short read
     this->Error = ERROR_IO_READ;
@@ -362,6 +521,15 @@ void MerkleFile::readBlock(uint16_t n) {
   }
 }
 
+void MerkleFile::sync() {
+  MetricInc(METRIC_SD_SYNCS);
+  this->m.sync();
+}
+
+void MerkleFile::Close() { this->reset(); }
+
+bool MerkleFile::IsOpen() { return this->m.isOpen(); }
+
 void MerkleFile::reset() {
   this->Error = ERROR_NONE;
   if (this->m.isOpen()) {
@@ -371,24 +539,9 @@ void MerkleFile::reset() {
 
 void MerkleFile::Load(HashChainMessage &msg, uint16_t chunk) {
   uint8_t i, treeDepth;
-  uint16_t j;
-  // Initialize message header
-  this->ReadHeaderBlock();
-  msg.Message.Header.version = PROTOCOL_VERSION;
-  msg.Message.Header.chunk = chunk;
-  msg.Message.Header.filename[MAX_FILENAME_LENGTH] =
-      0; // filename set using SetFilename
-  msg.Message.Header.numChunks = this->Block.HeaderBlock.numChunks;
-  msg.Message.Header.fileSize = this->Block.HeaderBlock.fileSize;
-  msg.Message.Header.chunkSize = this->Block.HeaderBlock.chunkSize;
-  treeDepth = msg.Message.Header.treeDepth = this->Block.HeaderBlock.treeDepth;
-  msg.Message.Header.messageLength =
-      sizeof(msg.Message.Header) + 32 * treeDepth;
-  j = 0;
-  this->ReadRootHashBlock();
-  memcpy(msg.Message.Header.rootHash, this->Block.HashBlock.hash, 32);
-  this->ReadHashBlock(chunk);
-  memcpy(msg.Message.Header.chunkHash, this->Block.HashBlock.hash, 32);
+  uint16_t j = 0;
+  this->LoadHeader(msg.Message.Header, chunk);
+  treeDepth = msg.Message.Header.treeDepth;
   for (i = 0; i < treeDepth; i++) {
     this->ReadHashBlock((j + (chunk >> i)) ^ 0x01);
     if (this->Error) {
@@ -399,7 +552,26 @@ void MerkleFile::Load(HashChainMessage &msg, uint16_t chunk) {
   }
 }
 
+void MerkleFile::LoadHeader(HashChainHeader &header, uint16_t chunk) {
+  // Initialize message header
+  this->ReadHeaderBlock();
+  header.version = PROTOCOL_VERSION;
+  header.chunk = chunk;
+  header.filename[MAX_FILENAME_LENGTH] = 0; // filename set using SetFilename
+  header.numChunks = this->Block.HeaderBlock.numChunks;
+  header.fileSize = this->Block.HeaderBlock.fileSize;
+  header.chunkSize = this->Block.HeaderBlock.chunkSize;
+  header.treeDepth = this->Block.HeaderBlock.treeDepth;
+  header.messageLength = sizeof(header) + 32 * header.treeDepth;
+  this->ReadRootHashBlock();
+  memcpy(header.rootHash, this->Block.HashBlock.hash, 32);
+  this->ReadHashBlock(chunk);
+  memcpy(header.chunkHash, this->Block.HashBlock.hash, 32);
+}
+
 void MerkleFile::Save(HashChainMessage &msg) {
+  Sha256Context ctx;
+  uint8_t hash[32];
   uint8_t i;
   uint16_t treeLayerWidth = (1 << msg.Message.Header.treeDepth);
   uint16_t j = 0, chunk = msg.Message.Header.chunk;
@@ -417,18 +589,34 @@ void MerkleFile::Save(HashChainMessage &msg) {
   Serial.print(F("HOK "));
   Serial.println(chunk);
   this->SetHash(chunk, msg.Message.Header.chunkHash);
+  memcpy(hash, msg.Message.Header.chunkHash, 32);
   for (i = 0; i <= msg.VerifyDepth; i++) {
     uint16_t n = (j + (chunk >> i)) ^ 0x01;
     if (this->HashKnown(n)) {
       // remainder of chain already known, stop here
-      this->m.sync();
+      this->sync();
       return;
     }
     this->SetHash(n, msg.Message.chain[i]);
     j += treeLayerWidth;
     treeLayerWidth >>= 1;
+    if (i < msg.VerifyDepth) {
+      // save the chunk's ancestors too, below the known one Verify stopped at.
+      // they are siblings in the chains of other chunks, which this station
+      // may broadcast.
+      sha256_init(&ctx);
+      if (chunk & (1 << i)) {
+        sha256_update(&ctx, msg.Message.chain[i], 32);
+        sha256_update(&ctx, hash, 32);
+      } else {
+        sha256_update(&ctx, hash, 32);
+        sha256_update(&ctx, msg.Message.chain[i], 32);
+      }
+      sha256_final(&ctx, hash);
+      this->SetHash(j + (chunk >> (i + 1)), hash);
+    }
   }
-  this->m.sync();
+  this->sync();
 }
 
 // Returns true if the hash chain is valid
@@ -446,6 +634,10 @@ bool MerkleFile::Verify(HashChainMessage &msg) {
         (msg.Message.Header.treeDepth > MAX_TREE_DEPTH) ||
         (msg.Message.Header.fileSize > MAX_FILE_SIZE) ||
         (msg.Message.Header.chunkSize > MAX_CHUNK_SIZE) ||
+        (msg.Message.Header.chunkSize == 0) ||
+        (msg.Message.Header.numChunks !=
+         (msg.Message.Header.fileSize + msg.Message.Header.chunkSize - 1) /
+             msg.Message.Header.chunkSize) ||
         (msg.Message.Header.numChunks > (1 << msg.Message.Header.treeDepth)) ||
         (msg.Message.Header.chunk >= msg.Message.Header.numChunks)) {
       // reject
@@ -588,4 +780,31 @@ void MerkleFile::fill(Sha256Context &ctx) {
   }
 }
 
+HashChainReader::HashChainReader(MerkleFile &m, uint16_t chunk,
+                                 uint8_t treeDepth)
+    : m(m), chunk(chunk), cursor(0), treeDepth(treeDepth) {}
+
+int HashChainReader::read(void *buf, uint16_t n) {
+  uint8_t *dst = (uint8_t *)buf;
+  uint16_t done = 0;
+  while (done < n && this->cursor < 32 * this->treeDepth) {
+    uint8_t i = this->cursor >> 5, offset = this->cursor & 0x1f;
+    uint16_t len = 32 - offset;
+    // index of the first node in tree layer i. layers are stored leafs first,
+    // and layer k holds 2^(treeDepth - k) nodes
+    uint16_t j = (1 << (this->treeDepth + 1)) - (1 << (this->treeDepth + 1 - i));
+    this->m.ReadHashBlock((j + (this->chunk >> i)) ^ 0x01);
+    if (this->m.Error) {
+      break;
+    }
+    if (len > n - done) {
+      len = n - done;
+    }
+    memcpy(dst + done, this->m.Block.HashBlock.hash + offset, len);
+    done += len;
+    this->cursor += len;
+  }
+  return done;
+}
+
 } // namespace PDP
@@ -12,6 +12,15 @@ typedef enum {
   MERKLE_CHUNK_COMPLETE = (1 << 1),
 } MerkleBlockFlags_t;
 
+// Returns the chunk size for a file of fileSize bytes. The tree is kept as
+// shallow as MAX_CHUNK_SIZE chunks allow, and of the chunk sizes whose data
+// messages fill whole packets, the one that sends the file in the fewest
+// packets is chosen. Large files use the sector friendly MAX_CHUNK_SIZE.
+//
+// The chunk size is part of the root hash, so it depends on the file alone:
+// every station holding the file must choose the same one, whatever its link.
+uint32_t ChooseChunkSize(uint32_t fileSize);
+
 class MerkleFile {
 public:
   MerkleFile();
@@ -24,11 +33,22 @@ public:
   // HashChainMessage
   void Open(FatFileSystem &fs, const char *merkleFilename,
             HashChainMessage &msg);
-  // Opens merkleFilename.
+  // Opens merkleFilename, the merkle file of src.
   //
-  // If merkleFilename does not exist, or has invalid header, creates it from
-  // the data in FatFile
+  // If merkleFilename does not exist, or has not been completely built by
+  // Build, Error is set to ERROR_MERKLE_INCOMPLETE
   void Open(FatFileSystem &fs, const char *merkleFilename, FatFile &src);
+  // Build merkleFilename from src, continuing where the last call stopped,
+  // writing at most steps blocks. steps is reduced by the number of blocks
+  // written. Returns true once the merkle file is complete. The merkle file is
+  // closed on return.
+  bool Build(FatFileSystem &fs, const char *merkleFilename, FatFile &src,
+             uint16_t &steps);
+  // Opens merkleFilename, setting Error if it does not exist or has an invalid
+  // header
+  void Open(FatFileSystem &fs, const char *merkleFilename);
+  void Close();
+  bool IsOpen();
   void ReadHashBlock(uint16_t n);
   void WriteHashBlock(
       uint16_t n); // TODO private? only expose Save(HashChainMessage&)
@@ -38,46 +58,88 @@ public:
   void SetHash(uint16_t chunk, uint8_t *hash);
   bool ChunkComplete(uint16_t chunk);
   void SetChunkComplete(uint16_t chunk);
+  // Returns the first chunk index >= chunk that is not marked complete, or
+  // numLeafs if there is none. Subtrees marked complete are skipped without
+  // reading their leafs.
+  uint16_t NextIncomplete(uint16_t chunk);
   // load the hash chain for the specified chunk into 'msg'
   void Load(HashChainMessage &msg, uint16_t chunk);
-  // save the hash chain specified in 'msg'
+  // load only the header of the hash chain message for the specified chunk.
+  // the chain itself can be read with a HashChainReader
+  void LoadHeader(HashChainHeader &header, uint16_t chunk);
+  // save the hash chain specified in 'msg', and the hashes of the chunk's
+  // ancestors computed from it, so every chain of a known chunk can be sent
   void Save(HashChainMessage &msg);
   // verify msg is a valid hash chain
   bool Verify(HashChainMessage &msg);
   // verify msg is a valid chunk. returns false if the correct hash for this
   // chunk is not yet known.
   bool Verify(DataChunkMessage &msg);
+  // returns true if hash is the known hash of chunk. returns false if the
+  // correct hash for this chunk is not yet known.
+  bool VerifyChunkHash(uint16_t chunk, uint8_t *hash);
   // Check that the contents of f match this merkle file's hashes
   void Check(FatFile &f);
   // Fill in unknown hashes in this merkle file, if their children are known
   void Fill();
-  struct {
+  // packed, so merkle files have the same layout on every platform
+  struct __attribute__((__packed__)) {
     uint8_t type;
     union {
       struct {
         uint8_t flags;
         uint8_t hash[32];
       } HashBlock;
-      struct {
+      struct __attribute__((__packed__)) {
         uint32_t fileSize;
         uint32_t chunkSize;
         uint16_t numChunks, numLeafs, numNodes;
         uint8_t treeDepth;
+        // number of hash blocks written, while the header is
+        // BLOCK_HEADER_PARTIAL
+        uint16_t built;
+        // FAT modification date and time of the source when the build began,
+        // so a build is only resumed on the same contents
+        uint16_t modifyDate, modifyTime;
       } HeaderBlock;
     };
   } Block;
   Error_t Error;
 
 private:
-  void createFrom(FatFile &src, const uint32_t chunkSize);
+  // Begin building from src, writing a BLOCK_HEADER_PARTIAL header
+  void buildBegin(FatFile &src);
+  // true if the BLOCK_HEADER_PARTIAL header in Block was written for src as
+  // it is now
+  bool buildMatches(FatFile &src);
   void scanChunks(FatFile &src, bool writeHashes, Sha256Context &ctx);
   void fill(Sha256Context &ctx);
   void readBlock(uint16_t n);
   void writeBlock(uint16_t n);
+  void sync();
   void reset();
   FatFile m;
 };
 
+// HashChainReader reads the hash chain of a chunk directly from a MerkleFile's
+// hash blocks, in the order it appears in HashChainMessage's chain field. It is
+// a MultipartStreamSplitter source, so a hash chain can be broadcast without
+// buffering the whole chain.
+//
+// Clobbers the MerkleFile's Block.
+class HashChainReader {
+public:
+  HashChainReader(MerkleFile &m, uint16_t chunk, uint8_t treeDepth);
+  // Read the next n bytes of the hash chain into buf. Returns the number of
+  // bytes read, which is less than n on error or at the end of the chain.
+  int read(void *buf, uint16_t n);
+
+private:
+  MerkleFile &m;
+  uint16_t chunk, cursor;
+  uint8_t treeDepth;
+};
+
 } // namespace PDP
 
 #endif // MERKLE_H
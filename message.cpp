@@ -23,8 +23,9 @@ void HashChainMessage::Print() {
 
 ListenForReqMessage::ListenForReqMessage() {}
 
-ListenForReqMessage::ListenForReqMessage(ChunkQueue &q)
-    : Message{PROTOCOL_VERSION, sizeof(this->Message), {}, {}, ChunkQueue(q)} {}
+ListenForReqMessage::ListenForReqMessage(ChunkSet &q)
+    : Message{PROTOCOL_VERSION, sizeof(this->Message), {}, {}, 0, 0, 0, {},
+              ChunkSet(q)} {}
 
 // TODO figure out how to combine the following two methods
 void ReqMessage::SetRootHash(uint8_t *rootHash) {
@@ -39,77 +40,243 @@ void DataChunkMessage::SetRootHash(uint8_t *rootHash) {
   memcpy(this->Message.Header.rootHash, rootHash, 32);
 }
 
-ChunkQueue::ChunkQueue() : len(0) {}
+// ChunkSet::len of a set stored as a bitmap
+static const uint8_t CHUNKSET_BITMAP = 0xff;
 
-uint8_t ChunkQueue::Length() { return this->len; }
+ChunkSet::ChunkSet() : len(0) {}
 
-bool ChunkQueue::Verify() {
-  if (this->len > REQ_QUEUE_LEN) {
+uint16_t ChunkSet::Length() {
+  uint16_t n = 0;
+  if (this->len == CHUNKSET_BITMAP) {
+    for (uint8_t i = 0; i < sizeof(this->bitmap.bits); i++) {
+      for (uint8_t b = this->bitmap.bits[i]; b; b &= b - 1) {
+        n++;
+      }
+    }
+    return n;
+  }
+  for (uint8_t i = 0; i < this->len; i++) {
+    n += this->ranges[i].count;
+  }
+  return n;
+}
+
+bool ChunkSet::Verify() {
+  if (this->len == CHUNKSET_BITMAP) {
+    return true;
+  }
+  if (this->len > MAX_CHUNKSET_RANGES) {
     this->len = 0;
     return false;
   }
+  for (uint8_t i = 0; i < this->len; i++) {
+    if (this->ranges[i].count == 0 ||
+        (i > 0 && (uint32_t)this->ranges[i - 1].first +
+                          this->ranges[i - 1].count >=
+                      this->ranges[i].first)) {
+      // empty, unsorted, or overlapping runs
+      this->len = 0;
+      return false;
+    }
+  }
   return true;
 }
 
-bool ChunkQueue::Push(uint16_t chunk) {
-  if (this->len >= REQ_QUEUE_LEN) {
+bool ChunkSet::toBitmap(uint16_t first, uint32_t end) {
+  uint8_t i, n = this->len;
+  // first and count of each run, as the bitmap overwrites them
+  uint16_t runs[MAX_CHUNKSET_RANGES * 2];
+  memcpy(runs, this->ranges, n * sizeof(this->ranges[0]));
+  if (n > 0) {
+    if (runs[0] < first) {
+      first = runs[0];
+    }
+    if ((uint32_t)runs[2 * n - 2] + runs[2 * n - 1] > end) {
+      end = (uint32_t)runs[2 * n - 2] + runs[2 * n - 1];
+    }
+  }
+  if (end - first > CHUNKSET_BITMAP_CHUNKS) {
     return false;
   }
-  for (uint8_t i = 0; i < this->len; i++) {
-    if (this->reqs[i] == chunk) {
-      return true;
-    }
+  this->len = CHUNKSET_BITMAP;
+  this->bitmap.first = first;
+  memset(this->bitmap.bits, 0, sizeof(this->bitmap.bits));
+  for (i = 0; i < n; i++) {
+    this->setBits(runs[2 * i], runs[2 * i + 1], true);
   }
-  this->reqs[this->len] = chunk;
-  this->len++;
   return true;
 }
 
-bool ChunkQueue::Push(ChunkQueue &q) {
-  for (uint8_t i = 0; i < q.len; i++) {
-    if (!this->Push(q.reqs[i])) {
+void ChunkSet::setBits(uint16_t first, uint16_t count, bool on) {
+  for (uint16_t i = first - this->bitmap.first; count > 0; i++, count--) {
+    if (on) {
+      this->bitmap.bits[i >> 3] |= 1 << (i & 7);
+    } else {
+      this->bitmap.bits[i >> 3] &= ~(1 << (i & 7));
+    }
+  }
+}
+
+uint16_t ChunkSet::findBit(uint16_t i, bool on) {
+  for (; i < CHUNKSET_BITMAP_CHUNKS; i++) {
+    if (((this->bitmap.bits[i >> 3] >> (i & 7)) & 1) == on) {
+      break;
+    }
+  }
+  return i;
+}
+
+bool ChunkSet::Push(uint16_t chunk) { return this->Push(chunk, 1); }
+
+bool ChunkSet::Push(uint16_t first, uint16_t count) {
+  uint32_t end = (uint32_t)first + count;
+  uint8_t i, j;
+  if (count == 0) {
+    return true;
+  }
+  if (this->len == CHUNKSET_BITMAP) {
+    if (first < this->bitmap.first ||
+        end > (uint32_t)this->bitmap.first + CHUNKSET_BITMAP_CHUNKS) {
+      // outside the bitmap
       return false;
     }
+    this->setBits(first, count, true);
+    return true;
   }
+  // skip runs that end before first
+  for (i = 0; i < this->len &&
+              (uint32_t)this->ranges[i].first + this->ranges[i].count < first;
+       i++)
+    ;
+  // runs i..j-1 overlap or touch [first, end), merge them
+  for (j = i; j < this->len && this->ranges[j].first <= end; j++) {
+    if (this->ranges[j].first < first) {
+      first = this->ranges[j].first;
+    }
+    if ((uint32_t)this->ranges[j].first + this->ranges[j].count > end) {
+      end = (uint32_t)this->ranges[j].first + this->ranges[j].count;
+    }
+  }
+  if (j == i) {
+    // no run to merge with, insert a new run at i
+    if (this->len >= MAX_CHUNKSET_RANGES) {
+      // no room, switch to a bitmap if it can hold the set
+      if (!this->toBitmap(first, end)) {
+        return false;
+      }
+      this->setBits(first, count, true);
+      return true;
+    }
+    memmove(&this->ranges[i + 1], &this->ranges[i],
+            (this->len - i) * sizeof(this->ranges[0]));
+    this->len++;
+  } else if (j > i + 1) {
+    // runs i+1..j-1 are merged into run i
+    memmove(&this->ranges[i + 1], &this->ranges[j],
+            (this->len - j) * sizeof(this->ranges[0]));
+    this->len -= j - i - 1;
+  }
+  this->ranges[i].first = first;
+  this->ranges[i].count = end - first;
   return true;
 }
 
-uint16_t ChunkQueue::Pop() {
+uint16_t ChunkSet::Pop() {
+  uint16_t chunk;
+  if (this->len == CHUNKSET_BITMAP) {
+    chunk = this->findBit(0, true);
+    if (chunk == CHUNKSET_BITMAP_CHUNKS) {
+      // set is empty
+      return 0;
+    }
+    chunk += this->bitmap.first;
+    this->setBits(chunk, 1, false);
+    return chunk;
+  }
   if (this->len == 0) {
-    // queue is empty
+    // set is empty
     return 0;
   }
+  chunk = this->ranges[0].first;
+  this->Remove(chunk);
+  return chunk;
+}
+
+bool ChunkSet::PopRange(uint16_t &first, uint16_t &count) {
+  if (this->len == CHUNKSET_BITMAP) {
+    uint16_t i = this->findBit(0, true);
+    if (i == CHUNKSET_BITMAP_CHUNKS) {
+      return false;
+    }
+    first = this->bitmap.first + i;
+    count = this->findBit(i, false) - i;
+    this->setBits(first, count, false);
+    return true;
+  }
+  if (this->len == 0) {
+    return false;
+  }
+  first = this->ranges[0].first;
+  count = this->ranges[0].count;
   this->len--;
-  return this->reqs[this->len];
+  memmove(&this->ranges[0], &this->ranges[1],
+          this->len * sizeof(this->ranges[0]));
+  return true;
 }
 
-void ChunkQueue::Remove(uint16_t chunk) {
+void ChunkSet::Remove(uint16_t chunk) {
+  if (this->len == CHUNKSET_BITMAP) {
+    if (chunk >= this->bitmap.first &&
+        chunk - this->bitmap.first < CHUNKSET_BITMAP_CHUNKS) {
+      this->setBits(chunk, 1, false);
+    }
+    return;
+  }
   for (uint8_t i = 0; i < this->len; i++) {
-    if (this->reqs[i] == chunk) {
+    uint16_t first = this->ranges[i].first;
+    uint16_t last = first + this->ranges[i].count - 1;
+    if (chunk < first || chunk > last) {
+      continue;
+    }
+    if (first == last) {
+      // run holds only chunk, remove it
       this->len--;
-      memmove(&this->reqs[i], &this->reqs[i + 1],
-              (this->len - i) * sizeof(this->reqs[0]));
-      return;
+      memmove(&this->ranges[i], &this->ranges[i + 1],
+              (this->len - i) * sizeof(this->ranges[0]));
+    } else if (chunk == first) {
+      this->ranges[i].first++;
+      this->ranges[i].count--;
+    } else if (chunk == last) {
+      this->ranges[i].count--;
+    } else if (this->len < MAX_CHUNKSET_RANGES) {
+      // split run around chunk
+      memmove(&this->ranges[i + 1], &this->ranges[i],
+              (this->len - i) * sizeof(this->ranges[0]));
+      this->len++;
+      this->ranges[i].count = chunk - first;
+      this->ranges[i + 1].first = chunk + 1;
+      this->ranges[i + 1].count = last - chunk;
+    } else if (this->toBitmap(chunk, chunk + 1)) {
+      // no room to split the run, clear chunk's bit instead
+      this->setBits(chunk, 1, false);
     }
+    return;
   }
 }
 
-void ChunkQueue::Clear() { this->len = 0; }
+void ChunkSet::Clear() { this->len = 0; }
 
-/*
-void ChunkQueue::Print() {
-  for (uint8_t i = 0; i < this->len; i++) {
-    Serial.print(this->reqs[i]);
-    Serial.print(F(" "));
-  }
-  Serial.println();
+YieldAckMessage::YieldAckMessage() {}
+
+YieldAckMessage::YieldAckMessage(uint16_t stationId, uint8_t *rootHash)
+    : Message{PROTOCOL_VERSION, sizeof(this->Message), stationId, {}} {
+  memcpy(this->Message.rootHash, rootHash, YIELD_ACK_HASH_LEN);
 }
-*/
 
 ReqMessage::ReqMessage() {}
 
-ReqMessage::ReqMessage(ChunkQueue &q)
-    : Message{PROTOCOL_VERSION, sizeof(this->Message), {}, ChunkQueue(q)} {}
+ReqMessage::ReqMessage(ChunkSet &q)
+    : Message{PROTOCOL_VERSION, sizeof(this->Message), {}, ChunkSet(q)} {}
 
 bool ReqMessage::Verify() { return this->Message.q.Verify(); }
 
@@ -5,92 +5,127 @@
 
 namespace PDP {
 
+struct __attribute__((__packed__)) HashChainHeader {
+  // TODO split these first 2 fields into a MultipartHeader struct?
+  // TODO hash the header fields into rootHash to verify they're received
+  // correctly?
+  // Protocol version
+  uint8_t version;
+  // Length of this message, including verion and messageSize, in bytes
+  uint32_t messageLength;
+  // Index of chunk this hash chain describes
+  uint16_t chunk;
+  // Total number of chunks in this file
+  uint16_t numChunks;
+  // Tree depth, and also the length of the hash chain
+  uint8_t treeDepth;
+  // Maximum chunk size in bytes. Only last chunk may be smaller.
+  uint32_t chunkSize;
+  // File size in bytes
+  uint32_t fileSize;
+  // Hash of chunk
+  uint8_t chunkHash[32];
+  // Merkle tree root hash
+  uint8_t rootHash[32];
+  // To ensure filename is null-terminated, filename[MAX_FILENAME_LENGTH]
+  // must equal '\0'.
+  char filename[MAX_FILENAME_LENGTH + 1];
+};
+
 class HashChainMessage {
 public:
   HashChainMessage();
   void Print();
   void SetFilename(const char *filename);
-  struct __attribute__((__packed__)) {   // Message
-    struct __attribute__((__packed__)) { // Header
-      // TODO split these first 2 fields into a MultipartHeader struct?
-      // TODO hash the header fields into rootHash to verify they're received
-      // correctly?
-      // Protocol version
-      uint8_t version;
-      // Length of this message, including verion and messageSize, in bytes
-      uint32_t messageLength;
-      // Index of chunk this hash chain describes
-      uint16_t chunk;
-      // Total number of chunks in this file
-      uint16_t numChunks;
-      // Tree depth, and also the length of the hash chain
-      uint8_t treeDepth;
-      // Maximum chunk size in bytes. Only last chunk may be smaller.
-      uint32_t chunkSize;
-      // File size in bytes
-      uint32_t fileSize;
-      // Hash of chunk
-      uint8_t chunkHash[32];
-      // Merkle tree root hash
-      uint8_t rootHash[32];
-      // To ensure filename is null-terminated, filename[MAX_FILENAME_LENGTH]
-      // must equal '\0'.
-      char filename[MAX_FILENAME_LENGTH + 1];
-    } Header;
+  struct __attribute__((__packed__)) { // Message
+    HashChainHeader Header;
     uint8_t chain[MAX_TREE_DEPTH][32];
   } Message;
   bool Verified;
   uint8_t VerifyDepth;
 };
 
+struct __attribute__((__packed__)) DataChunkHeader {
+  // Protocol version
+  uint8_t version;
+  // Length of this message, including verion and messageSize, in bytes
+  uint32_t messageLength;
+  // Index of chunk
+  uint16_t chunk;
+  // Merkle tree root hash
+  uint8_t rootHash[32];
+  // Size of this chunk in bytes
+  uint32_t chunkSize;
+};
+
 // TODO rename ChunkMessage
 class DataChunkMessage {
 public:
   void SetRootHash(uint8_t *rootHash);
-  struct __attribute__((__packed__)) {   // Message
-    struct __attribute__((__packed__)) { // Header
-      // Protocol version
-      uint8_t version;
-      // Length of this message, including verion and messageSize, in bytes
-      uint32_t messageLength;
-      // Index of chunk
-      uint16_t chunk;
-      // Merkle tree root hash
-      uint8_t rootHash[32];
-      // Size of this chunk in bytes
-      uint32_t chunkSize;
-    } Header;
+  struct __attribute__((__packed__)) { // Message
+    DataChunkHeader Header;
     uint8_t chunk[MAX_CHUNK_SIZE];
   } Message;
 };
 
-class __attribute__((__packed__)) ChunkQueue {
+// A set of chunk indices, stored as up to MAX_CHUNKSET_RANGES sorted,
+// non-overlapping runs of consecutive chunks, so a few bytes can describe
+// hundreds of chunks. When scattered chunks need more runs than that, the set
+// is stored instead as a bitmap of the CHUNKSET_BITMAP_CHUNKS chunks from its
+// lowest one, until it is cleared.
+class __attribute__((__packed__)) ChunkSet {
 public:
-  ChunkQueue();
-  uint8_t Length();
+  ChunkSet();
+  // Returns the number of chunks in the set
+  uint16_t Length();
   bool Verify();
-  // Add a chunk index to the queue if it does not already exist. If the
-  // ChunkQueue is full, false is returned, otherwise true is returned.
+  // Add a chunk index to the set if it does not already exist. If the
+  // ChunkSet has no room for another run, and the chunk is outside the
+  // bitmap's chunks, false is returned, otherwise true is returned.
   bool Push(uint16_t chunk);
-  bool Push(ChunkQueue &q);
-  // Remove and return the last added chunk index from the queue
+  // Add the count chunks starting at first, as with Push(chunk)
+  bool Push(uint16_t first, uint16_t count);
+  // Remove and return the lowest chunk index in the set
   uint16_t Pop();
-  // removes chunk if it is in the queue
+  // Remove the lowest run of chunks from the set, returning it in first and
+  // count. Returns false if the set is empty.
+  bool PopRange(uint16_t &first, uint16_t &count);
+  // removes chunk if it is in the set. If chunk is inside a run, the set has
+  // no room to split it, and the bitmap can't hold the set, chunk is left in
+  // the set.
   void Remove(uint16_t chunk);
   void Clear();
-  void Print();
 
 private:
+  // number of runs, or CHUNKSET_BITMAP if the set is a bitmap
   uint8_t len;
-  uint16_t reqs[REQ_QUEUE_LEN];
-  friend class ReqMessage;
+  union __attribute__((__packed__)) {
+    struct __attribute__((__packed__)) {
+      uint16_t first;
+      uint16_t count;
+    } ranges[MAX_CHUNKSET_RANGES];
+    struct __attribute__((__packed__)) {
+      // chunk of the lowest bit
+      uint16_t first;
+      uint8_t bits[CHUNKSET_BITMAP_CHUNKS / 8];
+    } bitmap;
+  };
+  // Store the set as a bitmap, which must also hold the chunks from first to
+  // end. Returns false if it can't.
+  bool toBitmap(uint16_t first, uint32_t end);
+  // Set or clear the bits of the count chunks starting at first, all of which
+  // are in the bitmap
+  void setBits(uint16_t first, uint16_t count, bool on);
+  // Returns the first bit from bit i on that is set, or clear if on is false,
+  // or CHUNKSET_BITMAP_CHUNKS if there is none
+  uint16_t findBit(uint16_t i, bool on);
 };
 
 // TODO rename ListenPeriodStartMessage
 class ListenForReqMessage {
 public:
   ListenForReqMessage();
-  ListenForReqMessage(ChunkQueue &q);
+  ListenForReqMessage(ChunkSet &q);
   void SetRootHash(uint8_t *rootHash);
   struct __attribute__((__packed__)) { // Message
     // Protocol version
@@ -101,20 +136,46 @@ public:
     uint8_t rootHash[32];
     // Duration of TX's listen period in milliseconds
     uint16_t listenDuration;
+    // Length of each request slot in milliseconds, the number of contention
+    // slots at the start of the listen period, and the number of slots owned
+    // by a station after them
+    uint8_t slotDuration;
+    uint8_t contentionSlots;
+    uint8_t numSlots;
+    // Owner station id of each slot
+    uint16_t slots[REQ_SLOTS];
     // chunks missing from TX station. If an RX station has at least one of
     // these chunks, it will request a channel yield so that RX can become the
     // TX station.
-    ChunkQueue q;
+    ChunkSet q;
     // If zero, the TX is not yielding the channel. If non-zero, contains
     // the RX station id that now owns the channel.
     uint16_t yieldToRxId;
   } Message;
 };
 
+// Sent by an RX station to accept a channel yielded to it. The RX station
+// begins broadcasting immediately after sending it.
+class YieldAckMessage {
+public:
+  YieldAckMessage();
+  YieldAckMessage(uint16_t stationId, uint8_t *rootHash);
+  struct __attribute__((__packed__)) {
+    // Protocol version
+    uint8_t version;
+    // Length of this message, including verion and messageSize, in bytes
+    uint32_t messageLength;
+    // Station id the channel was yielded to
+    uint16_t stationId;
+    // First bytes of the merkle tree root hash of the file being broadcast
+    uint8_t rootHash[YIELD_ACK_HASH_LEN];
+  } Message;
+};
+
 class ReqMessage {
 public:
   ReqMessage();
-  ReqMessage(ChunkQueue &q);
+  ReqMessage(ChunkSet &q);
   void SetRootHash(uint8_t *rootHash);
   // Returns true if this is a valid ReqMessage
   bool Verify();
@@ -125,7 +186,9 @@ public:
     uint32_t messageLength;
     // Merkle tree root hash
     uint8_t rootHash[32];
-    ChunkQueue q;
+    ChunkSet q;
+    // Station id of the RX station making the request
+    uint16_t stationId;
     // If zero, the RX station is not requesting a channel yield. If non-zero
     // contains the station id that wishes to own the channel.
     uint16_t yieldRequest;
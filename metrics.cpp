@@ -0,0 +1,52 @@
+#include "Arduino.h"
+
+#include "metrics.h"
+
+namespace PDP {
+
+Metrics_t Metrics;
+
+void MetricDrop(Error_t cause) {
+  if (cause == ERROR_RX_TIMEOUT) {
+    MetricInc(METRIC_DROP_TIMEOUT);
+  } else if (cause == ERROR_MULTIPART_BAD_SEQUENCE) {
+    MetricInc(METRIC_DROP_SEQUENCE);
+  } else {
+    MetricInc(METRIC_DROP_INVALID);
+  }
+}
+
+void MetricTime(Histogram_t h, uint32_t value) {
+  uint32_t v = value >> HIST_BASE_SHIFT[h];
+  uint8_t i = 0;
+  while (v > 0 && i < HIST_BUCKETS - 1) {
+    v >>= 1;
+    i++;
+  }
+  if (Metrics.buckets[h][i] < 0xffff) {
+    Metrics.buckets[h][i]++;
+  }
+  Metrics.sums[h] += value;
+}
+
+// Write len bytes of buf to Serial, adding them to sum
+static void dumpBytes(const void *buf, uint16_t len, uint8_t &sum) {
+  const uint8_t *b = (const uint8_t *)buf;
+  for (uint16_t i = 0; i < len; i++) {
+    sum += b[i];
+  }
+  Serial.write(b, len);
+}
+
+void MetricsDump() {
+  const uint8_t header[] = {'P',          'M',       METRICS_DUMP_VERSION,
+                            METRIC_COUNT, HIST_COUNT, HIST_BUCKETS};
+  uint32_t now = millis();
+  uint8_t sum = 0;
+  dumpBytes(header, sizeof(header), sum);
+  dumpBytes(&now, sizeof(now), sum);
+  dumpBytes(&Metrics, sizeof(Metrics), sum);
+  Serial.write(sum);
+}
+
+} // namespace PDP
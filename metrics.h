@@ -0,0 +1,96 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "consts.h"
+#include "stdint.h"
+
+namespace PDP {
+
+// Protocol counters. They count from power on, and are never reset.
+typedef enum {
+  // packets taken from RxRing, and packets queued for TX including every
+  // RETRANSMITS copy
+  METRIC_PACKETS_RX = 0,
+  METRIC_PACKETS_TX,
+  // multipart messages dropped part way through, by cause: a packet did not
+  // arrive in time, a packet was missed, or the message was too long or
+  // described the wrong file
+  METRIC_DROP_TIMEOUT,
+  METRIC_DROP_SEQUENCE,
+  METRIC_DROP_INVALID,
+  // hash chains of the file being received, or of any file before one is
+  // chosen, received in full, that did and did not verify
+  METRIC_CHAINS_VERIFIED,
+  METRIC_CHAINS_REJECTED,
+  // chunks saved from the radio, and copied from other local files
+  METRIC_CHUNKS_SAVED,
+  METRIC_CHUNKS_COPIED,
+  // chunks not saved: already saved (DUP), hash not known yet (NHS), or the
+  // data did not match the hash (DRJ)
+  METRIC_CHUNKS_DUP,
+  METRIC_CHUNKS_NHS,
+  METRIC_CHUNKS_DRJ,
+  // requests sent by this station as RX, and heard from others as TX
+  METRIC_REQUESTS_SENT,
+  METRIC_REQUESTS_HEARD,
+  // channel yields to another station, and from another station
+  METRIC_YIELDS_GIVEN,
+  METRIC_YIELDS_TAKEN,
+  // TX sessions and chunk bursts cut short by a busy channel
+  METRIC_INTERFERENCE,
+  // SD card operations of transfers: merkle file blocks, whole chunks, and
+  // syncs of either file
+  METRIC_SD_BLOCK_READS,
+  METRIC_SD_BLOCK_WRITES,
+  METRIC_SD_CHUNK_READS,
+  METRIC_SD_CHUNK_WRITES,
+  METRIC_SD_SYNCS,
+  METRIC_COUNT,
+} Metric_t;
+
+// Latency histograms. Bucket 0 counts values below the histogram's base,
+// bucket i values below base << i, and the last bucket everything above.
+typedef enum {
+  // MerkleFile::Verify of a received hash chain (microseconds, base 1024)
+  HIST_CHAIN_VERIFY = 0,
+  // FlushChunks making saved chunks durable and complete (microseconds, base
+  // 1024)
+  HIST_CHUNK_FLUSH,
+  // a channel yield, from first offer to acceptance (milliseconds, base 16)
+  HIST_HANDOFF,
+  HIST_COUNT,
+} Histogram_t;
+
+const uint8_t HIST_BUCKETS = 8;
+// log2 of each histogram's base, in its unit
+const uint8_t HIST_BASE_SHIFT[HIST_COUNT] = {10, 10, 4};
+
+// Sent over Serial to request a MetricsDump
+const char METRICS_DUMP_REQUEST = 'M';
+const uint8_t METRICS_DUMP_VERSION = 1;
+
+typedef struct {
+  uint32_t counters[METRIC_COUNT];
+  // bucket counts stop at 0xffff
+  uint16_t buckets[HIST_COUNT][HIST_BUCKETS];
+  // sum of the values recorded in each histogram, in its unit
+  uint32_t sums[HIST_COUNT];
+} Metrics_t;
+
+extern Metrics_t Metrics;
+
+inline void MetricInc(Metric_t metric) { Metrics.counters[metric]++; }
+// Count a multipart message dropped with error cause
+void MetricDrop(Error_t cause);
+// Record value in histogram h
+void MetricTime(Histogram_t h, uint32_t value);
+
+// Write the metrics to Serial in a compact binary form: the bytes 'P' 'M',
+// METRICS_DUMP_VERSION, METRIC_COUNT, HIST_COUNT and HIST_BUCKETS, then
+// millis() and Metrics, little-endian as on AVR, then the low byte of the sum
+// of every byte before it.
+void MetricsDump();
+
+} // namespace PDP
+
+#endif // METRICS_H
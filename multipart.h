@@ -6,7 +6,7 @@
 
 namespace PDP {
 
-typedef struct {
+typedef struct __attribute__((__packed__)) {
   uint8_t sequenceNum;
   uint16_t messageId;
   uint8_t protocolVersion;
@@ -24,6 +24,7 @@ public:
   //
   // Returns true if there are more parts to be emitted
   bool Get(uint8_t *dst);
+  Error_t Error;
 
 private:
   uint8_t *src;
@@ -35,7 +36,8 @@ private:
 template <uint16_t PartSize>
 MultipartSplitter<PartSize>::MultipartSplitter(void *src, uint16_t len,
                                                uint8_t seq, uint16_t mid)
-    : src((uint8_t *)src), len(len), seq(seq), mid(mid), cursor(0) {}
+    : Error(ERROR_NONE), src((uint8_t *)src), len(len), seq(seq), mid(mid),
+      cursor(0) {}
 
 template <uint16_t PartSize> bool MultipartSplitter<PartSize>::More() {
   return (this->cursor < this->len);
@@ -54,6 +56,77 @@ bool MultipartSplitter<PartSize>::Get(uint8_t *dst) {
   return this->More();
 }
 
+// MultipartStreamSplitter emits the same parts as a MultipartSplitter, but
+// only the first headerLen bytes of the message are held in memory. The
+// remainder of the message is read from src directly into each part as it is
+// emitted, so large message bodies are never buffered.
+//
+// Source must provide int read(void *buf, uint16_t n), returning the number of
+// bytes read.
+template <uint16_t PartSize, class Source> class MultipartStreamSplitter {
+public:
+  MultipartStreamSplitter(void *header, uint16_t headerLen, Source &src,
+                          uint16_t len, uint8_t seq, uint16_t mid);
+  // Returns true if there are more parts to be emitted
+  bool More();
+  // Gets the next size PartSize part of the multipart message into dst
+  //
+  // Returns true if there are more parts to be emitted
+  bool Get(uint8_t *dst);
+  // Set to ERROR_IO_READ if src returned fewer bytes than requested
+  Error_t Error;
+
+private:
+  uint8_t *header;
+  Source &src;
+  uint16_t headerLen, len;
+  uint8_t seq;
+  uint16_t mid, cursor;
+};
+
+template <uint16_t PartSize, class Source>
+MultipartStreamSplitter<PartSize, Source>::MultipartStreamSplitter(
+    void *header, uint16_t headerLen, Source &src, uint16_t len, uint8_t seq,
+    uint16_t mid)
+    : Error(ERROR_NONE), header((uint8_t *)header), src(src),
+      headerLen(headerLen), len(len), seq(seq), mid(mid), cursor(0) {}
+
+template <uint16_t PartSize, class Source>
+bool MultipartStreamSplitter<PartSize, Source>::More() {
+  if (this->Error) {
+    // previous error, stop splitting
+    return false;
+  }
+  return (this->cursor < this->len);
+}
+
+template <uint16_t PartSize, class Source>
+bool MultipartStreamSplitter<PartSize, Source>::Get(uint8_t *dst) {
+  MultipartHeader *mpHeader = (MultipartHeader *)dst;
+  uint16_t n = (this->cursor + PartSize - 3 < this->len)
+                   ? PartSize - 3
+                   : this->len - this->cursor;
+  mpHeader->sequenceNum = this->seq;
+  mpHeader->messageId = this->mid;
+  dst += 3;
+  if (this->cursor < this->headerLen) {
+    // part begins inside the in-memory header
+    uint16_t h = this->headerLen - this->cursor;
+    if (h > n) {
+      h = n;
+    }
+    memcpy(dst, this->header + this->cursor, h);
+    dst += h;
+    n -= h;
+  }
+  if (n > 0 && this->src.read(dst, n) != (int)n) {
+    this->Error = ERROR_IO_READ;
+  }
+  this->seq++;
+  this->cursor += PartSize - 3;
+  return this->More();
+}
+
 // MultipartCombiner reassembles the parts emitted by a MultipartSplitter
 template <uint16_t PartSize> class MultipartCombiner {
 public:
@@ -126,6 +199,106 @@ template <uint16_t PartSize> uint16_t MultipartCombiner<PartSize>::Remaining() {
   return this->len - this->cursor;
 }
 
+// MultipartStreamCombiner reassembles the parts emitted by a MultipartSplitter
+// or MultipartStreamSplitter, but only the first headerLen bytes of the
+// message are stored, in header. The remainder of each part is left in place
+// and described by Payload and PayloadLength, so it can be consumed directly
+// from the received packet.
+template <uint16_t PartSize> class MultipartStreamCombiner {
+public:
+  MultipartStreamCombiner(void *header, uint16_t headerLen, uint16_t len,
+                          uint8_t seq);
+  // Returns true if there are more parts to be combined
+  bool More();
+  // Returns true if all headerLen bytes of the header have been combined
+  bool HeaderComplete();
+  // Puts the size PartSize part of the multipart message stored in src
+  //
+  // Returns true if there are more parts to be combined
+  bool Put(uint8_t *src);
+  // The bytes past the header in the part most recently Put. PayloadLength is
+  // zero if the part was ignored or held only header bytes.
+  uint8_t *Payload;
+  uint16_t PayloadLength;
+  Error_t Error;
+
+private:
+  uint8_t *header;
+  uint16_t headerLen, len;
+  uint8_t seq;
+  uint16_t cursor, mid;
+  bool knowMid;
+};
+
+template <uint16_t PartSize>
+MultipartStreamCombiner<PartSize>::MultipartStreamCombiner(void *header,
+                                                           uint16_t headerLen,
+                                                           uint16_t len,
+                                                           uint8_t seq)
+    : Payload(0), PayloadLength(0), Error(ERROR_NONE),
+      header((uint8_t *)header), headerLen(headerLen), len(len), seq(seq),
+      cursor(0), knowMid(false) {}
+
+template <uint16_t PartSize> bool MultipartStreamCombiner<PartSize>::More() {
+  if (this->Error) {
+    // previous error, stop combining
+    return false;
+  }
+  return (this->cursor < this->len);
+}
+
+template <uint16_t PartSize>
+bool MultipartStreamCombiner<PartSize>::HeaderComplete() {
+  return (this->cursor >= this->headerLen);
+}
+
+template <uint16_t PartSize>
+bool MultipartStreamCombiner<PartSize>::Put(uint8_t *src) {
+  MultipartHeader *mpHeader = (MultipartHeader *)src;
+  uint16_t n;
+  this->PayloadLength = 0;
+  if (this->Error || !this->More()) {
+    return false;
+  }
+  // compare src's sequence number to expected value
+  if (mpHeader->sequenceNum == this->seq - 1) {
+    // duplicate part, ignore
+    return true;
+  }
+  if (mpHeader->sequenceNum != this->seq) {
+    // invalid sequence number, error
+    this->Error = ERROR_MULTIPART_BAD_SEQUENCE;
+    return false;
+  }
+  if (!this->knowMid) {
+    this->knowMid = true;
+    this->mid = mpHeader->messageId;
+  } else {
+    if (mpHeader->messageId != this->mid) {
+      // part of some other message, ignore
+      return true;
+    }
+  }
+  n = (this->len - this->cursor > PartSize - 3) ? PartSize - 3
+                                                : this->len - this->cursor;
+  src += 3;
+  if (this->cursor < this->headerLen) {
+    // part begins inside the header
+    uint16_t h = this->headerLen - this->cursor;
+    if (h > n) {
+      h = n;
+    }
+    memcpy(this->header + this->cursor, src, h);
+    src += h;
+    n -= h;
+  }
+  this->Payload = src;
+  this->PayloadLength = n;
+  this->seq++;
+  this->cursor += PartSize - 3;
+  return this->More();
+}
+
 } // namespace PDP
 
 #endif // MULTIPART_H
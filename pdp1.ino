@@ -11,6 +11,11 @@
 #include "usha256.h"
 #include "util.h"
 #include "power.h"
+#include "radiorx.h"
+#include "rootindex.h"
+#include "channels.h"
+#include "chunkindex.h"
+#include "journal.h"
 #include <SPI.h>
 
 #include <avr/wdt.h>
@@ -18,6 +23,7 @@
 
 SdFatSoftSpi<PIN_SD_MISO, PIN_SD_MOSI, PIN_SD_SCK> sd;
 RF24 radio(PIN_RADIO_CE, PIN_RADIO_CS);
+PDP::ChannelTable channels;
 
 using namespace PDP;
 
@@ -122,9 +128,10 @@ void testTransmitter(RF24 &r, FatFileSystem &fs) {
 
 bool yieldflag;
 FatFile rxf;
+MerkleFile rxm;
 
 void testReceiver(RF24 &radio, FatFileSystem &fs) {
-  Receiver r(radio, fs, rxf, 10000);
+  Receiver r(radio, fs, rxf, rxm, 10000);
   //  while(1) {
   r.Listen();
   if (r.Error = ERROR_RX_TIMEOUT) {
@@ -174,7 +181,8 @@ void doTransmission(const char *filename, ChunkFile &c, MerkleFile &m) {
 */
 
 void transmitFile(FatFileSystem &fs, FatFile &src) {
-  Transmitter t(radio, fs, src);
+  MerkleFile m;
+  Transmitter t(radio, fs, src, m);
   t.Broadcast();
   Serial.print(F("TX EXIT "));
   Serial.println(t.Error);
@@ -326,7 +334,12 @@ void setup() {
   radio.openWritingPipe((uint8_t *)"BROAD");
   radio.openReadingPipe(1, (uint8_t *)"BROAD");
 
-  CollectEntropy(sd.card(), radio);
+  channels.Load(sd);
+  CollectEntropy(sd.card(), radio, channels);
+  if (RootIndexCheck(sd) || ChunkIndexCheck(sd)) {
+    Serial.println(F("IDXERR"));
+  }
+  RadioRxBegin(radio, PIN_RADIO_IRQ);
   
   Run();
   // Should never reach here
@@ -0,0 +1,67 @@
+#include "radiorx.h"
+#include <SPI.h>
+
+namespace PDP {
+
+PacketRing<RX_RING_LEN> RxRing;
+
+static RF24 *rxRadio;
+static bool irqEnabled;
+
+void RadioRxBegin(RF24 &radio, uint8_t irqPin) {
+  rxRadio = &radio;
+  // only raise the IRQ for received packets
+  radio.maskIRQ(true, true, false);
+  pinMode(irqPin, INPUT);
+  // mask the IRQ while the main program is using the radio's SPI bus
+  SPI.usingInterrupt(digitalPinToInterrupt(irqPin));
+  attachInterrupt(digitalPinToInterrupt(irqPin), RadioRxDrain, FALLING);
+  irqEnabled = true;
+}
+
+bool RadioRxIrqEnabled() { return irqEnabled; }
+
+void RadioRxPoll(RF24 &radio) {
+  if (irqEnabled) {
+    return;
+  }
+  rxRadio = &radio;
+  RadioRxDrain();
+}
+
+void RadioRxDrain() {
+  static uint8_t dropped[32];
+  bool txOk, txFail, rxReady;
+  if (!rxRadio) {
+    return;
+  }
+  // clear the IRQ flags first, so a packet arriving while the FIFO is being
+  // drained raises the IRQ again
+  rxRadio->whatHappened(txOk, txFail, rxReady);
+  while (rxRadio->available()) {
+    uint8_t *slot = RxRing.Reserve();
+    uint8_t *last;
+    uint32_t now;
+    if (!slot) {
+      // ring full, drop packet
+      rxRadio->read(dropped, 32);
+      continue;
+    }
+    last = RxRing.Last();
+    rxRadio->read(slot, 32);
+    now = micros();
+    if (last && now - RxRing.LastAt < RX_COPY_WINDOW &&
+        !memcmp(slot, last, 3)) {
+      // same sequence number and message id as the previous packet, just
+      // after it, so this is one of its RETRANSMITS copies. don't commit it,
+      // leaving more room for new packets. a later message with the same
+      // header, such as the next SEQ_TAKING_REQS, is committed.
+      RxRing.LastAt = now;
+      continue;
+    }
+    RxRing.Commit();
+    RxRing.LastAt = now;
+  }
+}
+
+} // namespace PDP
@@ -0,0 +1,121 @@
+#ifndef RADIORX_H
+#define RADIORX_H
+
+#include "RF24.h"
+#include "consts.h"
+#include "stdint.h"
+
+namespace PDP {
+
+// PacketRing is a lock-free single-producer, single-consumer ring of radio
+// packets. The radio IRQ handler is the only producer and the protocol code
+// the only consumer: head is only written by Commit and tail only by Get and
+// Clear, so neither side needs to disable interrupts.
+//
+// Size must be a power of 2, and at most 128.
+template <uint8_t Size> class PacketRing {
+public:
+  PacketRing();
+  // Producer: returns the slot the next packet should be read into, or 0 if
+  // the ring is full. The packet is not visible to the consumer until Commit.
+  uint8_t *Reserve();
+  // Producer: publish the packet in the slot returned by Reserve
+  void Commit();
+  // Producer: returns the most recently committed packet, or 0 if no packet
+  // has been committed since the ring was made or cleared
+  uint8_t *Last();
+  // Consumer: copy the oldest packet into dst and remove it from the ring.
+  // Returns false if the ring is empty.
+  bool Get(uint8_t *dst);
+  // Consumer: discard all packets in the ring, and forget the last one, so
+  // Last returns 0 until the next Commit
+  void Clear();
+  uint8_t Length();
+  // Largest number of packets ever waiting in the ring
+  uint8_t HighWater;
+  // Number of packets dropped because the ring was full
+  uint16_t Overflows;
+  // Producer: when the last packet, or a copy of it, was heard, in micros()
+  uint32_t LastAt;
+
+private:
+  volatile uint8_t head, tail;
+  bool committed;
+  uint8_t packets[Size][32];
+};
+
+template <uint8_t Size>
+PacketRing<Size>::PacketRing()
+    : HighWater(0), Overflows(0), LastAt(0), head(0), tail(0),
+      committed(false) {}
+
+template <uint8_t Size> uint8_t *PacketRing<Size>::Reserve() {
+  if ((uint8_t)(this->head - this->tail) >= Size) {
+    this->Overflows++;
+    return 0;
+  }
+  return this->packets[this->head & (Size - 1)];
+}
+
+template <uint8_t Size> void PacketRing<Size>::Commit() {
+  uint8_t len;
+  // slot contents must be written before head is advanced
+  __asm__ __volatile__("" ::: "memory");
+  this->head++;
+  this->committed = true;
+  len = this->head - this->tail;
+  if (len > this->HighWater) {
+    this->HighWater = len;
+  }
+}
+
+template <uint8_t Size> uint8_t *PacketRing<Size>::Last() {
+  if (!this->committed) {
+    return 0;
+  }
+  return this->packets[(uint8_t)(this->head - 1) & (Size - 1)];
+}
+
+template <uint8_t Size> bool PacketRing<Size>::Get(uint8_t *dst) {
+  if (this->head == this->tail) {
+    // ring is empty
+    return false;
+  }
+  // slot contents must not be read before head is
+  __asm__ __volatile__("" ::: "memory");
+  memcpy(dst, this->packets[this->tail & (Size - 1)], 32);
+  __asm__ __volatile__("" ::: "memory");
+  this->tail++;
+  return true;
+}
+
+template <uint8_t Size> void PacketRing<Size>::Clear() {
+  this->tail = this->head;
+  // if a packet is committed in between, its copies are not recognised, and
+  // reach the consumer, which ignores repeated parts anyway
+  this->committed = false;
+}
+
+template <uint8_t Size> uint8_t PacketRing<Size>::Length() {
+  return this->head - this->tail;
+}
+
+// Packets received by the radio, filled by RadioRxDrain
+extern PacketRing<RX_RING_LEN> RxRing;
+
+// Attach RadioRxDrain to the radio's IRQ pin, so received packets are moved
+// into RxRing as soon as they arrive, even while the protocol code is busy
+// with the SD card or hashing. irqPin must be 2 or 3.
+void RadioRxBegin(RF24 &radio, uint8_t irqPin);
+// Returns true if RadioRxBegin has been called
+bool RadioRxIrqEnabled();
+// Move all packets waiting in the radio's RX FIFO into RxRing. This is the
+// IRQ handler.
+void RadioRxDrain();
+// Unless RadioRxBegin has been called, drain radio's RX FIFO into RxRing. The
+// consumer calls it while waiting for packets, in place of the IRQ.
+void RadioRxPoll(RF24 &radio);
+
+} // namespace PDP
+
+#endif // RADIORX_H
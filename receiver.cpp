@@ -1,5 +1,8 @@
 #include "receiver.h"
+#include "chunkindex.h"
 #include "multipart.h"
+#include "rootindex.h"
+#include "usha256.h"
 #include "util.h"
 
 namespace PDP {
@@ -68,18 +71,72 @@ void ToHashFilename(uint8_t hash[32], char *dataFilename) {
 }
 
 Receiver::Receiver(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile,
-                   const uint16_t timeout)
-    : stationId(random(1, MAX_STATION_ID)),
-      TransceiverBase(radio, fs, chunkFile), _fs(fs), _timeout(timeout),
-      txIncomplete(false), yieldRequests(0) {
+                   MerkleFile &m, const uint16_t timeout)
+    : TransceiverBase(radio, fs, chunkFile, m), Received(0), Dropped(0),
+      stationId(random(1, MAX_STATION_ID)), _fs(fs), _timeout(timeout),
+      txIncomplete(false), txStationId(0), txHeard(false), yieldRequests(0),
+      slotWait(REQ_STATIONS / REQ_SLOTS), backoff(0), filesDone(0),
+      numCopies(0), sinceJournal(0) {
   this->knowRoot = chunkFile.isOpen();
+  this->anyFile = !this->knowRoot;
+  memset(this->doneRoots, 0, sizeof(this->doneRoots));
+}
+
+bool Receiver::Resume(JournalRecord &rec) {
+  if (!this->knowRoot || this->Error ||
+      memcmp(this->rootHash, rec.rootHash, 32)) {
+    return false;
+  }
+  // keep the station id the TX knows, so this station's request goes in its
+  // slot in the first listen period
+  this->stationId = rec.stationId;
+  this->txStationId = rec.txStationId;
+  // scan again from the missing set last requested, whose chunks may not have
+  // arrived, rather than from past it
+  this->lastScanned = rec.lastScanned < this->numChunks ? rec.lastScanned : 0;
+  if (rec.missingCount > 0 && rec.missingFirst < this->numChunks) {
+    this->lastScanned = rec.missingFirst;
+  }
+  this->updateMissing();
+  return true;
+}
+
+void Receiver::journal() {
+  JournalRecord rec;
+  memcpy(rec.rootHash, this->rootHash, 32);
+  ChunkSet missing(this->missing);
+  rec.stationId = this->stationId;
+  rec.lastScanned = this->lastScanned;
+  rec.missingCount = missing.Length();
+  rec.missingFirst = missing.Pop();
+  rec.channel = this->_radio.getChannel();
+  rec.txStationId = this->txStationId;
+  rec.open = true;
+  JournalAppend(this->_fs, rec);
+  this->sinceJournal = 0;
 }
 
 void Receiver::Listen() {
+  this->listen();
+  // on a takeover this station broadcasts at once. the local copies stay
+  // queued for the next receive session
+  if (this->YieldState != YIELD_GRANTED) {
+    this->copyChunks();
+  }
+  // make the chunks received so far durable before the file is closed or
+  // handed over
+  this->FlushChunks();
+}
+
+void Receiver::listen() {
   MultipartHeader *header = (MultipartHeader *)this->packet;
-  this->_radio.startListening();
+  this->startListening();
   while (1) {
     if (!this->receivePacket(this->packet, this->_timeout)) {
+      if (!this->knowRoot && this->filesDone > 0) {
+        // finished at least one file, and nothing else is on this channel
+        return;
+      }
       this->Error = ERROR_RX_TIMEOUT;
       return;
     }
@@ -104,11 +161,56 @@ void Receiver::Listen() {
       // TX is listening for requests
       // TODO check RX-only flag
       Serial.println(F("R"));
-      uint16_t listenDuration;
-      this->receiveListenForReq(header->messageLength, listenDuration);
-      if (listenDuration > 0) {
-        delay(random(0, listenDuration));
-        this->broadcastRequests();
+      uint16_t requestDelay;
+      uint8_t slotDuration;
+      bool request;
+      request = this->receiveListenForReq(header->messageLength, requestDelay,
+                                          slotDuration);
+      if (this->YieldState == YIELD_GRANTED) {
+        // accept, and stop listening to become TX. the radio is left in TX
+        // mode so broadcasting can begin at once.
+        this->broadcastYieldAck();
+        return;
+      }
+      if (slotDuration > 0) {
+        // the TX is listening, so update the list of missing chunks, and
+        // copy local chunks and flush saved chunks, while waiting for this
+        // station's slot to make the request. if the slot is too close for
+        // the copies and flush, or the update, they are done after the
+        // request.
+        uint32_t requestAt = millis() + requestDelay;
+        bool flushed = requestDelay >= REQ_FLUSH_TIME;
+        bool updated = requestDelay >= REQ_UPDATE_TIME;
+        if (flushed) {
+          this->copyChunks();
+          this->FlushChunks();
+        }
+        if (updated) {
+          this->updateMissing();
+        }
+        if (request && (int32_t)(requestAt - millis()) > 0) {
+          Air.Waited(AIR_LISTEN, requestAt - millis());
+          delay(requestAt - millis());
+        }
+        if (!request) {
+          // waiting for this station's turn at a slot, or backing off
+        } else if (millis() - requestAt <= slotDuration / 2) {
+          this->broadcastRequests();
+          if (this->knowRoot && this->sinceJournal >= JOURNAL_INTERVAL) {
+            // the TX is still listening, so the channel is quiet
+            this->journal();
+          }
+        } else {
+          // too late, the request would run into the next station's slot
+          Serial.println(F("slot missed"));
+        }
+        if (!flushed) {
+          this->copyChunks();
+          this->FlushChunks();
+        }
+        if (!updated) {
+          this->updateMissing();
+        }
       }
       break;
     default:
@@ -121,13 +223,22 @@ void Receiver::Listen() {
       m.ReadRootHashBlock();
       if (m.Block.HashBlock.flags & MERKLE_CHUNK_COMPLETE) {
         // File is complete.
+        // Until TX takes requests it isn't known to be missing chunks. a
+        // station that only has part of the file may be broadcasting it.
         // If TX isn't missing chunks, exit.
         // If TX is ignoring yield request, exit.
-        if (!this->txIncomplete ||
-            this->yieldRequests > 25) { // TODO configurable
+        if (this->txHeard &&
+            (!this->txIncomplete ||
+             this->yieldRequests > 25)) { // TODO configurable
           Serial.println("RX Exit");
           Serial.println(this->txIncomplete);
           Serial.println(this->yieldRequests);
+          JournalClose(this->_fs);
+          if (this->anyFile) {
+            // TX may be broadcasting other files, keep listening
+            this->nextFile();
+            continue;
+          }
           return;
         }
         /*
@@ -143,17 +254,16 @@ void Receiver::Listen() {
         */
       }
     }
-    if (this->YieldState == YIELD_GRANTED) {
-      // stop listening and become TX
-      break;
-    }
   }
 }
 
 void Receiver::receiveHashChain(uint16_t msgLength) {
   HashChainMessage msg;
+  uint32_t startTime;
+  bool verified, indexed;
   if (msgLength > sizeof(msg.Message)) {
     Serial.println(F("Hash chain too long"));
+    MetricInc(METRIC_DROP_INVALID);
     return;
   }
   MultipartCombiner<32> mc(&msg.Message, msgLength, SEQ_CHAIN_START);
@@ -167,26 +277,38 @@ void Receiver::receiveHashChain(uint16_t msgLength) {
     }
     if (m.HashKnown(msg.Message.Header.chunk)) {
       // already have this chain, reject
-      // use this free time to scan for missing chunks
-      this->scanMissingChunks();
+      Air.Repeated(msgLength);
       return;
     }
-    // don't have this chain, request the corresponding chunk later
-    this->missing.Push(msg.Message.Header.chunk);
   }
   this->receiveMultipart(mc, this->_timeout);
   if (mc.Error) {
     // error receiving remainder of message (dropped packet)
-    // TODO increment dropped packet counter
+    this->Dropped++;
+    return;
+  }
+  this->Received++;
+  if (this->knowRoot &&
+      memcmp(msg.Message.Header.rootHash, this->rootHash, 32)) {
+    // chain of another file on this channel, not a bad chain of this one
     return;
   }
   // verify hash chain
-  if (!this->m.Verify(msg)) {
+  startTime = micros();
+  verified = this->m.Verify(msg);
+  MetricTime(HIST_CHAIN_VERIFY, micros() - startTime);
+  if (!verified) {
     // hash chain invalid, reject
-    // TODO increment hash chain error counter
+    MetricInc(METRIC_CHAINS_REJECTED);
     return;
   }
+  MetricInc(METRIC_CHAINS_VERIFIED);
   // hash chain is valid
+  if (!this->knowRoot && this->recentlyDone(msg.Message.Header.rootHash)) {
+    // file was completed this session, ignore
+    Air.Repeated(msgLength);
+    return;
+  }
   if (!this->knowRoot) {
     // not yet receiving a file, open or create the file described by this
     // hash chain
@@ -194,27 +316,25 @@ void Receiver::receiveHashChain(uint16_t msgLength) {
     this->numChunks = msg.Message.Header.numChunks;
     this->chunkSize = msg.Message.Header.chunkSize;
     memcpy(this->rootHash, msg.Message.Header.rootHash, 32);
+    // if a local file has these contents, whatever it is named, resume or
+    // reuse it. the broadcast filename is replaced by the local one.
+    indexed = RootIndexFind(this->_fs, msg.Message.Header.rootHash,
+                            msg.Message.Header.filename);
     strcpy(this->filename, msg.Message.Header.filename);
     // this->packet is now clobbered (unioned with filename)
     ToMerkleFilename(this->filename);
     this->m.Open(this->_fs, this->filename, msg);
-    // TODO
-    // disabling file renaming for now, since if A.JPG gets renamed to
-    // 1234.JPG, then when TX yields channel and RX becomes TX, the same
-    // file will be broadcast under 1234.JPG, but the new RX (formerly TX)
-    // won't know to open A.JPG, unless some rootHash to filename lookup is
-    // implemented.
-    /*
     if (this->m.Error == ERROR_MERKLE_ROOT_MISMATCH) {
-      // merkle file has different root hash, must be for a different file
-      // try again replacing filename with root hash hex
+      // a different file has this name here, try again replacing filename
+      // with root hash hex. the root index lets this station find the file
+      // again if it is asked to broadcast it, or if the original name is
+      // broadcast again.
       this->m.Error = ERROR_NONE;
       ToHashFilename(msg.Message.Header.rootHash, msg.Message.Header.filename);
       strcpy(this->filename, msg.Message.Header.filename);
       ToMerkleFilename(this->filename);
-      this->m.Open(fs, this->filename, msg);
+      this->m.Open(this->_fs, this->filename, msg);
     }
-    */
     if (this->m.Error) {
       // error opening merkle file, or root hash mismatch. discard.
       return;
@@ -222,7 +342,8 @@ void Receiver::receiveHashChain(uint16_t msgLength) {
     // merkle file opened, open chunk file
     if (OpenFile(this->_fs, msg.Message.Header.filename, this->chunkFile,
                  O_RDWR)) {
-      // couldn't open chunk file, create it
+      // couldn't open chunk file, create it. it isn't zeroed, chunkFile only
+      // holds valid data for chunks marked complete.
       if (this->Error =
               Create(this->_fs, this->chunkFile, msg.Message.Header.filename,
                      msg.Message.Header.fileSize)) {
@@ -230,111 +351,341 @@ void Receiver::receiveHashChain(uint16_t msgLength) {
         return;
       }
     }
+    if (!indexed) {
+      RootIndexAdd(this->_fs, msg.Message.Header.rootHash,
+                   msg.Message.Header.filename);
+    }
     this->knowRoot = true;
+    this->journal();
   }
   // hash chain is valid and for file being received. save chain if it is not
   // known already.
   this->m.Save(msg);
+  if (!this->ChunkSaved(msg.Message.Header.chunk) &&
+      this->numCopies < COPY_BATCH) {
+    // the chunk may already be on the card in another file. it is looked up
+    // with the others in the next listen period, while the TX is not sending.
+    // if the batch is full it is only received.
+    this->copies[this->numCopies++] = msg.Message.Header.chunk;
+  }
+}
+
+void Receiver::copyChunks() {
+  FatFile index;
+  uint8_t i;
+  if (this->numCopies == 0) {
+    return;
+  }
+  if (!OpenFile(this->_fs, CHUNK_INDEX_FILENAME, index, O_READ)) {
+    for (i = 0; i < this->numCopies && !this->Error; i++) {
+      // the chunk may have been received since its hash was
+      if (!this->ChunkSaved(this->copies[i])) {
+        this->copyLocalChunk(index, this->copies[i]);
+      }
+    }
+    index.close();
+  }
+  this->numCopies = 0;
+}
+
+void Receiver::copyLocalChunk(FatFile &index, uint16_t chunk) {
+  ChunkLocation loc;
+  DataChunkHeader header;
+  FatFile dir, src;
+  Sha256Context ctx;
+  uint8_t hash[32];
+  uint32_t bytePosition;
+  uint16_t len;
+  int n;
+  this->m.ReadHashBlock(chunk);
+  if (this->m.Error ||
+      !ChunkIndexFind(index, this->m.Block.HashBlock.hash, loc)) {
+    return;
+  }
+  // the copy must be the size of this file's chunk
+  bytePosition = chunk;
+  bytePosition *= this->chunkSize;
+  if (bytePosition + loc.len > this->chunkFile.fileSize() ||
+      loc.len > this->chunkSize) {
+    return;
+  }
+  dir.openRoot(&this->_fs);
+  if (!src.open(&dir, loc.dirIndex, O_READ) || !src.seekSet(loc.offset)) {
+    dir.close();
+    return;
+  }
+  header.chunk = chunk;
+  this->SaveChunkBegin(header);
+  sha256_init(&ctx);
+  for (len = loc.len; len > 0; len -= n) {
+    n = src.read(this->packet, len < 32 ? len : 32);
+    if (n <= 0) {
+      break;
+    }
+    sha256_update(&ctx, this->packet, n);
+    this->SaveChunkPart(this->packet, n);
+  }
+  src.close();
+  dir.close();
+  if (len > 0 || this->Error) {
+    return;
+  }
+  // the index may be out of date, verify the copy as if it were received
+  sha256_final(&ctx, hash);
+  if (this->m.VerifyChunkHash(chunk, hash)) {
+    this->SaveChunkEnd(chunk);
+    this->missing.Remove(chunk);
+    MetricInc(METRIC_CHUNKS_COPIED);
+    Serial.print(F("LOK "));
+  } else {
+    Serial.print(F("LRJ "));
+  }
+  Serial.println(chunk);
+}
+
+void Receiver::nextFile() {
+  this->FlushChunks();
+  // chunks of this file, complete now
+  this->numCopies = 0;
+  // remember this file, overwriting the oldest
+  memcpy(this->doneRoots[this->filesDone % RX_DONE_LEN], this->rootHash, 4);
+  if (this->filesDone < 0xff) {
+    this->filesDone++;
+  }
+  this->chunkFile.close();
+  this->m.Close();
+  this->knowRoot = false;
+  this->txIncomplete = false;
+  this->txStationId = 0;
+  this->txHeard = false;
+  this->yieldRequests = 0;
+  this->slotWait = REQ_STATIONS / REQ_SLOTS;
+  this->backoff = 0;
+  this->missing.Clear();
+  this->lastScanned = 0;
+}
+
+bool Receiver::recentlyDone(uint8_t *rootHash) {
+  uint8_t n = this->filesDone < RX_DONE_LEN ? this->filesDone : RX_DONE_LEN;
+  for (uint8_t i = 0; i < n; i++) {
+    if (!memcmp(this->doneRoots[i], rootHash, 4)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 void Receiver::receiveDataChunk(uint16_t msgLength) {
-  DataChunkMessage msg;
+  DataChunkHeader header;
+  Sha256Context ctx;
+  uint8_t hash[32];
+  uint32_t bytePosition;
   if (!this->knowRoot) {
     // don't know the root hash yet, reject
     return;
   }
-  if (msgLength > sizeof(msg.Message)) {
+  if (msgLength < sizeof(header) || msgLength > sizeof(header) + MAX_CHUNK_SIZE) {
     // reject
     return;
   }
-  memset(&msg.Message, 0, sizeof(msg.Message));
-  MultipartCombiner<32> mc(&msg.Message, msgLength, SEQ_CHUNK_START);
+  MultipartStreamCombiner<32> mc(&header, sizeof(header), msgLength,
+                                 SEQ_CHUNK_START);
   mc.Put(this->packet);
-  this->receiveMultipart(mc, this->_timeout);
-  if (mc.Error) {
-    // error receiving multipart message (dropped packet)
-    Serial.print(F("DRP"));
-    Serial.println(msg.Message.Header.chunk);
-    return;
-  }
-  // only take the time to verify if this chunk is new
-  // and hash of chunk is known
-  // TODO do these checks after first part of message is received, like in
-  // recieveHashChain?
-  if (msg.Message.Header.chunk >= (1 << this->treeDepth)) {
+  // only take the time to receive if this chunk is new and hash of chunk is
+  // known. only the first 29 bytes of header are valid at this point
+  if (header.chunk >= this->numChunks) {
     // invalid chunk index, reject
     return;
   }
-  if (!m.HashKnown(msg.Message.Header.chunk)) {
+  if (!m.HashKnown(header.chunk)) {
     // don't know the hash for this chunk, reject
+    MetricInc(METRIC_CHUNKS_NHS);
     Serial.print(F("NHS "));
-    Serial.println(msg.Message.Header.chunk);
+    Serial.println(header.chunk);
     return;
   }
-  if (m.ChunkComplete(msg.Message.Header.chunk)) {
+  if (this->ChunkSaved(header.chunk)) {
     // already have this chunk, reject
+    MetricInc(METRIC_CHUNKS_DUP);
+    Air.Repeated(msgLength);
     Serial.print(F("DUP "));
-    Serial.println(msg.Message.Header.chunk);
+    Serial.println(header.chunk);
     // TODO this shouldn't be needed... never request a chunk we already have
-    this->missing.Remove(msg.Message.Header.chunk);
+    this->missing.Remove(header.chunk);
+    return;
+  }
+  // receive remainder of header
+  while (mc.More() && !mc.HeaderComplete()) {
+    if (!this->receivePacket(this->packet, this->_timeout)) {
+      mc.Error = ERROR_RX_TIMEOUT;
+      break;
+    }
+    mc.Put(this->packet);
+  }
+  bytePosition = header.chunk;
+  bytePosition *= this->chunkSize;
+  if (mc.Error || header.chunkSize != msgLength - sizeof(header) ||
+      header.chunkSize > this->chunkSize ||
+      bytePosition + header.chunkSize > this->chunkFile.fileSize() ||
+      memcmp(header.rootHash, this->rootHash, 32)) {
+    // dropped packet, or header doesn't describe a chunk of this file
+    this->Dropped++;
+    if (mc.Error) {
+      MetricDrop(mc.Error);
+    } else {
+      MetricInc(METRIC_DROP_INVALID);
+    }
+    Serial.print(F("DRP"));
+    Serial.println(header.chunk);
+    return;
+  }
+  // hash and write the chunk's contents as they arrive. chunkFile only holds
+  // valid data for chunks marked complete, so the chunk's place in chunkFile
+  // can be overwritten before the chunk is verified.
+  this->SaveChunkBegin(header);
+  sha256_init(&ctx);
+  while (true) {
+    if (mc.PayloadLength > 0) {
+      sha256_update(&ctx, mc.Payload, mc.PayloadLength);
+      this->SaveChunkPart(mc.Payload, mc.PayloadLength);
+    }
+    if (!mc.More()) {
+      break;
+    }
+    if (!this->receivePacket(this->packet, this->_timeout)) {
+      mc.Error = ERROR_RX_TIMEOUT;
+      break;
+    }
+    mc.Put(this->packet);
+  }
+  if (mc.Error) {
+    // error receiving multipart message (dropped packet)
+    this->Dropped++;
+    MetricDrop(mc.Error);
+    Serial.print(F("DRP"));
+    Serial.println(header.chunk);
     return;
   }
-  if (this->m.Verify(msg)) {
-    this->SaveChunk(msg);
-    m.SetChunkComplete(msg.Message.Header.chunk);
+  this->Received++;
+  sha256_final(&ctx, hash);
+  if (this->m.VerifyChunkHash(header.chunk, hash)) {
+    // chunk data must be durable before the chunk is marked complete
+    this->SaveChunkEnd(header.chunk);
+    MetricInc(METRIC_CHUNKS_SAVED);
+    Air.Saved(header.chunkSize);
     Serial.print(F("DOK "));
-    this->missing.Remove(msg.Message.Header.chunk);
+    this->missing.Remove(header.chunk);
+    if (this->sinceJournal < 0xff) {
+      this->sinceJournal++;
+    }
+    // other files may reuse this chunk
+    ChunkLocation loc;
+    loc.dirIndex = this->chunkFile.dirIndex();
+    loc.offset = bytePosition;
+    loc.len = header.chunkSize;
+    ChunkIndexAdd(this->_fs, hash, loc);
   } else {
+    // leave the chunk incomplete, its data will be overwritten when it is
+    // received again
+    MetricInc(METRIC_CHUNKS_DRJ);
     Serial.print(F("DRJ "));
   }
-  Serial.println(msg.Message.Header.chunk);
+  Serial.println(header.chunk);
 }
 
-void Receiver::receiveListenForReq(uint16_t messageLength,
-                                   uint16_t &listenDuration) {
+bool Receiver::receiveListenForReq(uint16_t messageLength,
+                                   uint16_t &requestDelay,
+                                   uint8_t &slotDuration) {
   ListenForReqMessage msg;
   MultipartCombiner<32> mc(&msg.Message, messageLength, SEQ_TAKING_REQS);
-  listenDuration = 0;
+  bool request = false;
+  slotDuration = 0;
   if (!this->knowRoot) {
-    return;
+    return false;
   }
   memset(&msg.Message, 0, sizeof(msg.Message));
   mc.Put(this->packet);
   this->receiveMultipart(mc, this->_timeout);
   if (mc.Error) {
-    return;
+    return false;
   }
   this->m.ReadRootHashBlock();
   if (memcmp(msg.Message.rootHash, this->m.Block.HashBlock.hash, 32)) {
-    // root hash mismatch
-    return;
+    // root hash mismatch, TX is broadcasting another file
+    this->txHeard = true;
+    return false;
   }
-  // TODO bound listen duration to something reasonable
-  listenDuration = msg.Message.listenDuration;
   if (msg.Message.yieldToRxId == this->stationId) {
     this->YieldState = YIELD_GRANTED;
   } else {
+    if (msg.Message.yieldToRxId != 0) {
+      // the channel is being handed to another station, which becomes TX
+      this->txStationId = msg.Message.yieldToRxId;
+    }
     // TODO scanning the merkle file may take longer than listen period length?
     this->YieldState = YIELD_NONE;
+    if (msg.Message.numSlots <= REQ_SLOTS && msg.Message.contentionSlots > 0 &&
+        msg.Message.listenDuration >=
+            (uint16_t)(msg.Message.contentionSlots + msg.Message.numSlots) *
+                msg.Message.slotDuration) {
+      // request in this station's slot if the TX has assigned it one
+      slotDuration = msg.Message.slotDuration;
+      requestDelay = msg.Message.listenDuration;
+      for (uint8_t s = 0; s < msg.Message.numSlots; s++) {
+        if (msg.Message.slots[s] == this->stationId) {
+          requestDelay = (msg.Message.contentionSlots + s) * slotDuration;
+          request = true;
+          break;
+        }
+      }
+      if (request) {
+        this->slotWait = 0;
+        this->backoff = 0;
+      } else if (this->slotWait + 1 < REQ_STATIONS / REQ_SLOTS) {
+        // the TX gave the slots to other stations this time, and will come
+        // back to this one
+        this->slotWait++;
+      } else if (random(0, 1 << this->backoff) == 0) {
+        // the TX does not know this station, request in a random contention
+        // slot
+        requestDelay = random(0, msg.Message.contentionSlots) * slotDuration;
+        request = true;
+        if (this->backoff < REQ_BACKOFF_MAX) {
+          this->backoff++;
+        }
+      }
+    }
     if (msg.Message.q.Verify() && this->knowRoot) {
       // check if this station has any pieces the TX station is missing
       this->txIncomplete = (msg.Message.q.Length() > 0);
-      while (msg.Message.q.Length() > 0) {
+      this->txHeard = true;
+      Serial.print(F("TX asking for "));
+      Serial.println(msg.Message.q.Length());
+      for (uint8_t i = 0; i < MAX_YIELD_SCAN && msg.Message.q.Length() > 0;
+           i++) {
         uint16_t ch = msg.Message.q.Pop();
-        Serial.print(F("TX asking for "));
-        Serial.println(ch);
-        if (ch > this->numChunks) {
+        if (ch >= this->numChunks) {
           // invalid chunk index
-          continue;
+          break;
         }
         if (this->m.ChunkComplete(ch)) {
           // begin channel yield request
           this->YieldState = YIELD_REQUEST;
-          // return;
+          break;
         }
       }
     }
   }
+  return request;
+}
+
+void Receiver::broadcastYieldAck() {
+  YieldAckMessage msg(this->stationId, this->rootHash);
+  MultipartSplitter<32> mps(&msg.Message, msg.Message.messageLength,
+                            SEQ_YIELD_ACK, this->stationId);
+  MetricInc(METRIC_YIELDS_TAKEN);
+  this->_radio.stopListening();
+  this->broadcastMultipart(mps, AIR_CONTROL);
 }
 
 void Receiver::broadcastRequests() {
@@ -358,10 +709,12 @@ void Receiver::broadcastRequests() {
     msg.Message.yieldRequest = 0;
     this->yieldRequests = 0;
   }
+  msg.Message.stationId = this->stationId;
   Serial.print(F("asking for "));
   Serial.println(msg.Message.q.Length());
-  this->broadcastMultipart(mps);
-  this->_radio.startListening();
+  MetricInc(METRIC_REQUESTS_SENT);
+  this->broadcastMultipart(mps, AIR_CONTROL);
+  this->startListening();
 }
 
 } // namespace PDP
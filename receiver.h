@@ -3,6 +3,7 @@
 
 #include "RF24.h"
 #include "SdFat.h"
+#include "journal.h"
 #include "merkle.h"
 #include "transceiver.h"
 
@@ -16,7 +17,10 @@ public:
   // If chunkFile is not open, Receiver will listen on the current channel
   // for a file being transmit. If a broadcast is found, chunkFile will
   // be opened to the received file.
-  Receiver(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile,
+  //
+  // m is the merkle file of chunkFile, if chunkFile is open, and is opened if
+  // it is not already open.
+  Receiver(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile, MerkleFile &m,
            const uint16_t timeout);
   // Begin listening.
   //
@@ -27,7 +31,9 @@ public:
   //
   // Returns with ERROR_NONE and YieldState YIELD_NONE if the file being
   // received is complete, and the TX is not missing any chunks, or TX is
-  // ignoring channel yield request.
+  // ignoring channel yield request. If chunkFile was not open, the Receiver
+  // instead goes on to receive other files heard on the channel, and returns
+  // with ERROR_NONE once nothing more is heard.
   // (driver: new channel? close file, listen again)
   //
   // Returns with ERROR_NONE and YieldState YIELD_GRANTED if the TX is missing
@@ -35,9 +41,16 @@ public:
   // this station.
   // (driver: keep channel, keep file, construct tx, broadcast)
   void Listen();
+  // Resume the session recorded in rec, which must be for chunkFile. Returns
+  // false if chunkFile is not the file rec describes.
+  bool Resume(JournalRecord &rec);
+  // number of multipart messages received ok, and dropped part way through
+  uint16_t Received, Dropped;
 
 private:
   uint16_t stationId;
+  // Listen, leaving the last few chunks received waiting to be made durable
+  void listen();
   FatFileSystem &_fs;
   const uint16_t _timeout;
   // true if a valid hash chain has been received. if true, rootHash and
@@ -45,15 +58,59 @@ private:
   bool knowRoot;
   // If true, TX is missing chunks.
   bool txIncomplete;
+  // station id the channel was last handed to, while this file was being
+  // received, or 0
+  uint16_t txStationId;
+  // If true, TX has taken requests since the file was chosen, so
+  // txIncomplete is known
+  bool txHeard;
   // number of times we've asked for a yield
   uint16_t yieldRequests;
+  // number of listen periods since the TX gave this station a slot. A station
+  // the TX knows has a slot at least once in REQ_STATIONS / REQ_SLOTS listen
+  // periods, so until then it waits for its turn instead of requesting in the
+  // contention slots.
+  uint8_t slotWait;
+  // a station without a slot requests in a listen period with probability
+  // 1 / 2^backoff. backoff goes up with each such request, and back to 0
+  // once the TX gives the station a slot.
+  uint8_t backoff;
+  // true if Receiver was not constructed for a particular file. After the
+  // file being received is complete, Receiver moves on to the next file it
+  // hears instead of returning.
+  bool anyFile;
+  // number of files completed this session
+  uint8_t filesDone;
+  // first bytes of the root hashes of recently completed files, which are
+  // ignored
+  uint8_t doneRoots[RX_DONE_LEN][4];
+  // chunks whose hashes were received while the chunks were not saved, and
+  // that may be copied from a local file. Looked up together by copyChunks.
+  uint16_t copies[COPY_BATCH];
+  uint8_t numCopies;
+  // number of chunks received since the session journal was written
+  uint8_t sinceJournal;
+  // Record the file being received in the session journal
+  void journal();
+  // Copy each chunk in copies still missing that the chunk index knows a
+  // local copy of into chunkFile, marking it complete if its hash is correct
+  void copyChunks();
+  void copyLocalChunk(FatFile &index, uint16_t chunk);
+  // Forget the file being received, and listen for the next one
+  void nextFile();
+  bool recentlyDone(uint8_t *rootHash);
   // Receive the hash chain currently being broadcast
   void receiveHashChain(uint16_t messageLength);
   // Receive the data chunk currently being broadcast
   void receiveDataChunk(uint16_t messageLength);
-  // Receive the listen period start message, returning the duration
-  // of the listen period in listenDuration
-  void receiveListenForReq(uint16_t messageLength, uint16_t &listenDuration);
+  // Receive the listen period start message. If the TX is taking requests,
+  // slotDuration is set to the length of a request slot, otherwise 0. Returns
+  // true if this station requests in this listen period, with requestDelay set
+  // to the time from now that its request should be sent.
+  bool receiveListenForReq(uint16_t messageLength, uint16_t &requestDelay,
+                           uint8_t &slotDuration);
+  // Accept the channel yielded to this station
+  void broadcastYieldAck();
   // Broadcast a request for missing chunks
   void broadcastRequests();
 };
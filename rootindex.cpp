@@ -0,0 +1,144 @@
+#include "RF24.h"
+#include "SdFat.h"
+
+#include "merkle.h"
+#include "rootindex.h"
+#include "util.h"
+
+namespace PDP {
+
+struct __attribute__((__packed__)) RootIndexRecord {
+  uint8_t prefix[ROOT_INDEX_PREFIX];
+  char filename[MAX_FILENAME_LENGTH + 1];
+};
+
+static bool readRecord(FatFile &f, uint16_t n, RootIndexRecord &rec) {
+  return f.seekSet((uint32_t)n * sizeof(rec)) &&
+         f.read(&rec, sizeof(rec)) == sizeof(rec);
+}
+
+static bool writeRecord(FatFile &f, uint16_t n, RootIndexRecord &rec) {
+  return f.seekSet((uint32_t)n * sizeof(rec)) &&
+         f.write(&rec, sizeof(rec)) == sizeof(rec);
+}
+
+// Returns the index of the first record with prefix >= rootHash's prefix,
+// setting found if its prefix is equal. rec holds the last record read.
+static uint16_t search(FatFile &f, const uint8_t *rootHash,
+                       RootIndexRecord &rec, bool &found) {
+  uint16_t lo = 0, hi = f.fileSize() / sizeof(rec), mid;
+  int c;
+  found = false;
+  while (lo < hi) {
+    mid = lo + ((hi - lo) >> 1);
+    if (!readRecord(f, mid, rec)) {
+      break;
+    }
+    c = memcmp(rec.prefix, rootHash, ROOT_INDEX_PREFIX);
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+      if (c == 0) {
+        found = true;
+      }
+    }
+  }
+  return lo;
+}
+
+bool RootIndexFind(FatFileSystem &fs, const uint8_t *rootHash, char *filename) {
+  FatFile f;
+  RootIndexRecord rec;
+  bool found;
+  if (OpenFile(fs, ROOT_INDEX_FILENAME, f, O_READ)) {
+    return false;
+  }
+  search(f, rootHash, rec, found);
+  f.close();
+  if (found) {
+    rec.filename[MAX_FILENAME_LENGTH] = '\0';
+    strcpy(filename, rec.filename);
+  }
+  return found;
+}
+
+Error_t RootIndexAdd(FatFileSystem &fs, const uint8_t *rootHash,
+                     const char *filename) {
+  FatFile f;
+  RootIndexRecord rec;
+  uint16_t pos, n;
+  bool found;
+  if (OpenFile(fs, ROOT_INDEX_FILENAME, f, O_RDWR | O_CREAT)) {
+    return ERROR_IO_OPEN;
+  }
+  pos = search(f, rootHash, rec, found);
+  if (found) {
+    readRecord(f, pos, rec);
+    if (!strncmp(rec.filename, filename, MAX_FILENAME_LENGTH)) {
+      // already indexed
+      f.close();
+      return ERROR_IO_ALREADY_EXISTS;
+    }
+  } else {
+    // move the records after pos up one place, starting from the end
+    for (n = f.fileSize() / sizeof(rec); n > pos; n--) {
+      if (!readRecord(f, n - 1, rec) || !writeRecord(f, n, rec)) {
+        f.close();
+        return ERROR_IO_WRITE;
+      }
+    }
+  }
+  memset(&rec, 0, sizeof(rec));
+  memcpy(rec.prefix, rootHash, ROOT_INDEX_PREFIX);
+  strncpy(rec.filename, filename, MAX_FILENAME_LENGTH);
+  if (!writeRecord(f, pos, rec)) {
+    f.close();
+    return ERROR_IO_WRITE;
+  }
+  f.close();
+  return ERROR_NONE;
+}
+
+Error_t RootIndexCheck(FatFileSystem &fs) {
+  FatFile dir, src;
+  MerkleFile m;
+  char filename[MAX_FILENAME_LENGTH + 1];
+  char merkleFilename[MAX_FILENAME_LENGTH + 1];
+  Error_t err = ERROR_NONE;
+  if (fs.exists(ROOT_INDEX_FILENAME)) {
+    return ERROR_NONE;
+  }
+  if (!fs.exists(STATE_DIR) && !fs.mkdir(STATE_DIR)) {
+    return ERROR_IO_CREATE;
+  }
+  Serial.println(F("Indexing roots"));
+  // index every file in the root directory that has a valid merkle file
+  dir.openRoot(&fs);
+  while (!err && src.openNext(&dir, O_READ)) {
+    src.getName(filename, MAX_FILENAME_LENGTH + 1);
+    src.close();
+    if (IsMerkleFilename(filename)) {
+      continue;
+    }
+    strcpy(merkleFilename, filename);
+    ToMerkleFilename(merkleFilename);
+    m.Open(fs, merkleFilename);
+    if (m.Error) {
+      continue;
+    }
+    m.ReadRootHashBlock();
+    if (m.Error) {
+      continue;
+    }
+    err = RootIndexAdd(fs, m.Block.HashBlock.hash, filename);
+    if (err == ERROR_IO_ALREADY_EXISTS) {
+      // two files with the same contents
+      err = ERROR_NONE;
+    }
+  }
+  dir.close();
+  return err;
+}
+
+} // namespace PDP
@@ -0,0 +1,31 @@
+#ifndef ROOTINDEX_H
+#define ROOTINDEX_H
+
+#include "SdFat.h"
+#include "consts.h"
+
+namespace PDP {
+
+// The root index is a file on the SD card mapping the merkle root hashes of
+// local files to their filenames, so a file can be found by its contents
+// whatever it is named.
+//
+// It holds fixed size records sorted by the first ROOT_INDEX_PREFIX bytes of
+// the root hash, and is searched by bisection.
+
+// Find the file whose root hash starts with the same ROOT_INDEX_PREFIX bytes
+// as rootHash, and copy its name to filename, which must have room for
+// MAX_FILENAME_LENGTH + 1 bytes. Returns false if there is no such file.
+bool RootIndexFind(FatFileSystem &fs, const uint8_t *rootHash, char *filename);
+// Add filename to the index under rootHash, replacing any other file with the
+// same root hash prefix. Returns ERROR_IO_ALREADY_EXISTS if filename is
+// already indexed under rootHash.
+Error_t RootIndexAdd(FatFileSystem &fs, const uint8_t *rootHash,
+                     const char *filename);
+// Create the root index from the merkle files in the root directory if it does
+// not exist
+Error_t RootIndexCheck(FatFileSystem &fs);
+
+} // namespace PDP
+
+#endif // ROOTINDEX_H
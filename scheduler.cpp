@@ -0,0 +1,207 @@
+#include "scheduler.h"
+
+namespace PDP {
+
+#ifdef ON_PC
+bool SchedSequential = false;
+#endif
+
+static uint16_t gcd(uint16_t a, uint16_t b) {
+  while (b) {
+    uint16_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// number of bits set in x
+static uint8_t bitCount(uint16_t x) {
+  uint8_t n = 0;
+  for (; x; x &= x - 1) {
+    n++;
+  }
+  return n;
+}
+
+ChunkScheduler::ChunkScheduler()
+    : len(0), recentLen(0), recentNext(0), numChunks(0), runs(0), stride(1),
+      run(1) {}
+
+void ChunkScheduler::Reset(uint16_t numChunks, uint16_t chunkSize) {
+  this->len = 0;
+  this->recentLen = 0;
+  this->recentNext = 0;
+  this->numChunks = numChunks;
+  this->run = chunkSize ? (SCHED_RUN_BYTES + chunkSize - 1) / chunkSize : 1;
+  if (this->run > SCHED_BURST) {
+    this->run = SCHED_BURST;
+  }
+  this->runs = (numChunks + this->run - 1) / this->run;
+  // step through the file's runs by about runs / golden ratio. the stride must
+  // be coprime to runs so every run is visited once per pass.
+  this->stride = ((uint32_t)this->runs * 618) / 1000;
+  if (this->stride == 0) {
+    this->stride = 1;
+  }
+  while (gcd(this->stride, this->runs) != 1) {
+    this->stride++;
+  }
+#ifdef ON_PC
+  if (SchedSequential) {
+    this->stride = 1;
+  }
+#endif
+}
+
+bool ChunkScheduler::Request(uint16_t first, uint16_t count,
+                             uint16_t stationId) {
+  uint8_t i;
+  uint16_t end, next, bit = 1 << (stationId % 16);
+  bool ok = true;
+  if (first >= this->numChunks) {
+    // invalid chunk index
+    return true;
+  }
+  if (count > this->numChunks - first) {
+    count = this->numChunks - first;
+  }
+  end = first + count;
+  // split pending ranges that stick out of [first, end), then add the station
+  // to the ranges inside it. split ranges are appended, so the loop visits
+  // them too.
+  for (i = 0; i < this->len; i++) {
+    if (this->entries[i].first < first &&
+        first < this->entries[i].first + this->entries[i].count) {
+      ok = this->split(i, first) && ok;
+    }
+    if (this->entries[i].first < end &&
+        end < this->entries[i].first + this->entries[i].count) {
+      ok = this->split(i, end) && ok;
+    }
+    if (this->entries[i].first < end &&
+        first < this->entries[i].first + this->entries[i].count) {
+      this->entries[i].requesters |= bit;
+    }
+  }
+  // add the parts of [first, end) not covered by a pending range
+  while (first < end) {
+    next = end;
+    for (i = 0; i < this->len; i++) {
+      if (this->entries[i].first <= first &&
+          first < this->entries[i].first + this->entries[i].count) {
+        // first is covered, skip to the end of this range
+        next = 0;
+        first = this->entries[i].first + this->entries[i].count;
+        break;
+      }
+      if (this->entries[i].first > first && this->entries[i].first < next) {
+        next = this->entries[i].first;
+      }
+    }
+    if (next == 0) {
+      continue;
+    }
+    if (!this->insert(first, next - first, bit)) {
+      // table full. the receiver will request it again later
+      ok = false;
+    }
+    first = next;
+  }
+  return ok;
+}
+
+bool ChunkScheduler::insert(uint16_t first, uint16_t count,
+                            uint16_t requesters) {
+  if (this->len >= SCHED_LEN) {
+    return false;
+  }
+  this->entries[this->len].first = first;
+  this->entries[this->len].count = count;
+  this->entries[this->len].requesters = requesters;
+  this->entries[this->len].age = 0;
+  this->len++;
+  return true;
+}
+
+bool ChunkScheduler::split(uint8_t i, uint16_t at) {
+  uint16_t end = this->entries[i].first + this->entries[i].count;
+  if (this->len >= SCHED_LEN) {
+    // table full, the whole range gains the request
+    return false;
+  }
+  this->entries[this->len] = this->entries[i];
+  this->entries[this->len].first = at;
+  this->entries[this->len].count = end - at;
+  this->entries[i].count = at - this->entries[i].first;
+  this->len++;
+  return true;
+}
+
+bool ChunkScheduler::NextRequested(uint16_t &chunk) {
+  uint8_t i, best = 0;
+  uint16_t score, bestScore = 0;
+  if (this->len == 0) {
+    return false;
+  }
+  for (i = 0; i < this->len; i++) {
+    score = bitCount(this->entries[i].requesters) * SCHED_DEMAND_WEIGHT +
+            this->entries[i].age;
+    if (score > bestScore) {
+      bestScore = score;
+      best = i;
+    }
+  }
+#ifdef ON_PC
+  if (SchedSequential) {
+    best = this->len - 1;
+  }
+#endif
+  chunk = this->entries[best].first;
+  // everything else still waiting has now waited for one more chunk
+  for (i = 0; i < this->len; i++) {
+    if (this->entries[i].age < 0xff) {
+      this->entries[i].age++;
+    }
+  }
+  this->entries[best].age = 0;
+  this->entries[best].first++;
+  this->entries[best].count--;
+  if (this->entries[best].count == 0) {
+    this->len--;
+    this->entries[best] = this->entries[this->len];
+  }
+  return true;
+}
+
+uint16_t ChunkScheduler::Sweep(uint16_t i) {
+  uint16_t run = ((uint32_t)(i / this->run) * this->stride) % this->runs;
+  return run * this->run + i % this->run;
+}
+
+uint16_t ChunkScheduler::SweepLength() {
+  return this->runs * this->run;
+}
+
+uint8_t ChunkScheduler::RunLength() { return this->run; }
+
+bool ChunkScheduler::RecentlySent(uint16_t chunk) {
+  for (uint8_t i = 0; i < this->recentLen; i++) {
+    if (this->recent[i] == chunk) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ChunkScheduler::Sent(uint16_t chunk) {
+  this->recent[this->recentNext] = chunk;
+  this->recentNext = (this->recentNext + 1) % SCHED_RECENT_LEN;
+  if (this->recentLen < SCHED_RECENT_LEN) {
+    this->recentLen++;
+  }
+}
+
+uint8_t ChunkScheduler::Pending() { return this->len; }
+
+} // namespace PDP
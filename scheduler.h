@@ -0,0 +1,80 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "consts.h"
+#include "stdint.h"
+
+namespace PDP {
+
+// ChunkScheduler decides which chunk a transmitter sends next.
+//
+// Requested chunks are sent before the background sweep, those wanted by the
+// most receivers first. Every time a request is served the others age, so an
+// old request is eventually served even if newer ones have more demand.
+// Receivers are told apart by station id modulo 16, so a station asking again
+// adds no demand.
+//
+// The background sweep visits every chunk once per pass, in runs of
+// consecutive chunks about SCHED_RUN_BYTES long. The runs are visited in an
+// order that spreads consecutive runs across the whole file. Chunks that were
+// just sent on request are skipped.
+class ChunkScheduler {
+public:
+  ChunkScheduler();
+  // Forget all requests, and prepare a sweep over numChunks chunks of
+  // chunkSize bytes
+  void Reset(uint16_t numChunks, uint16_t chunkSize);
+  // Record a request by stationId for the count chunks starting at first. A
+  // pending range the request covers only part of is split, so the rest keeps
+  // its demand. Returns false if part of the range was dropped, or a range was
+  // not split, because too many ranges are already pending.
+  bool Request(uint16_t first, uint16_t count, uint16_t stationId);
+  // Remove the first chunk of the pending range with the highest priority,
+  // storing its index in chunk. Returns false if no requests are pending.
+  bool NextRequested(uint16_t &chunk);
+  // Returns the chunk to send at step i (0 <= i < SweepLength()) of the
+  // background sweep. Steps past the end of the last run return a chunk
+  // >= numChunks, which is skipped.
+  uint16_t Sweep(uint16_t i);
+  // Returns the number of steps in a pass of the background sweep
+  uint16_t SweepLength();
+  // Returns the number of chunks in a run of the background sweep. Step i
+  // begins a run if i is a multiple of it.
+  uint8_t RunLength();
+  // Returns true if chunk was one of the last SCHED_RECENT_LEN chunks sent
+  bool RecentlySent(uint16_t chunk);
+  // Record that chunk has been sent
+  void Sent(uint16_t chunk);
+  uint8_t Pending();
+
+private:
+  // insert a new range requested by the stations in requesters, if there is
+  // room
+  bool insert(uint16_t first, uint16_t count, uint16_t requesters);
+  // split pending range i in two at chunk at, if there is room
+  bool split(uint8_t i, uint16_t at);
+  // pending ranges, which never overlap
+  struct {
+    uint16_t first, count;
+    // bit stationId % 16 is set for each station that requested this range
+    uint16_t requesters;
+    // number of other chunks served since a chunk of this range was sent
+    uint8_t age;
+  } entries[SCHED_LEN];
+  uint8_t len;
+  uint16_t recent[SCHED_RECENT_LEN];
+  uint8_t recentLen, recentNext;
+  uint16_t numChunks, runs, stride;
+  uint8_t run;
+};
+
+#ifdef ON_PC
+// If true, every ChunkScheduler sends the newest request first and sweeps the
+// file in order, as Transmitter::Broadcast did before it had a scheduler. For
+// comparison in the host simulator.
+extern bool SchedSequential;
+#endif
+
+} // namespace PDP
+
+#endif // SCHEDULER_H
@@ -2,39 +2,89 @@
 #include "pdp.h"
 #include "util.h"
 #include "power.h"
+#include "radiorx.h"
+#include "rootindex.h"
+#include "chunkindex.h"
 
 namespace PDP {
 
 TransceiverBase::TransceiverBase(RF24 &radio, FatFileSystem &fs,
-                                 FatFile &chunkFile)
+                                 FatFile &chunkFile, MerkleFile &m)
     : Error(ERROR_NONE), YieldState(YIELD_NONE), _radio(radio),
-      chunkFile(chunkFile), chunkSize(0), lastScanned(0) {
+      chunkFile(chunkFile), m(m), chunkSize(0), lastScanned(0), numPending(0) {
+  // the session's time is counted in Air from here until Air.End()
+  Air.Begin(radio.getDataRate());
   if (this->chunkFile.isOpen()) {
-    // chunkFile is already open. Open the corresponding merkle file.
-    uint8_t filenameLen;
+    if (this->m.IsOpen()) {
+      // switching roles, the merkle file is already open
+      this->loadMerkle();
+    } else {
+      // chunkFile is already open. Open the corresponding merkle file.
+      this->openMerkle(fs);
+    }
+  }
+}
+
+void TransceiverBase::loadMerkle() {
+  this->m.ReadHeaderBlock();
+  this->Error = this->m.Error;
+  if (!this->Error) {
+    this->treeDepth = this->m.Block.HeaderBlock.treeDepth;
+    this->chunkSize = this->m.Block.HeaderBlock.chunkSize;
+    this->numChunks = this->m.Block.HeaderBlock.numChunks;
+    this->m.ReadRootHashBlock();
+    memcpy(this->rootHash, this->m.Block.HashBlock.hash, 32);
+  }
+}
+
+void TransceiverBase::openMerkle(FatFileSystem &fs) {
+  this->chunkFile.getName(this->filename, MAX_FILENAME_LENGTH + 1);
+  if (IsMerkleFilename(this->filename)) {
+    // refuse to transmit/receive merkle files
+    this->Error = ERROR_REFUSE_MERKLE;
+    return;
+  }
+  ToMerkleFilename(this->filename);
+  this->m.Open(fs, this->filename, chunkFile);
+  this->Error = this->m.Error;
+  if (!this->Error) {
+    this->loadMerkle();
+  }
+  if (!this->Error) {
+    // let the file, and its chunks, be found by their contents
     this->chunkFile.getName(this->filename, MAX_FILENAME_LENGTH + 1);
-    filenameLen = strlen(this->filename);
-    if (filenameLen >= 3 && !strcmp(this->filename + filenameLen - 3, "mkl")) {
-      // refuse to transmit/receive merkle files
-      this->Error = ERROR_REFUSE_MERKLE;
-      return;
+    if (RootIndexAdd(fs, this->rootHash, this->filename) == ERROR_NONE) {
+      // new or renamed file
+      ChunkIndexAddFile(fs, this->m, this->chunkFile.dirIndex());
     }
-    ToMerkleFilename(this->filename);
-    this->m.Open(fs, this->filename, chunkFile);
-    this->Error = this->m.Error;
-    if (!this->Error) {
-      // header block is loaded after calling Open
-      this->treeDepth = this->m.Block.HeaderBlock.treeDepth;
-      this->chunkSize = this->m.Block.HeaderBlock.chunkSize;
-      this->numChunks = this->m.Block.HeaderBlock.numChunks;
-      this->m.ReadRootHashBlock();
-      memcpy(this->rootHash, this->m.Block.HashBlock.hash, 32);
+  }
+  this->missing.Clear();
+  this->lastScanned = 0;
+  if (!this->Error) {
+    this->m.ReadRootHashBlock();
+    if (!(this->m.Block.HashBlock.flags & MERKLE_CHUNK_COMPLETE)) {
+      // list the missing chunks now, so the first listen period already
+      // tells receivers which chunks this station lacks
+      this->updateMissing();
     }
   }
 }
 
 void TransceiverBase::LoadChunk(DataChunkMessage &msg, const uint16_t chunk) {
-  uint32_t bytePosition;
+  this->LoadChunkHeader(msg.Message.Header, chunk);
+  if (this->Error || msg.Message.Header.chunkSize == 0) {
+    return;
+  }
+  if (this->chunkFile.read(msg.Message.chunk, msg.Message.Header.chunkSize) !=
+      (int)msg.Message.Header.chunkSize) {
+    this->Error = ERROR_IO_READ;
+    return;
+  }
+}
+
+void TransceiverBase::LoadChunkHeader(DataChunkHeader &header,
+                                      const uint16_t chunk) {
+  uint32_t bytePosition, fileSize;
 #ifdef DEBUG
   if (this->chunkSize == 0 || this->chunkSize > MAX_CHUNK_SIZE) {
     Serial.println(F("IE01"));
@@ -44,29 +94,29 @@ void TransceiverBase::LoadChunk(DataChunkMessage &msg, const uint16_t chunk) {
 #endif
   bytePosition = chunk;
   bytePosition *= this->chunkSize;
+  fileSize = this->chunkFile.fileSize();
   // TODO refuse to load if in error state? (as in save)
-  if (bytePosition >= this->chunkFile.fileSize()) {
+  if (bytePosition >= fileSize) {
     // requesting chunk after end of file, return empty chunk
-    msg.Message.Header.chunkSize = 0;
+    header.chunkSize = 0;
   } else {
     if (!chunkFile.seekSet(bytePosition)) {
       this->Error = ERROR_IO_SEEK;
       return;
     }
-    msg.Message.Header.chunkSize =
-        this->chunkFile.read(msg.Message.chunk, this->chunkSize);
-    if (msg.Message.Header.chunkSize == 0) {
-      this->Error = ERROR_IO_READ;
-      return;
+    // only the last chunk may be shorter than chunkSize
+    header.chunkSize = fileSize - bytePosition;
+    if (header.chunkSize > this->chunkSize) {
+      header.chunkSize = this->chunkSize;
     }
+    MetricInc(METRIC_SD_CHUNK_READS);
   }
-  msg.Message.Header.version = PROTOCOL_VERSION;
-  msg.Message.Header.chunk = chunk;
-  msg.Message.Header.messageLength =
-      msg.Message.Header.chunkSize + sizeof(msg.Message.Header);
+  header.version = PROTOCOL_VERSION;
+  header.chunk = chunk;
+  header.messageLength = header.chunkSize + sizeof(header);
 }
 
-void TransceiverBase::SaveChunk(DataChunkMessage &msg) {
+void TransceiverBase::SaveChunkBegin(DataChunkHeader &header) {
   uint32_t bytePosition;
 #ifdef DEBUG
   if (this->chunkSize == 0 || this->chunkSize > MAX_CHUNK_SIZE) {
@@ -75,7 +125,7 @@ void TransceiverBase::SaveChunk(DataChunkMessage &msg) {
       ;
   }
 #endif
-  bytePosition = msg.Message.Header.chunk;
+  bytePosition = header.chunk;
   bytePosition *= this->chunkSize;
   if (this->Error) {
     Serial.println(this->Error);
@@ -87,26 +137,75 @@ void TransceiverBase::SaveChunk(DataChunkMessage &msg) {
     this->Error = ERROR_IO_SEEK;
     return;
   }
-  if (this->chunkFile.write(msg.Message.chunk, msg.Message.Header.chunkSize) !=
-      msg.Message.Header.chunkSize) {
+  MetricInc(METRIC_SD_CHUNK_WRITES);
+}
+
+void TransceiverBase::SaveChunkPart(uint8_t *data, const uint16_t len) {
+  if (this->Error) {
+    return;
+  }
+  if (this->chunkFile.write(data, len) != (int)len) {
     this->Error = ERROR_IO_WRITE;
     return;
   }
-  this->chunkFile.sync();
 }
 
-void TransceiverBase::broadcastMultipart(MultipartSplitter<32> &mps) {
-  while (mps.More()) {
-    mps.Get(this->packet);
-    for (uint8_t i = 0; i < RETRANSMITS; i++) {
-      this->_radio.write(this->packet, 32, true);
+void TransceiverBase::SaveChunkEnd(uint16_t chunk) {
+  if (this->Error) {
+    return;
+  }
+  if (!this->ChunkSaved(chunk)) {
+    this->pending[this->numPending++] = chunk;
+  }
+  // each sync also writes the chunk file's directory entry and waits for the
+  // card, so batching saves sync time. data sectors are written back as
+  // often either way, since merkle writes between chunks evict them from the
+  // SD library's block cache.
+  if (DURABILITY == DURABLE_CHUNK || this->numPending >= SAVE_BATCH) {
+    this->FlushChunks();
+  }
+}
+
+void TransceiverBase::FlushChunks() {
+  uint32_t startTime = micros();
+  if (this->numPending == 0) {
+    return;
+  }
+  MetricInc(METRIC_SD_SYNCS);
+  if (!this->chunkFile.sync()) {
+    // the data may not be on the card, leave the chunks incomplete
+    this->Error = ERROR_IO_WRITE;
+    this->numPending = 0;
+    return;
+  }
+  for (uint8_t i = 0; i < this->numPending; i++) {
+    this->m.SetChunkComplete(this->pending[i]);
+  }
+  this->numPending = 0;
+  MetricTime(HIST_CHUNK_FLUSH, micros() - startTime);
+}
+
+bool TransceiverBase::ChunkSaved(uint16_t chunk) {
+  for (uint8_t i = 0; i < this->numPending; i++) {
+    if (this->pending[i] == chunk) {
+      return true;
     }
   }
+  return this->m.ChunkComplete(chunk);
+}
+
+void TransceiverBase::startListening() {
+  // packets queued by broadcastMultipart are lost if the radio leaves TX mode
+  // before the FIFO is empty
+  this->_radio.txStandBy();
+  this->_radio.startListening();
 }
 
 bool TransceiverBase::receivePacket(uint8_t *packet, const uint16_t timeout) {
   uint32_t timeoutAt = millis() + timeout;
-  while (!this->_radio.available()) {
+  while (!RxRing.Get(this->packet)) {
+    // without the radio IRQ, poll the radio instead
+    RadioRxPoll(this->_radio);
     CheckPowerSwitch();
     if (FlagShutdown) {
       return false;
@@ -115,7 +214,8 @@ bool TransceiverBase::receivePacket(uint8_t *packet, const uint16_t timeout) {
       return false;
     }
   }
-  this->_radio.read(this->packet, 32);
+  MetricInc(METRIC_PACKETS_RX);
+  Air.Received(((MultipartHeader *)this->packet)->sequenceNum);
   return true;
 }
 
@@ -124,29 +224,44 @@ void TransceiverBase::receiveMultipart(MultipartCombiner<32> &mpc,
   while (mpc.More()) {
     if (!this->receivePacket(this->packet, timeout)) {
       mpc.Error = ERROR_RX_TIMEOUT;
-      return;
+      break;
     }
     mpc.Put(this->packet);
   }
+  if (mpc.Error) {
+    MetricDrop(mpc.Error);
+  }
 }
 
-void TransceiverBase::scanMissingChunks() {
-  // stop scanning after 10 milliseconds
-  unsigned long timeoutAt = millis() + 10; // TODO configure timeout?
-  uint16_t numChunks = this->numChunks;
-  for (uint16_t i = 0; i < numChunks; i++) {
-    if (millis() > timeoutAt) {
-      // out of scan time
+void TransceiverBase::updateMissing() {
+  uint16_t chunk = this->lastScanned, end = this->numChunks, scanned = 0;
+  this->missing.Clear();
+  while (scanned < MAX_MISSING_SCAN) {
+    chunk = this->m.NextIncomplete(chunk);
+    if (this->m.Error) {
       return;
     }
-    if (!this->m.ChunkComplete(lastScanned)) {
-      if (!this->missing.Push(lastScanned)) {
-        // queue full, stop now
+    if (chunk >= end) {
+      if (end == this->lastScanned || this->lastScanned == 0) {
+        // scanned the whole file
+        this->lastScanned = 0;
         return;
       }
+      // wrap around to the chunks before lastScanned
+      end = this->lastScanned;
+      chunk = 0;
+      continue;
+    }
+    if (!this->missing.Push(chunk)) {
+      // missing is full, continue from here next time
+      this->lastScanned = chunk;
+      return;
     }
-    lastScanned = (lastScanned + 1) % numChunks;
+    chunk++;
+    scanned++;
   }
+  // out of scan time, continue from here next time
+  this->lastScanned = (chunk < this->numChunks) ? chunk : 0;
 }
 
 } // namespace PDP
@@ -2,8 +2,10 @@
 #define TRANSCEIVER_H
 
 #include "RF24.h"
+#include "airtime.h"
 #include "merkle.h"
 #include "message.h"
+#include "metrics.h"
 #include "multipart.h"
 #include "stdint.h"
 
@@ -15,9 +17,32 @@ public:
   YieldState_t YieldState;
 
 protected:
-  TransceiverBase(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile);
+  // If chunkFile is open and m is not, m is opened as chunkFile's merkle file.
+  // If both are open, m must be chunkFile's merkle file, as it is when one
+  // role hands chunkFile and m over to the other.
+  TransceiverBase(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile,
+                  MerkleFile &m);
+  // Open the merkle file of the already open chunkFile, and load the file's
+  // parameters from it
+  void openMerkle(FatFileSystem &fs);
+  // Load the file's parameters from the open merkle file
+  void loadMerkle();
   void LoadChunk(DataChunkMessage &msg, const uint16_t chunk);
-  void SaveChunk(DataChunkMessage &msg);
+  // Fill in header for chunk, and seek chunkFile to the start of the chunk so
+  // its contents can be read sequentially from chunkFile.
+  void LoadChunkHeader(DataChunkHeader &header, const uint16_t chunk);
+  // Seek chunkFile to the start of the chunk described by header, so its
+  // contents can be written sequentially with SaveChunkPart.
+  void SaveChunkBegin(DataChunkHeader &header);
+  void SaveChunkPart(uint8_t *data, const uint16_t len);
+  // Mark chunk complete once the data written since SaveChunkBegin is durable,
+  // following the DURABILITY policy
+  void SaveChunkEnd(uint16_t chunk);
+  // Make all saved chunk data durable, and mark the chunks complete
+  void FlushChunks();
+  // Returns true if chunk is complete, or saved and waiting to be marked
+  // complete
+  bool ChunkSaved(uint16_t chunk);
   // buffers that are never used simutaneously
   union {
     uint8_t packet[32];
@@ -26,19 +51,55 @@ protected:
   // TODO rename to radio
   RF24 &_radio;
   FatFile &chunkFile;
-  MerkleFile m;
-  ChunkQueue missing;
+  MerkleFile &m;
+  ChunkSet missing;
   uint16_t treeDepth;
   uint16_t chunkSize;
   uint16_t numChunks;
   uint16_t lastScanned;
+  // chunks saved but not yet durable, and so not yet marked complete
+  uint16_t pending[SAVE_BATCH];
+  uint8_t numPending;
   // the merkle tree root of the file currently being received
   uint8_t rootHash[32];
+  // Wait for the radio to finish sending queued packets, then begin listening
+  void startListening();
   bool receivePacket(uint8_t *packet, const uint16_t timeout);
   void receiveMultipart(MultipartCombiner<32> &mpc, const uint16_t timeout);
-  void broadcastMultipart(MultipartSplitter<32> &mps);
-  void scanMissingChunks();
+  // Splitter is a MultipartSplitter<32> or MultipartStreamSplitter<32, ...>.
+  // The message is counted in Air as category, useful bytes of it as chunk
+  // contents.
+  template <class Splitter>
+  void broadcastMultipart(Splitter &mps, AirCategory_t category,
+                          uint16_t useful = 0);
+  // Rebuild missing from the merkle file's chunk complete flags. If more
+  // chunks are missing than fit in missing, the next update continues where
+  // this one stopped.
+  void updateMissing();
 };
+
+template <class Splitter>
+void TransceiverBase::broadcastMultipart(Splitter &mps, AirCategory_t category,
+                                         uint16_t useful) {
+  uint16_t packets = 0;
+  while (mps.More()) {
+    mps.Get(this->packet);
+    if (mps.Error) {
+      this->Error = mps.Error;
+      Air.Sent(category, packets, 0);
+      return;
+    }
+    // queue the packet in the radio's TX FIFO without waiting for it to be
+    // sent. writeFast only blocks while the FIFO is full, so the next part is
+    // prepared (and read from SD) while the radio is still sending.
+    for (uint8_t i = 0; i < RETRANSMITS; i++) {
+      this->_radio.writeFast(this->packet, 32, true);
+    }
+    Metrics.counters[METRIC_PACKETS_TX] += RETRANSMITS;
+    packets++;
+  }
+  Air.Sent(category, packets, useful);
+}
 }
 
 #endif // TRANSCEIVER_H
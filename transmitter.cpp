@@ -3,73 +3,218 @@
 #include "transmitter.h"
 #include "stackmon.h"
 #include "power.h"
+#include "radiorx.h"
+#include "util.h"
 
 namespace PDP {
 
-Transmitter::Transmitter(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile)
-    : TransceiverBase(radio, fs, chunkFile), HeardRequest(false),
-      yieldRxStationId(0){};
+Transmitter::Transmitter(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile,
+                         MerkleFile &m)
+    : TransceiverBase(radio, fs, chunkFile, m), HeardRequest(false),
+      TxMillis(0), ListenMillis(0), HandoffMillis(0), RequestsHeard(0),
+      RequestsDropped(0), _fs(fs), yieldRxStationId(0), listenInterval(1),
+      sinceListen(0), listenDuration(REQ_CONTENTION_SLOTS * REQ_SLOT_DURATION),
+      requestsHeard(0), numStations(0), numSlots(0), slotNext(0){};
 
 void Transmitter::Broadcast() {
-  uint8_t sinceHeard = 0;
-  uint16_t numChunks, i;
+  uint16_t i = 0;
   if (this->Error) {
     return;
   }
+  if (!this->channelQuiet()) {
+    return;
+  }
+  this->schedule.Reset(this->numChunks, this->chunkSize);
+  this->broadcastSteps(i, this->schedule.SweepLength(), 10);
+}
+
+void Transmitter::TakeOver() {
+  uint16_t i = 0;
+  if (this->Error) {
+    return;
+  }
+  // the previous TX station has just handed over the channel, so there is no
+  // need to check it is quiet
+  this->schedule.Reset(this->numChunks, this->chunkSize);
+  this->broadcastSteps(i, this->schedule.SweepLength(), 10);
+}
+
+void Transmitter::Carousel(FatFile &dir) {
+  struct {
+    // directory index of the file
+    uint16_t index;
+    // next step of the file's background sweep
+    uint16_t sweepPos;
+    // the file is given CAROUSEL_SLICE << demand steps in each round
+    uint8_t demand;
+    // the file has been swept at least once
+    bool swept;
+  } files[CAROUSEL_FILES];
+  uint8_t numFiles = 0, k;
+  bool heard, swept, wrapped = false;
+  if (this->Error) {
+    return;
+  }
+  // list the files to broadcast, continuing from dir's current position so
+  // the next session picks up where this one stopped
+  while (numFiles < CAROUSEL_FILES) {
+    if (!this->chunkFile.openNext(&dir, O_READ)) {
+      if (wrapped) {
+        break;
+      }
+      dir.rewind();
+      wrapped = true;
+      continue;
+    }
+    if (numFiles > 0 && this->chunkFile.dirIndex() == files[0].index) {
+      // every file in dir is listed
+      this->chunkFile.close();
+      break;
+    }
+    this->chunkFile.getName(this->filename, MAX_FILENAME_LENGTH + 1);
+    if (this->chunkFile.isFile() && !IsMerkleFilename(this->filename)) {
+      files[numFiles].index = this->chunkFile.dirIndex();
+      files[numFiles].sweepPos = 0;
+      files[numFiles].demand = 0;
+      files[numFiles].swept = false;
+      numFiles++;
+    }
+    this->chunkFile.close();
+  }
+  if (numFiles == 0 || !this->channelQuiet()) {
+    return;
+  }
+  // give each file a slice of steps in turn, until every file has been swept
+  // once and a whole round passes with no requests heard
+  do {
+    heard = false;
+    swept = true;
+    for (k = 0; k < numFiles; k++) {
+      // opened for writing too, as the file is received into if the channel
+      // is yielded before it is complete
+      if (!this->chunkFile.open(&dir, files[k].index, O_RDWR)) {
+        this->Error = ERROR_IO_OPEN;
+        return;
+      }
+      // switch files without listening for interference again, so the
+      // channel is never left idle between files
+      this->openMerkle(this->_fs);
+      if (this->Error == ERROR_MERKLE_INCOMPLETE) {
+        // not indexed yet, leave it for a later session
+        this->Error = ERROR_NONE;
+        files[k].swept = true;
+        this->chunkFile.close();
+        continue;
+      }
+      if (this->Error) {
+        return;
+      }
+      Serial.print(F("TX "));
+      Serial.println(this->filename);
+      this->schedule.Reset(this->numChunks, this->chunkSize);
+      this->requestsHeard = 0;
+      if (!this->broadcastSteps(files[k].sweepPos,
+                                CAROUSEL_SLICE << files[k].demand, 0xff)) {
+        // error, shutdown or channel yielded. on yield, chunkFile stays open
+        // as the file to receive.
+        return;
+      }
+      this->m.Close();
+      if (files[k].sweepPos >= this->schedule.SweepLength()) {
+        files[k].sweepPos = 0;
+        files[k].swept = true;
+      }
+      swept = swept && files[k].swept;
+      // files with requests get longer slices
+      if (this->requestsHeard > 0) {
+        heard = true;
+        if (files[k].demand < CAROUSEL_DEMAND_MAX) {
+          files[k].demand++;
+        }
+      } else if (files[k].demand > 0) {
+        files[k].demand--;
+      }
+      this->chunkFile.close();
+    }
+  } while (heard || !swept);
+}
+
+bool Transmitter::channelQuiet() {
   uint16_t interference; // TODO remove
   if ((interference = this->ListenForInterference(1000)) > 3) {
     // channel interference detected
     this->Error = ERROR_TX_INTERFERENCE;
+    MetricInc(METRIC_INTERFERENCE);
     Serial.println(F("channel not quiet"));
     Serial.println(interference);
-    return;
+    return false;
   }
   this->_radio.stopListening();
-  // broadcast hash chains
-  m.ReadHeaderBlock();
-  numChunks = m.Block.HeaderBlock.numChunks;
-  for (i = 0; i < numChunks; i++) {
-    while (this->transmit.Length() > 0) {
-      uint16_t ch = this->transmit.Pop();
-      if (ch > numChunks) {
-        // invalid chunk index
-        continue;
-      }
-      this->m.ReadHashBlock(ch);
-      uint8_t flags = this->m.Block.HashBlock.flags;
-      if (flags != (MERKLE_CHUNK_COMPLETE | MERKLE_HASH_KNOWN)) {
-        this->missing.Push(ch);
-      }
-      Serial.println(ch);
-      if (flags & MERKLE_HASH_KNOWN) {
-        Serial.println(F("Chain"));
-        this->broadcastHashChain(ch);
-        if (flags & MERKLE_CHUNK_COMPLETE) {
-          Serial.println(F("chunk"));
-          this->broadcastDataChunk(ch);
-        }
-        if (this->ListenForInterference(100) > 3) {
-          // channel interference detected
-          this->Error = ERROR_TX_INTERFERENCE;
-          return;
-        }
-      }
-      CheckPowerSwitch();
-      if (FlagShutdown) {
-        return;
+  return true;
+}
+
+// sort the n chunk indices in chunks in increasing order
+static void sortChunks(uint16_t *chunks, uint8_t n) {
+  uint8_t i, j;
+  uint16_t t;
+  for (i = 1; i < n; i++) {
+    for (j = i; j > 0 && chunks[j] < chunks[j - 1]; j--) {
+      t = chunks[j];
+      chunks[j] = chunks[j - 1];
+      chunks[j - 1] = t;
+    }
+  }
+}
+
+bool Transmitter::broadcastSteps(uint16_t &i, uint16_t steps,
+                                 uint8_t maxQuiet) {
+  uint8_t sinceHeard = 0, n, stepped, heard;
+  uint16_t end, ch, chunks[SCHED_BURST], length = this->schedule.SweepLength();
+  end = (steps < length - i) ? i + steps : length;
+  while (i < end) {
+    // requested chunks first, the most wanted first
+    for (n = 0; n < SCHED_BURST && this->schedule.NextRequested(chunks[n]);
+         n++)
+      ;
+    // the burst's chunks are picked from several ranges in turn. sent in file
+    // order, chunks of the same sector are read from it while it is cached.
+    sortChunks(chunks, n);
+    this->broadcastChunks(chunks, n);
+    if (this->Error || FlagShutdown) {
+      return false;
+    }
+    // then the rest of the current run of the background sweep, except the
+    // chunks just sent on request
+    stepped = n;
+    n = 0;
+    do {
+      ch = this->schedule.Sweep(i);
+      if (ch < this->numChunks && !this->schedule.RecentlySent(ch)) {
+        chunks[n++] = ch;
       }
+      stepped++;
+    } while (++i < end && i % this->schedule.RunLength());
+    this->broadcastChunks(chunks, n);
+    if (this->Error || FlagShutdown) {
+      return false;
+    }
+    if ((this->sinceListen += stepped) < this->listenInterval) {
+      // not time to listen yet
+      continue;
     }
-    this->transmit.Push(i);
     // signal intention to listen
     this->broadcastListenForReqs();
     // enter listen period
-    if (this->listenForRequests()) {
+    heard = this->listenForRequests();
+    this->updateListenCadence(heard);
+    if (heard) {
       sinceHeard = 0;
       this->HeardRequest = true;
+      this->requestsHeard += heard;
       if (this->yieldRxStationId > 0 && this->missing.Length() > 0) {
         // there are missing pieces and a station is requesting channel yield
         // TODO decide if yield should be granted
-        if (i > (numChunks >> 2)) {
+        if (i > (this->numChunks >> 2)) {
           this->YieldState = YIELD_GRANTED;
         }
       }
@@ -77,69 +222,215 @@ void Transmitter::Broadcast() {
       sinceHeard++;
       // TODO hack. some better logic is needed here
       // end transmission if no requests have been heard in a while
-      if (sinceHeard > 10) {
-        return;
+      if (sinceHeard > maxQuiet) {
+        return false;
       }
     }
     this->m.ReadRootHashBlock();
     if (!(this->m.Block.HashBlock.flags & MERKLE_CHUNK_COMPLETE)) {
-      // at least one chunk missing, scan
-      this->scanMissingChunks();
+      // at least one chunk missing, list them for the next listen period
+      this->updateMissing();
     }
     if (this->YieldState == YIELD_GRANTED) {
-      MultipartHeader *header = (MultipartHeader *)this->packet;
-      // TODO move to its own method? doChannelYield?
-      for (uint8_t yieldTries = 0; yieldTries < 5; yieldTries++) {
-        this->broadcastListenForReqs();
-        this->_radio.startListening();
-        while (this->receivePacket(this->packet, 1000)) {
-          // TODO if we don't get a SEQ_CHAIN_START, but keep getting packets,
-          // we'll be stuck here forever
-          if (header->sequenceNum == SEQ_CHAIN_START) {
-            // another station is now broadcasting, channel yield successful
-            return;
-          }
-        }
-        // other station has not started broadcasting, retry yield
-        this->_radio.stopListening();
+      if (this->doChannelYield()) {
+        // another station now owns the channel
+        MetricInc(METRIC_YIELDS_GIVEN);
+        MetricTime(HIST_HANDOFF, this->HandoffMillis);
+        return false;
       }
       // channel yield failed
       this->YieldState = YIELD_NONE;
     }
   }
+  return true;
+}
+
+bool Transmitter::doChannelYield() {
+  YieldAckMessage ack;
+  MultipartHeader *header = (MultipartHeader *)this->packet;
+  unsigned long startTime = millis(), listenStart, deadline;
+  int32_t remaining;
+  for (uint8_t tries = 0; tries < YIELD_TRIES; tries++) {
+    // offer the channel
+    this->broadcastListenForReqs();
+    this->startListening();
+    listenStart = millis();
+    deadline = listenStart + YIELD_ACK_TIMEOUT;
+    while ((remaining = (int32_t)(deadline - millis())) > 0 &&
+           this->receivePacket(this->packet, remaining)) {
+      if (header->sequenceNum == SEQ_CHAIN_START) {
+        // the acknowledgement was lost, but the other station is already
+        // broadcasting
+        this->HandoffMillis = millis() - startTime;
+        Air.Waited(AIR_LISTEN, millis() - listenStart);
+        return true;
+      }
+      if (header->sequenceNum != SEQ_YIELD_ACK ||
+          header->messageLength != sizeof(ack.Message)) {
+        continue;
+      }
+      MultipartCombiner<32> mc(&ack.Message, sizeof(ack.Message),
+                               SEQ_YIELD_ACK);
+      mc.Put(this->packet);
+      if (!mc.Error && !mc.More() &&
+          ack.Message.stationId == this->yieldRxStationId &&
+          !memcmp(ack.Message.rootHash, this->rootHash, YIELD_ACK_HASH_LEN)) {
+        // accepted, the other station begins broadcasting now
+        this->HandoffMillis = millis() - startTime;
+        Air.Waited(AIR_LISTEN, millis() - listenStart);
+        return true;
+      }
+    }
+    // no answer, offer again
+    Air.Waited(AIR_LISTEN, millis() - listenStart);
+    this->_radio.stopListening();
+  }
+  return false;
+}
+
+void Transmitter::broadcastChunks(uint16_t *chunks, uint8_t n) {
+  uint8_t i, flags, complete = 0, sent = 0;
+  unsigned long startTime = millis();
+  if (n == 0) {
+    return;
+  }
+  // hash chains first, then the data of the complete chunks. the data is
+  // read without merkle file reads in between, so consecutive chunks share
+  // the SD card sectors already read.
+  for (i = 0; i < n; i++) {
+    this->m.ReadHashBlock(chunks[i]);
+    flags = this->m.Block.HashBlock.flags;
+    Serial.println(chunks[i]);
+    if (!(flags & MERKLE_HASH_KNOWN)) {
+      continue;
+    }
+    Serial.println(F("Chain"));
+    this->broadcastHashChain(chunks[i]);
+    sent++;
+    if (flags & MERKLE_CHUNK_COMPLETE) {
+      complete |= 1 << i;
+    }
+    this->schedule.Sent(chunks[i]);
+  }
+  for (i = 0; i < n && !this->Error; i++) {
+    if (complete & (1 << i)) {
+      Serial.println(F("chunk"));
+      this->broadcastDataChunk(chunks[i]);
+    }
+  }
+  this->TxMillis += millis() - startTime;
+  if (sent == 0) {
+    // none of the chunks is known here, so there was no burst to check after.
+    // a station that has just taken over the channel gets to its first known
+    // chunk without pausing.
+    return;
+  }
+  if (this->ListenForInterference(CARRIER_CHECK_TIME) > 3) {
+    // channel interference detected
+    this->Error = ERROR_TX_INTERFERENCE;
+    MetricInc(METRIC_INTERFERENCE);
+    return;
+  }
+  CheckPowerSwitch();
 }
 
 void Transmitter::broadcastHashChain(uint16_t chunk) {
-  HashChainMessage msg;
-  m.Load(msg, chunk);
-  this->chunkFile.getName(msg.Message.Header.filename, MAX_FILENAME_LENGTH + 1);
-  MultipartSplitter<32> mp(&msg.Message, msg.Message.Header.messageLength,
-                           SEQ_CHAIN_START, chunk);
-  this->broadcastMultipart(mp);
+  HashChainHeader header;
+  m.LoadHeader(header, chunk);
+  this->chunkFile.getName(header.filename, MAX_FILENAME_LENGTH + 1);
+  // the chain is read from the merkle file as each packet is sent
+  HashChainReader chain(this->m, chunk, header.treeDepth);
+  MultipartStreamSplitter<32, HashChainReader> mp(
+      &header, sizeof(header), chain, header.messageLength, SEQ_CHAIN_START,
+      chunk);
+  this->broadcastMultipart(mp, AIR_CHAIN);
 }
 
 void Transmitter::broadcastDataChunk(uint16_t chunk) {
-  DataChunkMessage msg;
+  DataChunkHeader header;
 #ifdef DEBUG_VERIFY_TX
-  memset(msg.Message.chunk, 0xAA, MAX_CHUNK_SIZE);
+  {
+    DataChunkMessage msg;
+    memset(msg.Message.chunk, 0xAA, MAX_CHUNK_SIZE);
+    this->m.ReadRootHashBlock();
+    msg.SetRootHash(m.Block.HashBlock.hash);
+    this->LoadChunk(msg, chunk);
+    if (!this->m.Verify(msg)) {
+      Serial.println(StackCount());
+      Serial.println(this->Error);
+      Serial.println(F("Tried to transmit bad data. Halt."));
+      while (1)
+        ;
+    } else {
+      Serial.println(F("Data ok!"));
+    }
+  }
 #endif
-  this->m.ReadRootHashBlock();
-  msg.SetRootHash(m.Block.HashBlock.hash);
-  this->LoadChunk(msg, chunk);
-#ifdef DEBUG_VERIFY_TX
-  if (!this->m.Verify(msg)) {
-    Serial.println(StackCount());
-    Serial.println(this->Error);
-    Serial.println(F("Tried to transmit bad data. Halt."));
-    while (1)
-      ;
+  memcpy(header.rootHash, this->rootHash, 32);
+  this->LoadChunkHeader(header, chunk);
+  if (this->Error) {
+    return;
+  }
+  // chunk contents are read from chunkFile directly into each packet
+  MultipartStreamSplitter<32, FatFile> mp(&header, sizeof(header),
+                                          this->chunkFile,
+                                          header.messageLength,
+                                          SEQ_CHUNK_START, chunk);
+  this->broadcastMultipart(mp, AIR_CHUNK_OTHER, header.chunkSize);
+}
+
+void Transmitter::updateListenCadence(uint8_t heard) {
+  uint8_t i, j;
+  this->sinceListen = 0;
+  if (heard) {
+    // stations are asking, listen after every chunk
+    this->listenInterval = 1;
   } else {
-    Serial.println(F("Data ok!"));
+    // quiet, back off. the interval is bounded so a new station waits at most
+    // LISTEN_INTERVAL_MAX chunks to be heard
+    if (this->listenInterval < LISTEN_INTERVAL_MAX) {
+      this->listenInterval <<= 1;
+    }
   }
-#endif
-  MultipartSplitter<32> mp(&msg.Message, msg.Message.Header.messageLength,
-                           SEQ_CHUNK_START, chunk);
-  this->broadcastMultipart(mp);
+  // move on to the stations after those that just had slots, dropping the
+  // stations that have stopped asking
+  if (this->numStations > 0) {
+    this->slotNext = (this->slotNext + this->numSlots) % this->numStations;
+  }
+  for (i = 0, j = 0; i < this->numStations; i++) {
+    if (this->stations[i].idle < REQ_SLOT_EXPIRY) {
+      this->stations[j++] = this->stations[i];
+    } else if (i < this->slotNext) {
+      this->slotNext--;
+    }
+  }
+  this->numStations = j;
+  if (this->slotNext >= this->numStations) {
+    this->slotNext = 0;
+  }
+  this->numSlots = j < REQ_SLOTS ? j : REQ_SLOTS;
+  // listen for long enough to give each of them its slot
+  this->listenDuration =
+      (REQ_CONTENTION_SLOTS + this->numSlots) * REQ_SLOT_DURATION;
+}
+
+void Transmitter::slotHeard(uint16_t stationId) {
+  uint8_t i, oldest = 0;
+  for (i = 0; i < this->numStations; i++) {
+    if (this->stations[i].stationId == stationId) {
+      this->stations[i].idle = 0;
+      return;
+    }
+    if (this->stations[i].idle > this->stations[oldest].idle) {
+      oldest = i;
+    }
+  }
+  // a new station, it has a slot when its turn comes
+  if (this->numStations < REQ_STATIONS) {
+    oldest = this->numStations++;
+  }
+  this->stations[oldest].stationId = stationId;
+  this->stations[oldest].idle = 0;
 }
 
 void Transmitter::broadcastListenForReqs() {
@@ -152,38 +443,53 @@ void Transmitter::broadcastListenForReqs() {
     Serial.println(this->yieldRxStationId);
     msg.Message.yieldToRxId = this->yieldRxStationId;
   } else {
-    msg.Message.listenDuration = LISTEN_DURATION;
+    msg.Message.listenDuration = this->listenDuration;
+    msg.Message.slotDuration = REQ_SLOT_DURATION;
+    msg.Message.contentionSlots = REQ_CONTENTION_SLOTS;
+    msg.Message.numSlots = this->numSlots;
+    for (uint8_t i = 0, s = this->slotNext; i < this->numSlots; i++) {
+      msg.Message.slots[i] = this->stations[s].stationId;
+      this->stations[s].idle++;
+      if (++s == this->numStations) {
+        s = 0;
+      }
+    }
     msg.Message.yieldToRxId = 0;
   }
   MultipartSplitter<32> mp(&msg.Message, msg.Message.messageLength,
                            SEQ_TAKING_REQS, SEQ_TAKING_REQS);
-  this->broadcastMultipart(mp);
+  unsigned long startTime = millis();
+  this->broadcastMultipart(mp, AIR_CONTROL);
+  this->TxMillis += millis() - startTime;
 }
 
-bool Transmitter::listenForRequests() {
+uint8_t Transmitter::listenForRequests() {
   unsigned long startTime;
-  uint16_t remaining;
-  bool heard = false;
+  uint16_t remaining, first, count;
+  uint8_t heard = 0;
   ReqMessage msg;
   MultipartHeader *header = (MultipartHeader *)this->packet;
   m.ReadRootHashBlock();
-  this->_radio.startListening();
+  this->startListening();
   startTime = millis();
   // TODO millis overflow?
-  while (millis() - startTime < LISTEN_DURATION) {
-    remaining = LISTEN_DURATION - (millis() - startTime);
+  while (millis() - startTime < this->listenDuration) {
+    remaining = this->listenDuration - (millis() - startTime);
     if (this->receivePacket(this->packet, remaining)) {
       if (header->sequenceNum == SEQ_MAKING_REQ) {
         // receiving a request
         if (header->messageLength > sizeof(msg.Message)) {
           // message too long, reject
+          MetricInc(METRIC_DROP_INVALID);
           continue;
         }
         MultipartCombiner<32> mpc(&msg.Message, header->messageLength,
                                   SEQ_MAKING_REQ);
+        mpc.Put(this->packet);
         this->receiveMultipart(mpc, remaining);
         if (mpc.Error) {
           // dropped packet or timeout, reject
+          this->RequestsDropped++;
           continue;
         }
         if (!msg.Verify()) {
@@ -195,26 +501,35 @@ bool Transmitter::listenForRequests() {
           continue;
         }
         Serial.println(F("REQ RX"));
+        this->RequestsHeard++;
+        MetricInc(METRIC_REQUESTS_HEARD);
+        this->slotHeard(msg.Message.stationId);
         if (msg.Message.yieldRequest > 0) {
           // an RX station is requesting the channel
           this->yieldRxStationId = msg.Message.yieldRequest;
         }
         // request received ok
-        // chunk numbers are validated on transmit
-        this->transmit.Push(msg.Message.q);
-        heard = true;
+        // chunk numbers are validated by the scheduler
+        while (msg.Message.q.PopRange(first, count)) {
+          this->schedule.Request(first, count, msg.Message.stationId);
+        }
+        if (heard < 0xff) {
+          heard++;
+        }
       }
     }
   }
   this->_radio.stopListening();
+  this->ListenMillis += millis() - startTime;
+  Air.Waited(AIR_LISTEN, millis() - startTime);
   return heard;
 }
 
 uint8_t Transmitter::ListenForInterference(uint16_t duration) {
   uint8_t ret = 0;
-  unsigned long timeoutAt = millis() + duration;
+  unsigned long startTime = millis(), timeoutAt = startTime + duration;
   while (millis() < timeoutAt) {
-    this->_radio.startListening();
+    this->startListening();
     delay(10);
     this->_radio.stopListening();
     if (this->_radio.testCarrier()) {
@@ -224,11 +539,14 @@ uint8_t Transmitter::ListenForInterference(uint16_t duration) {
       }
     }
     // clear any received packet
-    if (this->_radio.available()) {
+    RadioRxPoll(this->_radio);
+    if (RxRing.Length() > 0) {
       Serial.println(F("flushed packet!"));
-      this->_radio.read(this->packet, 32);
+      RxRing.Clear();
     }
   }
+  this->ListenMillis += millis() - startTime;
+  Air.Waited(AIR_CARRIER, millis() - startTime);
   return ret;
 }
 
@@ -4,14 +4,17 @@
 #include "RF24.h"
 #include "SdFat.h"
 #include "merkle.h"
+#include "scheduler.h"
 #include "transceiver.h"
 
 namespace PDP {
 
 class Transmitter : public TransceiverBase {
 public:
-  // chunkFile must be the opened file to be transmit.
-  Transmitter(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile);
+  // chunkFile must be the opened file to be transmit. m is its merkle file,
+  // opened if it is not already open.
+  Transmitter(RF24 &radio, FatFileSystem &fs, FatFile &chunkFile,
+              MerkleFile &m);
   // Broadcast the hash chains and file chunks.
   //
   // Returns with ERROR_NONE and YIELD_NONE after the file has been broadcast at
@@ -27,19 +30,77 @@ public:
   // channel
   // (driver: new channel, keep file, broadcast again)
   void Broadcast();
+  // Broadcast up to CAROUSEL_FILES files in dir in one session, switching
+  // between them without giving up the channel. Each file is given a slice of
+  // the broadcast in turn, and files that are requested get longer slices.
+  //
+  // Returns as Broadcast does, once every file has been broadcast at least
+  // once and a whole round of slices passes with no requests heard. chunkFile
+  // is closed, unless the channel was yielded, in which case it is the file
+  // to receive.
+  void Carousel(FatFile &dir);
+  // Broadcast chunkFile straight after the channel was yielded to this
+  // station, without first listening for interference. Returns as Broadcast
+  // does.
+  void TakeOver();
   // at least one valid request was received during broadcast
   bool HeardRequest;
+  // milliseconds spent transmitting, and listening for requests or
+  // interference
+  uint32_t TxMillis, ListenMillis;
+  // milliseconds from first offering a channel yield to the RX station
+  // accepting it
+  uint16_t HandoffMillis;
+  // number of requests received, and lost part way through
+  uint16_t RequestsHeard, RequestsDropped;
 
   uint8_t ListenForInterference(uint16_t duration);
 
 private:
+  FatFileSystem &_fs;
   // Station ID of most recent RX station requesting channel yield
   uint16_t yieldRxStationId;
-  ChunkQueue transmit;
+  // decides which chunk to send next
+  ChunkScheduler schedule;
+  // broadcast the hash chains of the n chunks, then the data of those that
+  // are complete. n is at most 8.
+  void broadcastChunks(uint16_t *chunks, uint8_t n);
   void broadcastHashChain(uint16_t chunk);
   void broadcastDataChunk(uint16_t chunk);
+  // chunks to send between listen periods, and chunks sent since the last
+  uint8_t listenInterval, sinceListen;
+  // length of the next listen period in milliseconds
+  uint16_t listenDuration;
+  // number of requests heard since last reset by Carousel
+  uint16_t requestsHeard;
+  // RX stations heard from recently, which take turns at the request slots
+  struct {
+    uint16_t stationId;
+    // number of slots given to the station since it was heard
+    uint8_t idle;
+  } stations[REQ_STATIONS];
+  uint8_t numStations;
+  // the next listen period gives slots to numSlots stations, from
+  // stations[slotNext] on
+  uint8_t numSlots, slotNext;
+  // Record a request from stationId, adding it to stations if it is not there
+  void slotHeard(uint16_t stationId);
+  // Listen for interference, setting Error if the channel is busy
+  bool channelQuiet();
+  // Broadcast the open file, starting at step i of the background sweep,
+  // until steps steps have been taken or the sweep is complete. Returns false
+  // on error, shutdown, channel yield, or when no requests are heard in more
+  // than maxQuiet listen periods.
+  bool broadcastSteps(uint16_t &i, uint16_t steps, uint8_t maxQuiet);
+  // Offer the channel to yieldRxStationId until it accepts. Returns false if
+  // it does not accept.
+  bool doChannelYield();
+  // adapt listen interval to the number of requests heard, and the listen
+  // duration to the number of slots
+  void updateListenCadence(uint8_t heard);
   void broadcastListenForReqs();
-  bool listenForRequests();
+  // returns the number of valid requests heard
+  uint8_t listenForRequests();
 };
 
 } // namespace PDP
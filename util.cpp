@@ -2,6 +2,7 @@
 #include "SdFat.h"
 #include "usha256.h"
 
+#include "channels.h"
 #include "util.h"
 
 namespace PDP {
@@ -19,8 +20,8 @@ void PrintHash(uint8_t *hash) {
 }
 
 // Collect entropy from the filesystem, radio, and analog pin, and use it
-// to seed the PRNG.
-void CollectEntropy(SdSpiCard *card, RF24 &radio) {
+// to seed the PRNG. The channel scan is also recorded in channels.
+void CollectEntropy(SdSpiCard *card, RF24 &radio, ChannelTable &channels) {
   uint8_t buf[512];
   Sha256Context ctx;
   sha256_init(&ctx);
@@ -38,11 +39,12 @@ void CollectEntropy(SdSpiCard *card, RF24 &radio) {
       // clear any received packet
       // TODO experiment
       if (radio.available()) {
-        radio.read(buf, 32);
+        radio.read(buf + 256, 32);
       }
       radio.stopListening();
       buf[ch] += radio.testCarrier() ? 0 : 1;
     }
+    channels.SampleBusy(ch, 10 - buf[ch], 10);
   }
   sha256_update(&ctx, buf, 128);
   // read A5, an unconnected analog pin, and hash the results
@@ -66,17 +68,32 @@ Error_t OpenFile(FatFileSystem &fs, const char *filename, FatFile &f,
   return ERROR_NONE;
 }
 
-// Create a filename on fs of size filesize, filled with 0's, with
-// its opened handle in f
+// Returns true if filename ends in the merkle file extension "mkl"
+bool IsMerkleFilename(const char *filename) {
+  uint8_t len = strlen(filename);
+  return len >= 3 && !strcmp(filename + len - 3, "mkl");
+}
+
+// Create a filename on fs of size filesize, with its opened handle in f. The
+// file's clusters are reserved but not written, so its contents are whatever
+// was on the card before unless zero is true.
 Error_t Create(FatFileSystem &fs, FatFile &f, char *filename,
-               uint32_t filesize) {
+               uint32_t filesize, bool zero) {
   uint8_t buf[32];
   if (fs.exists(filename)) {
     // refuse to overwrite
     return ERROR_IO_ALREADY_EXISTS;
   }
-  if (OpenFile(fs, filename, f, O_CREAT | O_TRUNC | O_RDWR)) {
-    return ERROR_IO_OPEN;
+  if (filesize > 0 && f.createContiguous(fs.vwd(), filename, filesize)) {
+    if (!zero) {
+      return ERROR_NONE;
+    }
+  } else {
+    // no free run of clusters long enough, grow the file by writing it
+    f.close();
+    if (OpenFile(fs, filename, f, O_CREAT | O_TRUNC | O_RDWR)) {
+      return ERROR_IO_OPEN;
+    }
   }
   memset(buf, 0, 32);
   while (filesize > 0) {
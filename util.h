@@ -5,15 +5,19 @@
 
 namespace PDP {
 
+class ChannelTable;
+
 void PrintHash(uint8_t *hash);
-void CollectEntropy(SdSpiCard *card, RF24 &radio);
+void CollectEntropy(SdSpiCard *card, RF24 &radio, ChannelTable &channels);
 
 // TODO make the argument order on these two the same
 Error_t Create(FatFileSystem &fs, FatFile &f, char *filename,
-               uint32_t filesize);
+               uint32_t filesize, bool zero = false);
 Error_t OpenFile(FatFileSystem &fs, const char *filename, FatFile &f,
                  uint8_t flag);
 void ToMerkleFilename(char *dataFilename);
+// Returns true if filename has the merkle file extension
+bool IsMerkleFilename(const char *filename);
 
 } // namespace PDP
 